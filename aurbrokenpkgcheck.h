@@ -0,0 +1,262 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2017 Philipp Richter
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * libaurbrokenpkgcheck, the checks of aurbrokenpkgcheck for programs like AUR helpers,
+ * the command line is built on it too
+ * A context keeps the parsed ELF files from check to check, so checking again
+ * after a transaction only reads the files that changed
+ * A context is used by one thread at a time, aurbrokenpkgcheck_cancel() excepted,
+ * different contexts may run at the same time, all the state is in the context
+ * Errors are printed on the error output
+ */
+
+#ifndef AURBROKENPKGCHECK_H
+#define AURBROKENPKGCHECK_H
+
+#include <alpm.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* MACROS */
+#define AURBROKENPKGCHECK_EXPORT __attribute__((visibility("default")))
+/* flags of aurbrokenpkgcheck_new() */
+#define AURBROKENPKGCHECK_SYMBOLS 1
+#define AURBROKENPKGCHECK_NO_CACHE 2
+#define AURBROKENPKGCHECK_REBUILD_CACHE 4
+#define AURBROKENPKGCHECK_VERIFY_WITH_LD 8
+#define AURBROKENPKGCHECK_IO_URING 16
+#define AURBROKENPKGCHECK_LOW_IMPACT 32
+#define AURBROKENPKGCHECK_STATS 64
+#define AURBROKENPKGCHECK_FILES_DATABASES 128
+/* formats of aurbrokenpkgcheck_report() */
+#define AURBROKENPKGCHECK_FORMAT_TREE 0
+#define AURBROKENPKGCHECK_FORMAT_NDJSON 1
+/* the pacman configuration used when none is given */
+#define AURBROKENPKGCHECK_PACMAN_CONF "/etc/pacman.conf"
+/* MACROS */
+
+/* STRUCTURES */
+
+/* The opaque context of the checks */
+struct aurbrokenpkgcheck_t;
+
+/* A library or a symbol a file can't get */
+struct aurbrokenpkgcheck_problem_t {
+	/* the library or the symbol */
+	const char *name;
+	/* what the dynamic loader would say about it */
+	const char *message;
+};
+
+/* A broken file, it is only valid during the callback */
+struct aurbrokenpkgcheck_file_t {
+	/* the package owning the file */
+	const char *package;
+	/* the file inside the root, without a leading '/' like in the alpm filelist */
+	const char *name;
+	/* the problems of the file */
+	const struct aurbrokenpkgcheck_problem_t *problems;
+	/* number of problems */
+	size_t problems_count;
+};
+
+/* Called for every broken file, in the order of the packages, data is the one given to the check */
+typedef void (*aurbrokenpkgcheck_callback_t)(const struct aurbrokenpkgcheck_file_t *file, void *data);
+
+/* Selects the installed packages to check instead of the foreign ones */
+struct aurbrokenpkgcheck_filter_t {
+	/* flag set if every installed package is checked, else only the foreign ones */
+	int all;
+	/* the repositories, a package belongs to the first sync database knowing it */
+	const char **repos;
+	/* number of repos, 0 for any repository */
+	size_t repos_count;
+	/* the shell patterns, a package name must match one of them */
+	const char **globs;
+	/* number of globs, 0 for any name */
+	size_t globs_count;
+};
+
+/* STRUCTURES */
+
+/*
+ * Creates an alpm handle from a pacman configuration, with its architectures
+ * and its sync databases registered
+ * root_path and db_path override the ones of the configuration if not NULL
+ * Returns NULL on error, the handle is released with alpm_release()
+ */
+AURBROKENPKGCHECK_EXPORT alpm_handle_t *aurbrokenpkgcheck_initialize(
+	const char *config,
+	const char *root_path,
+	const char *db_path);
+
+/*
+ * Creates a context checking the packages of handle, which stays owned by the caller
+ * and must outlive the context, or of the root of aurbrokenpkgcheck_open() if it is NULL
+ * jobs is the number of worker threads, 0 for one per online CPU
+ * flags is a combination of
+ *   AURBROKENPKGCHECK_SYMBOLS: the versioned symbols are checked too
+ *   AURBROKENPKGCHECK_NO_CACHE: the verdicts kept under $XDG_CACHE_HOME are
+ *     neither read nor written, without it every check reads them and writes
+ *     them back, a check of a few packages keeps the verdicts of the others
+ *   AURBROKENPKGCHECK_REBUILD_CACHE: the verdicts are written but not read
+ *   AURBROKENPKGCHECK_VERIFY_WITH_LD: the dynamic loader confirms the broken files
+ *   AURBROKENPKGCHECK_IO_URING: the files are probed in batches with io_uring,
+ *     ignored with AURBROKENPKGCHECK_LOW_IMPACT
+ *   AURBROKENPKGCHECK_LOW_IMPACT: the process gets the idle IO priority, the
+ *     page cache is spared and the workers slow down under system pressure
+ *   AURBROKENPKGCHECK_STATS: every check prints its phases and system calls
+ *   AURBROKENPKGCHECK_FILES_DATABASES: aurbrokenpkgcheck_open() registers the
+ *     files databases of pacman -Fy, for aurbrokenpkgcheck_predict()
+ * Returns NULL on error
+ */
+AURBROKENPKGCHECK_EXPORT struct aurbrokenpkgcheck_t *aurbrokenpkgcheck_new(alpm_handle_t *handle, size_t jobs, int flags);
+
+/*
+ * Frees a context, no check may be running
+ */
+AURBROKENPKGCHECK_EXPORT void aurbrokenpkgcheck_free(struct aurbrokenpkgcheck_t *abc);
+
+/*
+ * Opens an alpm handle on a root like aurbrokenpkgcheck_initialize(), for the
+ * next checks, it replaces the handle of the context and is released with it
+ * config may be NULL for AURBROKENPKGCHECK_PACMAN_CONF
+ * Anything other than 0 returned is an error
+ */
+AURBROKENPKGCHECK_EXPORT int aurbrokenpkgcheck_open(
+	struct aurbrokenpkgcheck_t *abc,
+	const char *config,
+	const char *root_path,
+	const char *db_path);
+
+/*
+ * Gives the installation root and the database location used by the last
+ * aurbrokenpkgcheck_open(), they belong to the context until the next one
+ * Anything other than 0 returned means no root is open
+ */
+AURBROKENPKGCHECK_EXPORT int aurbrokenpkgcheck_paths(
+	const struct aurbrokenpkgcheck_t *abc,
+	const char **root_path,
+	const char **db_path);
+
+/*
+ * Selects the packages of the checks not given names, the foreign ones if filter is NULL
+ * Every selection keeps its own cache of verdicts
+ * filter must outlive its use by the context
+ */
+AURBROKENPKGCHECK_EXPORT void aurbrokenpkgcheck_select(struct aurbrokenpkgcheck_t *abc, const struct aurbrokenpkgcheck_filter_t *filter);
+
+/*
+ * Only checks the packages a transaction of count targets may have broken, the
+ * targets themselves and the packages needing a library they ship or one gone
+ * missing, as a pacman hook using NeedsTargets gets them
+ * The names are copied, targets NULL checks every package again
+ * Anything other than 0 returned is an error
+ */
+AURBROKENPKGCHECK_EXPORT int aurbrokenpkgcheck_targets(struct aurbrokenpkgcheck_t *abc, const char *const *targets, size_t count);
+
+/*
+ * Stops the checks after limit broken packages, 0 for no limit, the likely
+ * broken packages are checked first then
+ */
+AURBROKENPKGCHECK_EXPORT void aurbrokenpkgcheck_limit(struct aurbrokenpkgcheck_t *abc, size_t limit);
+
+/*
+ * Sets how the checks without a callback report the broken files, the package
+ * names go to the standard output and the problems to the error output
+ * format is AURBROKENPKGCHECK_FORMAT_TREE, the default, or
+ * AURBROKENPKGCHECK_FORMAT_NDJSON for one JSON record per broken file on the standard output
+ * colors, if set, colors the tree, label, if set, names the root in the reports
+ */
+AURBROKENPKGCHECK_EXPORT void aurbrokenpkgcheck_report(struct aurbrokenpkgcheck_t *abc, int format, int colors, int label);
+
+/*
+ * Writes the phases, packages and files of every check as Chrome trace events to filename
+ * Anything other than 0 returned is an error
+ */
+AURBROKENPKGCHECK_EXPORT int aurbrokenpkgcheck_trace(struct aurbrokenpkgcheck_t *abc, const char *filename);
+
+/*
+ * Lists the installed packages no sync database knows about, like pacman -Qm
+ * The names are sorted and belong to the handle, only the array needs to be freed
+ * Anything other than 0 returned is an error
+ */
+AURBROKENPKGCHECK_EXPORT int aurbrokenpkgcheck_foreign(struct aurbrokenpkgcheck_t *abc, const char ***names, size_t *count);
+
+/*
+ * Lists the packages aurbrokenpkgcheck_select() selected, like aurbrokenpkgcheck_foreign()
+ * Anything other than 0 returned is an error
+ */
+AURBROKENPKGCHECK_EXPORT int aurbrokenpkgcheck_packages(struct aurbrokenpkgcheck_t *abc, const char ***names, size_t *count);
+
+/*
+ * Checks the files of count installed packages, every selected package if names is NULL
+ * callback gets the broken files from the calling thread, it may call
+ * aurbrokenpkgcheck_cancel(), if it is NULL the files are reported like
+ * aurbrokenpkgcheck_report() set
+ * broken, if not NULL, is set to the number of packages found broken, those of
+ * a canceled check may not all have been reported
+ * Returns 0 once every package is checked, -1 if the check was canceled,
+ * anything else is an error
+ */
+AURBROKENPKGCHECK_EXPORT int aurbrokenpkgcheck_check(
+	struct aurbrokenpkgcheck_t *abc,
+	const char *const *names,
+	size_t count,
+	aurbrokenpkgcheck_callback_t callback,
+	void *data,
+	size_t *broken);
+
+/*
+ * Reports the selected packages the pending upgrades would break, from the
+ * files databases of a root opened with AURBROKENPKGCHECK_FILES_DATABASES
+ * broken, if not NULL, is set to the number of packages reported
+ * Anything other than 0 returned is an error
+ */
+AURBROKENPKGCHECK_EXPORT int aurbrokenpkgcheck_predict(struct aurbrokenpkgcheck_t *abc, size_t *broken);
+
+/*
+ * Checks the selected packages of the root of aurbrokenpkgcheck_open(), then
+ * keeps watching its libraries and checks again the packages a change affects,
+ * like aurbrokenpkgcheck_check() does
+ * Only returns once canceled, -1 then, anything else is an error
+ */
+AURBROKENPKGCHECK_EXPORT int aurbrokenpkgcheck_watch(struct aurbrokenpkgcheck_t *abc, aurbrokenpkgcheck_callback_t callback, void *data);
+
+/*
+ * Stops the running check or watch of a context from any thread, the workers
+ * finish the files they hold but the packages not reported yet are left out
+ * A check started afterwards runs normally
+ */
+AURBROKENPKGCHECK_EXPORT void aurbrokenpkgcheck_cancel(struct aurbrokenpkgcheck_t *abc);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
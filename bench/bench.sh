@@ -0,0 +1,125 @@
+#!/bin/sh
+# Times aurbrokenpkgcheck on synthetic roots of several sizes
+# Every size gets a root generated by genroot, then each phase is timed:
+#   generate : writing the root with genroot
+#   scan     : a full check without cache
+#   symbols  : a full check with --symbols, without cache
+#   cold     : a full check writing a new cache
+#   warm     : a check answered by the cache
+#   all      : a check of every installed package with --all, without cache
+# The peak RSS and the allocations recording the results are printed for a
+# check without cache and for a check with --all, they are not compared
+# With a baseline file the times are compared and the script fails when a phase
+# of the checker got slower than BENCH_TOLERANCE percent
+# With --update the baseline is rewritten, it only makes sense on the same machine
+
+set -e
+
+BENCH=$(dirname "$0")
+BIN=${BENCH_BIN:-$BENCH/../aurbrokenpkgcheck}
+GENROOT=${BENCH_GENROOT:-$BENCH/genroot}
+DIR=${BENCH_DIR:-${TMPDIR:-/tmp}/aurbrokenpkgcheck-bench}
+SIZES=${BENCH_SIZES:-100 1000 10000}
+RUNS=${BENCH_RUNS:-3}
+TOLERANCE=${BENCH_TOLERANCE:-25}
+BASELINE=${BENCH_BASELINE:-$BENCH/baseline.txt}
+RESULTS=$DIR/results.txt
+UPDATE=0
+
+[ "$1" = "--update" ] && UPDATE=1
+
+now() {
+	date +%s%N
+}
+
+# Runs the checker on the root of the current size, its output is not interesting
+check() {
+	XDG_CACHE_HOME=$DIR/cache "$BIN" --no-colors --config "$DIR/$size/etc/pacman.conf" "$@" >/dev/null 2>&1 || true
+}
+
+# Keeps the best of RUNS runs, in milliseconds
+best() {
+	best_ms=
+	run=0
+	while [ $run -lt "$RUNS" ]; do
+		[ -n "$prepare" ] && $prepare
+		start=$(now)
+		"$@"
+		ms=$(( ($(now) - start) / 1000000 ))
+		if [ -z "$best_ms" ] || [ $ms -lt "$best_ms" ]; then best_ms=$ms; fi
+		run=$((run + 1))
+	done
+}
+
+# Prints the memory used by a check without cache, from --stats
+# The first argument names the line, the others are given to the checker
+memory() {
+	label=$1
+	shift
+	XDG_CACHE_HOME=$DIR/cache "$BIN" --no-colors --no-cache --stats --config "$DIR/$size/etc/pacman.conf" "$@" 2>&1 >/dev/null \
+		| awk -v size="$size" -v label="$label" -F ' *: *' '
+			$1 ~ /peak RSS/ { rss = $2 }
+			$1 ~ /result allocations/ { allocations = $2 }
+			END { printf "%-8s %-9s %8s peak RSS, %s result allocations\n", size, label, rss, allocations }'
+}
+
+generate() {
+	"$GENROOT" --packages "$size" "$DIR/$size" >"$DIR/genroot.out"
+}
+
+drop_cache() {
+	rm -rf "$DIR/cache"
+}
+
+report() {
+	phase=$1
+	if [ "$best_ms" -gt 0 ]; then rate=$((files * 1000 / best_ms)); else rate=-; fi
+	baseline=-
+	verdict=
+	if [ -f "$BASELINE" ]; then
+		baseline=$(awk -v size="$size" -v phase="$phase" '$1 == size && $2 == phase { print $3 }' "$BASELINE")
+		[ -z "$baseline" ] && baseline=-
+	fi
+	# Times under 10ms are mostly noise, generating the root is no part of the tool
+	if [ "$baseline" != "-" ] && [ "$best_ms" -ge 10 ] && [ "$phase" != generate ] \
+		&& [ $((best_ms * 100)) -gt $((baseline * (100 + TOLERANCE))) ]; then
+		verdict=REGRESSION
+		failed=1
+	fi
+	printf '%-8s %-9s %8s %10s %10s %s\n' "$size" "$phase" "$best_ms" "$rate" "$baseline" "$verdict"
+	printf '%s %s %s\n' "$size" "$phase" "$best_ms" >>"$RESULTS"
+}
+
+mkdir -p "$DIR"
+: >"$RESULTS"
+failed=0
+printf '%-8s %-9s %8s %10s %10s\n' packages phase ms files/s baseline
+for size in $SIZES; do
+	prepare="rm -rf $DIR/$size"
+	best generate
+	files=$(awk '{ print $4 }' "$DIR/genroot.out")
+	report generate
+	prepare=
+	best check --no-cache
+	report scan
+	best check --no-cache --symbols
+	report symbols
+	prepare=drop_cache
+	best check --rebuild-cache
+	report cold
+	prepare=
+	best check
+	report warm
+	best check --no-cache --all
+	report all
+	memory memory
+	memory all-mem --all
+	rm -rf "$DIR/$size" "$DIR/cache"
+done
+
+if [ $UPDATE = 1 ]; then
+	cp "$RESULTS" "$BASELINE"
+	echo "Baseline written to $BASELINE"
+	exit 0
+fi
+exit $failed
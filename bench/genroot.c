@@ -0,0 +1,422 @@
+#define _GNU_SOURCE
+#include <elf.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Generates a synthetic pacman root for benchmarking aurbrokenpkgcheck
+ * Every package gets a shared library and executables, all tiny ELF objects
+ * written from scratch with a DT_NEEDED graph between the packages
+ * A fraction of the packages have an executable needing a library that does
+ * not exist, nothing depends on it so only that package is broken
+ */
+
+/* MACROS */
+#define LOADER_PATH "/lib/ld-linux-x86-64.so.2"
+#define LOADER_NAME "ld-linux-x86-64.so.2"
+#define EXPORT_ADDRESS 0x1000
+#define MAX_NEEDED 8
+#define NAME_SIZE 64
+#define PACKAGE_NAME_SIZE 32
+#define PATH_SIZE 4096
+
+/* What goes into a generated ELF object */
+struct elf_spec_t {
+	/* ET_EXEC or ET_DYN */
+	uint16_t type;
+	/* PT_INTERP, NULL for a library */
+	const char *interp;
+	/* DT_SONAME, NULL for an executable */
+	const char *soname;
+	/* the DT_NEEDED sonames */
+	const char *needed[MAX_NEEDED];
+	/* number of needed sonames */
+	size_t needed_count;
+	/* the symbol exported, NULL if none */
+	const char *exported;
+	/* the symbols imported, one per needed soname */
+	const char *imported[MAX_NEEDED];
+	/* number of imported symbols */
+	size_t imported_count;
+};
+
+/* A growing output buffer */
+struct buffer_t {
+	/* the data */
+	unsigned char *data;
+	/* bytes used */
+	size_t length;
+	/* bytes allocated */
+	size_t size;
+};
+
+/*
+ * Prints the error message associated to errno
+ * Returns the value of errno
+ */
+static inline int error_handler(const char *msg) {
+	int errsv = errno;
+	perror(msg);
+	return errsv;
+}
+
+/*
+ * Small xorshift generator, the roots only depend on the seed
+ */
+static uint64_t random_next(uint64_t *state) {
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+/*
+ * Appends length bytes, data may be NULL for zeros
+ * Returns the offset they were written at
+ */
+static size_t buffer_append(struct buffer_t *buf, const void *data, size_t length) {
+	size_t offset = buf->length;
+	unsigned char *grown;
+	if (buf->length + length > buf->size) {
+		size_t size = buf->size ? buf->size : 1024;
+		while (size < buf->length + length) size *= 2;
+		if (!(grown = realloc(buf->data, size))) {
+			error_handler("realloc()");
+			exit(EXIT_FAILURE);
+		}
+		buf->data = grown;
+		buf->size = size;
+	}
+	if (data) memcpy(buf->data + buf->length, data, length);
+	else memset(buf->data + buf->length, 0, length);
+	buf->length += length;
+	return offset;
+}
+
+/*
+ * Pads the buffer with zeros to a multiple of alignment
+ */
+static void buffer_align(struct buffer_t *buf, size_t alignment) {
+	if (buf->length % alignment) buffer_append(buf, NULL, alignment - buf->length % alignment);
+}
+
+/*
+ * The DT_GNU_HASH function
+ */
+static uint32_t gnu_hash(const char *name) {
+	uint32_t hash = 5381;
+	for (; *name; ++name) hash = hash * 33 + (unsigned char)*name;
+	return hash;
+}
+
+/*
+ * Writes a minimal x86_64 ELF object: one PT_LOAD mapping the whole file at 0,
+ * the dynamic section, its string and symbol tables and a DT_GNU_HASH table
+ * There is no code and no section header, the checker only reads the dynamic part
+ * Anything other than 0 returned is an error
+ */
+static int elf_write(const char *filename, const struct elf_spec_t *spec) {
+	struct buffer_t buf, strtab;
+	Elf64_Ehdr ehdr;
+	Elf64_Phdr phdr[3];
+	Elf64_Sym sym;
+	Elf64_Dyn dyn;
+	size_t i, phnum, interp, symtab, hash, strings, dynamic, soname, symcount;
+	size_t needed[MAX_NEEDED], imported[MAX_NEEDED], exported;
+	uint32_t header[4], word, h;
+	uint64_t bloom;
+	FILE *out;
+	int ret;
+	memset(&buf, 0, sizeof(struct buffer_t));
+	memset(&strtab, 0, sizeof(struct buffer_t));
+	/* The string table starts with the empty string */
+	buffer_append(&strtab, "", 1);
+	soname = spec->soname ? buffer_append(&strtab, spec->soname, strlen(spec->soname) + 1) : 0;
+	for (i = 0; i < spec->needed_count; ++i)
+		needed[i] = buffer_append(&strtab, spec->needed[i], strlen(spec->needed[i]) + 1);
+	for (i = 0; i < spec->imported_count; ++i)
+		imported[i] = buffer_append(&strtab, spec->imported[i], strlen(spec->imported[i]) + 1);
+	exported = spec->exported ? buffer_append(&strtab, spec->exported, strlen(spec->exported) + 1) : 0;
+	phnum = spec->interp ? 3 : 2;
+	buffer_append(&buf, NULL, sizeof(Elf64_Ehdr) + phnum * sizeof(Elf64_Phdr));
+	interp = spec->interp ? buffer_append(&buf, spec->interp, strlen(spec->interp) + 1) : 0;
+	buffer_align(&buf, 8);
+	/* Undefined symbols come first, DT_GNU_HASH only covers the defined ones */
+	symtab = buffer_append(&buf, NULL, sizeof(Elf64_Sym));
+	memset(&sym, 0, sizeof(Elf64_Sym));
+	for (i = 0; i < spec->imported_count; ++i) {
+		sym.st_name = (uint32_t)imported[i];
+		sym.st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC);
+		sym.st_shndx = SHN_UNDEF;
+		buffer_append(&buf, &sym, sizeof(Elf64_Sym));
+	}
+	symcount = 1 + spec->imported_count;
+	if (spec->exported) {
+		sym.st_name = (uint32_t)exported;
+		sym.st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC);
+		sym.st_shndx = SHN_ABS;
+		sym.st_value = EXPORT_ADDRESS;
+		buffer_append(&buf, &sym, sizeof(Elf64_Sym));
+	}
+	/* One bucket and one bloom word are enough for a single export */
+	hash = buffer_append(&buf, NULL, 0);
+	header[0] = 1;
+	header[1] = (uint32_t)symcount;
+	header[2] = 1;
+	header[3] = 6;
+	buffer_append(&buf, header, sizeof(header));
+	bloom = 0;
+	if (spec->exported) {
+		h = gnu_hash(spec->exported);
+		bloom = (1ULL << (h % 64)) | (1ULL << ((h >> 6) % 64));
+	}
+	buffer_append(&buf, &bloom, sizeof(uint64_t));
+	word = spec->exported ? (uint32_t)symcount : 0;
+	buffer_append(&buf, &word, sizeof(uint32_t));
+	if (spec->exported) {
+		word = gnu_hash(spec->exported) | 1;
+		buffer_append(&buf, &word, sizeof(uint32_t));
+	}
+	strings = buffer_append(&buf, strtab.data, strtab.length);
+	buffer_align(&buf, 8);
+	dynamic = buf.length;
+#define DYN(tag, value) do { \
+		dyn.d_tag = (tag); dyn.d_un.d_val = (uint64_t)(value); \
+		buffer_append(&buf, &dyn, sizeof(Elf64_Dyn)); \
+	} while (0)
+	for (i = 0; i < spec->needed_count; ++i) DYN(DT_NEEDED, needed[i]);
+	if (spec->soname) DYN(DT_SONAME, soname);
+	DYN(DT_STRTAB, strings);
+	DYN(DT_STRSZ, strtab.length);
+	DYN(DT_SYMTAB, symtab);
+	DYN(DT_SYMENT, sizeof(Elf64_Sym));
+	DYN(DT_GNU_HASH, hash);
+	DYN(DT_NULL, 0);
+#undef DYN
+	memset(&ehdr, 0, sizeof(Elf64_Ehdr));
+	memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+	ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+	ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+	ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+	ehdr.e_type = spec->type;
+	ehdr.e_machine = EM_X86_64;
+	ehdr.e_version = EV_CURRENT;
+	ehdr.e_phoff = sizeof(Elf64_Ehdr);
+	ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+	ehdr.e_phentsize = sizeof(Elf64_Phdr);
+	ehdr.e_phnum = (uint16_t)phnum;
+	memcpy(buf.data, &ehdr, sizeof(Elf64_Ehdr));
+	memset(phdr, 0, sizeof(phdr));
+	i = 0;
+	if (spec->interp) {
+		phdr[i].p_type = PT_INTERP;
+		phdr[i].p_flags = PF_R;
+		phdr[i].p_offset = phdr[i].p_vaddr = phdr[i].p_paddr = interp;
+		phdr[i].p_filesz = phdr[i].p_memsz = strlen(spec->interp) + 1;
+		phdr[i++].p_align = 1;
+	}
+	phdr[i].p_type = PT_LOAD;
+	phdr[i].p_flags = PF_R;
+	phdr[i].p_filesz = phdr[i].p_memsz = buf.length;
+	phdr[i++].p_align = 0x1000;
+	phdr[i].p_type = PT_DYNAMIC;
+	phdr[i].p_flags = PF_R | PF_W;
+	phdr[i].p_offset = phdr[i].p_vaddr = phdr[i].p_paddr = dynamic;
+	phdr[i].p_filesz = phdr[i].p_memsz = buf.length - dynamic;
+	phdr[i].p_align = 8;
+	memcpy(buf.data + sizeof(Elf64_Ehdr), phdr, phnum * sizeof(Elf64_Phdr));
+	ret = 0;
+	if (!(out = fopen(filename, "w"))) ret = error_handler(filename);
+	else {
+		ret = fwrite(buf.data, 1, buf.length, out) != buf.length;
+		if (fclose(out) || ret) ret = error_handler(filename);
+		else if (chmod(filename, 0755) < 0) ret = error_handler(filename);
+	}
+	free(buf.data);
+	free(strtab.data);
+	return ret;
+}
+
+/*
+ * Creates every missing directory of path, like mkdir -p
+ * Anything other than 0 returned is an error
+ */
+static int mkdirs(const char *path) {
+	char dir[PATH_SIZE], *p;
+	snprintf(dir, PATH_SIZE, "%s", path);
+	for (p = dir + 1; *p; ++p) {
+		if (*p != '/') continue;
+		*p = 0;
+		if (mkdir(dir, 0755) < 0 && errno != EEXIST) return error_handler(dir);
+		*p = '/';
+	}
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST) return error_handler(dir);
+	return 0;
+}
+
+/*
+ * Writes text to filename
+ * Anything other than 0 returned is an error
+ */
+static int write_text(const char *filename, const char *text) {
+	FILE *out;
+	int ret;
+	if (!(out = fopen(filename, "w"))) return error_handler(filename);
+	ret = fputs(text, out) < 0;
+	if (fclose(out) || ret) return error_handler(filename);
+	return 0;
+}
+
+static void usage(const char *arg0) {
+	fprintf(stdout, "Usage: %s [-h|--help] [-p|--packages N] [-e|--executables N] [-n|--needed N] [--broken PERCENT] [--seed SEED] ROOT\n", arg0);
+	fprintf(stdout, "Options:\n");
+	fprintf(stdout, "\t -h,--help          : This help\n");
+	fprintf(stdout, "\t -p,--packages N    : Number of packages (default: 100)\n");
+	fprintf(stdout, "\t -e,--executables N : Executables per package (default: 2)\n");
+	fprintf(stdout, "\t -n,--needed N      : Most libraries needed by a library (default: 3, at most %d)\n", MAX_NEEDED - 1);
+	fprintf(stdout, "\t --broken PERCENT   : Packages with an executable needing a library that does not exist (default: 5)\n");
+	fprintf(stdout, "\t --seed SEED        : Seed of the generator (default: 1)\n");
+	fprintf(stdout, "The number of packages and files generated is printed to stdout\n");
+}
+
+int main(int argc, const char *argv[]) {
+	const char **arg, *root;
+	char path[PATH_SIZE], text[PATH_SIZE], *end;
+	char sonames[MAX_NEEDED][NAME_SIZE], symbols[MAX_NEEDED][NAME_SIZE], name[PACKAGE_NAME_SIZE];
+	char soname[NAME_SIZE], exported[NAME_SIZE];
+	struct elf_spec_t spec;
+	FILE *files;
+	unsigned long packages, executables, max_needed, broken, value;
+	unsigned long package, exe, i, j, lib, file_count, broken_count;
+	uint64_t state;
+	(void)argc;
+	packages = 100;
+	executables = 2;
+	max_needed = 3;
+	broken = 5;
+	state = 1;
+	root = NULL;
+	for (arg = argv + 1; *arg; ++arg) {
+		if (!strcmp(*arg, "-h") || !strcmp(*arg, "--help")) {
+			usage(*argv);
+			return EXIT_SUCCESS;
+		}
+		if (!strcmp(*arg, "-p") || !strcmp(*arg, "--packages") || !strcmp(*arg, "-e")
+			|| !strcmp(*arg, "--executables") || !strcmp(*arg, "-n") || !strcmp(*arg, "--needed")
+			|| !strcmp(*arg, "--broken") || !strcmp(*arg, "--seed")) {
+			if (!*(arg + 1)) {
+				fprintf(stderr, "Missing argument for '%s'\n", *arg);
+				usage(*argv);
+				return EXIT_FAILURE;
+			}
+			value = strtoul(*(arg + 1), &end, 10);
+			if (*end || !**(arg + 1)) {
+				fprintf(stderr, "Invalid number '%s'\n", *(arg + 1));
+				usage(*argv);
+				return EXIT_FAILURE;
+			}
+			if (!strcmp(*arg, "-p") || !strcmp(*arg, "--packages")) packages = value;
+			else if (!strcmp(*arg, "-e") || !strcmp(*arg, "--executables")) executables = value;
+			else if (!strcmp(*arg, "-n") || !strcmp(*arg, "--needed")) max_needed = value;
+			else if (!strcmp(*arg, "--broken")) broken = value;
+			else state = value ? value : 1;
+			++arg;
+		}
+		else if (**arg == '-' || root) {
+			fprintf(stderr, "Unknown argument '%s'\n", *arg);
+			usage(*argv);
+			return EXIT_FAILURE;
+		}
+		else root = *arg;
+	}
+	if (!root || !*root || max_needed >= MAX_NEEDED || broken > 100 || (broken && !executables)) {
+		usage(*argv);
+		return EXIT_FAILURE;
+	}
+	/* The loader lives in /usr/lib, with /lib pointing there like on Arch */
+	snprintf(path, PATH_SIZE, "%s/usr/lib", root);
+	if (mkdirs(path)) return EXIT_FAILURE;
+	snprintf(path, PATH_SIZE, "%s/usr/bin", root);
+	if (mkdirs(path)) return EXIT_FAILURE;
+	snprintf(path, PATH_SIZE, "%s/etc", root);
+	if (mkdirs(path)) return EXIT_FAILURE;
+	snprintf(path, PATH_SIZE, "%s/var/lib/pacman/local", root);
+	if (mkdirs(path)) return EXIT_FAILURE;
+	snprintf(path, PATH_SIZE, "%s/lib", root);
+	if (symlink("usr/lib", path) < 0 && errno != EEXIST) return error_handler(path);
+	memset(&spec, 0, sizeof(struct elf_spec_t));
+	spec.type = ET_DYN;
+	spec.soname = LOADER_NAME;
+	snprintf(path, PATH_SIZE, "%s/usr/lib/%s", root, LOADER_NAME);
+	if (elf_write(path, &spec)) return EXIT_FAILURE;
+	/* No repository, so every local package is foreign */
+	snprintf(path, PATH_SIZE, "%s/etc/pacman.conf", root);
+	snprintf(text, PATH_SIZE, "[options]\nRootDir = %s/\nDBPath = %s/var/lib/pacman/\nArchitecture = x86_64\n",
+		root, root);
+	if (write_text(path, text)) return EXIT_FAILURE;
+	snprintf(path, PATH_SIZE, "%s/var/lib/pacman/local/ALPM_DB_VERSION", root);
+	if (write_text(path, "9\n")) return EXIT_FAILURE;
+	file_count = broken_count = 0;
+	for (package = 0; package < packages; ++package) {
+		snprintf(name, PACKAGE_NAME_SIZE, "synth%06lu", package);
+		snprintf(path, PATH_SIZE, "%s/var/lib/pacman/local/%s-1.0-1", root, name);
+		if (mkdirs(path)) return EXIT_FAILURE;
+		snprintf(path, PATH_SIZE, "%s/var/lib/pacman/local/%s-1.0-1/desc", root, name);
+		snprintf(text, PATH_SIZE, "%%NAME%%\n%s\n\n%%VERSION%%\n1.0-1\n\n%%ARCH%%\nx86_64\n\n"
+			"%%BUILDDATE%%\n0\n\n%%INSTALLDATE%%\n0\n\n%%REASON%%\n1\n\n", name);
+		if (write_text(path, text)) return EXIT_FAILURE;
+		snprintf(path, PATH_SIZE, "%s/var/lib/pacman/local/%s-1.0-1/files", root, name);
+		if (!(files = fopen(path, "w"))) return error_handler(path);
+		fprintf(files, "%%FILES%%\n");
+		/* The library needs some of the libraries of the packages before it */
+		memset(&spec, 0, sizeof(struct elf_spec_t));
+		spec.type = ET_DYN;
+		snprintf(soname, NAME_SIZE, "lib%s.so.1", name);
+		snprintf(exported, NAME_SIZE, "%s_entry", name);
+		spec.soname = soname;
+		spec.exported = exported;
+		for (i = 0; package && i < max_needed && i < package; ++i) {
+			/* Low indices are needed more often, like the base libraries */
+			lib = (unsigned long)(random_next(&state) % package);
+			lib = (unsigned long)(random_next(&state) % (lib + 1));
+			snprintf(sonames[i], NAME_SIZE, "libsynth%06lu.so.1", lib);
+			for (j = 0; j < spec.needed_count && strcmp(spec.needed[j], sonames[i]); ++j) ;
+			if (j < spec.needed_count) continue;
+			snprintf(symbols[i], NAME_SIZE, "synth%06lu_entry", lib);
+			spec.needed[spec.needed_count++] = sonames[i];
+			spec.imported[spec.imported_count++] = symbols[i];
+		}
+		snprintf(path, PATH_SIZE, "%s/usr/lib/%s", root, soname);
+		if (elf_write(path, &spec)) return EXIT_FAILURE;
+		fprintf(files, "usr/lib/%s\n", soname);
+		++file_count;
+		/* The executables only need the library of their package
+		 * The first one of a broken package also needs a library that does not
+		 * exist, a library would break every package needing it */
+		for (exe = 0; exe < executables; ++exe) {
+			memset(&spec, 0, sizeof(struct elf_spec_t));
+			spec.type = ET_DYN;
+			spec.interp = LOADER_PATH;
+			spec.needed[spec.needed_count++] = soname;
+			spec.imported[spec.imported_count++] = exported;
+			if (!exe && random_next(&state) % 100 < broken) {
+				snprintf(sonames[0], NAME_SIZE, "libgone%06lu.so.1", package);
+				spec.needed[spec.needed_count++] = sonames[0];
+				++broken_count;
+			}
+			snprintf(path, PATH_SIZE, "%s/usr/bin/%s-%lu", root, name, exe);
+			if (elf_write(path, &spec)) return EXIT_FAILURE;
+			fprintf(files, "usr/bin/%s-%lu\n", name, exe);
+			++file_count;
+		}
+		fprintf(files, "\n");
+		if (fclose(files)) return error_handler(path);
+	}
+	fprintf(stdout, "packages %lu files %lu broken %lu\n", packages, file_count, broken_count);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,311 @@
+/*
+ * Compares the stream parser of aurbrokenpkgcheck with the one it replaced
+ * The old parser read 256 bytes at a time, split them with strcspn() and
+ * handed the pieces of the tokens cut by the blocks to the callback
+ * Both parse the same generated outputs from a memory file, the best of
+ * several runs is kept and the tokens they saw must be the same
+ */
+
+#include "../libaurbrokenpkgcheck.c"
+
+/* MACROS */
+#define LEGACY_BUFFER_SIZE 256
+#define LINE_SIZE 4096
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+/* The parser state before the tokenizer was rewritten */
+struct legacy_stream_t {
+	/* the delimiters */
+	const char *delims;
+	/* represents the current token position */
+	int pos;
+	/* true if string is the beginning of a new token */
+	int beg;
+	/* true if string is the end of the current token */
+	int end;
+	/* the current '\0' terminated piece of token */
+	char *string;
+	/* the length of the current piece */
+	size_t string_length;
+	/* the delimiter that was replaced by '\0' */
+	char string_delim;
+	/* where the pieces go */
+	struct digest_t *digest;
+};
+
+/* What a parser saw, it must not depend on how the tokens were cut */
+struct digest_t {
+	/* flag set if the bytes get hashed, the timed runs only count */
+	int verify;
+	/* FNV-1a of the token bytes and their delimiters */
+	uint64_t hash;
+	/* number of token bytes */
+	size_t bytes;
+	/* number of delimited tokens */
+	size_t tokens;
+};
+
+/* A generated output */
+struct input_t {
+	/* what the output looks like */
+	const char *name;
+	/* the delimiters its parser uses */
+	const char *delims;
+	/* writes line number index into line, returns its length */
+	int (*line)(char *line, size_t index);
+};
+
+/*
+ * Adds bytes to the digest
+ */
+static void digest_add(struct digest_t *digest, const char *data, size_t length) {
+	size_t i;
+	for (i = 0; i < length; ++i) {
+		digest->hash ^= (unsigned char)data[i];
+		digest->hash *= FNV_PRIME;
+	}
+}
+
+/*
+ * Adds a piece of token to the digest, and its delimiter if it ends
+ */
+static void digest_piece(struct digest_t *digest, const char *string, size_t length, int end, char delim) {
+	digest->bytes += length;
+	if (digest->verify) digest_add(digest, string, length);
+	if (!end) return;
+	if (digest->verify) digest_add(digest, &delim, 1);
+	++digest->tokens;
+}
+
+/*
+ * The old stream_parser_read(), only the callback is fixed
+ */
+static ssize_t legacy_stream_parser_read(int fd, struct legacy_stream_t *st) {
+	char buffer[LEGACY_BUFFER_SIZE];
+	ssize_t length;
+	if ((length = read(fd, buffer, LEGACY_BUFFER_SIZE - 1)) <= 0) return length;
+	buffer[length] = 0;
+	for (st->string = buffer;
+		;
+		st->string += st->string_length + 1) {
+		st->string_length = strcspn(st->string, st->delims);
+		if (!st->string_length && !st->string[st->string_length]) break;
+		st->string_delim = st->string[st->string_length];
+		st->string[st->string_length] = '\0';
+		if (st->end) {
+			++st->pos;
+			st->beg = 1;
+			st->end = 0;
+		}
+		if (st->string_delim) st->end = 1;
+		digest_piece(st->digest, st->string, st->string_length, st->end, st->string_delim);
+		st->beg = 0;
+		if (!st->string_delim) break;
+	}
+	return length;
+}
+
+/*
+ * The callback of the current parser
+ */
+static void stream_digest_callback(struct stream_t *st) {
+	digest_piece((struct digest_t *)st->data, st->string, st->string_length, st->end, st->string_delim);
+}
+
+/*
+ * ld.so --list on broken objects: the found libraries and the errors
+ */
+static int loader_line(char *line, size_t index) {
+	if (index % 4 == 3) {
+		return snprintf(line, LINE_SIZE, "/usr/lib/ld-linux-x86-64.so.2: error while loading shared libraries: "
+			"libsynth%06zu.so.1: cannot open shared object file: No such file or directory\n", index);
+	}
+	return snprintf(line, LINE_SIZE, "\tlibsynth%06zu.so.1 => /usr/lib/libsynth%06zu.so.1 (0x00007f%010zx)\n",
+		index, index, index * 4096);
+}
+
+/*
+ * pacman -Ql: a package name and one of its files per line
+ */
+static int pacman_line(char *line, size_t index) {
+	return snprintf(line, LINE_SIZE, "synth%06zu /usr/lib/synth%06zu/plugins/libsynth-plugin-%zu.so\n",
+		index / 16, index / 16, index % 16);
+}
+
+/*
+ * Lines far longer than the old blocks, every one is cut many times
+ */
+static int long_line(char *line, size_t index) {
+	int length = LINE_SIZE - 96;
+	memset(line, 'a' + (int)(index % 26), (size_t)length);
+	line[length++] = index % 8 == 7 ? '\n' : ' ';
+	line[length] = 0;
+	return length;
+}
+
+/*
+ * Tokens of about 256 KiB, larger than the first buffer of the current parser
+ */
+static int huge_line(char *line, size_t index) {
+	int length = LINE_SIZE - 96;
+	memset(line, 'a' + (int)(index % 26), (size_t)length);
+	if (index % 64 == 63) line[length - 1] = '\n';
+	line[length] = 0;
+	return length;
+}
+
+/*
+ * Fills a memory file with lines until it holds size bytes
+ * Returns the file descriptor, -1 on error
+ */
+static int input_create(const struct input_t *input, size_t size) {
+	char line[LINE_SIZE];
+	FILE *out;
+	size_t index, written;
+	int fd, length;
+	if ((fd = memfd_create(input->name, MFD_CLOEXEC)) < 0) {
+		error_handler("memfd_create()");
+		return -1;
+	}
+	if (!(out = fdopen(dup(fd), "w"))) {
+		error_handler("fdopen()");
+		close(fd);
+		return -1;
+	}
+	for (index = 0, written = 0; written < size; ++index) {
+		length = input->line(line, index);
+		fwrite(line, 1, (size_t)length, out);
+		written += (size_t)length;
+	}
+	if (fclose(out)) {
+		error_handler("fclose()");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Parses the whole file with the old parser
+ */
+static void run_legacy(int fd, const struct input_t *input, struct digest_t *digest) {
+	struct legacy_stream_t st;
+	memset(&st, 0, sizeof(struct legacy_stream_t));
+	st.delims = input->delims;
+	st.beg = 1;
+	st.digest = digest;
+	lseek(fd, 0, SEEK_SET);
+	while (legacy_stream_parser_read(fd, &st) > 0) ;
+}
+
+/*
+ * Parses the whole file with the current parser
+ */
+static void run_current(int fd, const struct input_t *input, struct digest_t *digest) {
+	struct stream_t st;
+	stream_parser_init(&st);
+	st.delims = input->delims;
+	st.callback = stream_digest_callback;
+	st.data = digest;
+	lseek(fd, 0, SEEK_SET);
+	while (stream_parser_read(fd, &st) > 0) ;
+	stream_parser_free(&st);
+}
+
+/*
+ * Keeps the best time of runs runs, in nanoseconds
+ * A last run hashes what the parser saw into digest
+ */
+static uint64_t best_of(
+	unsigned long runs,
+	void (*run)(int, const struct input_t *, struct digest_t *),
+	int fd,
+	const struct input_t *input,
+	struct digest_t *digest) {
+	uint64_t best, start, time;
+	unsigned long i;
+	best = 0;
+	for (i = 0; i <= runs; ++i) {
+		memset(digest, 0, sizeof(struct digest_t));
+		/* Hashing would take longer than parsing */
+		if ((digest->verify = i == runs)) digest->hash = FNV_OFFSET;
+		start = stats_now();
+		run(fd, input, digest);
+		time = stats_now() - start;
+		if (!digest->verify && (!best || time < best)) best = time;
+	}
+	return best;
+}
+
+/*
+ * Prints the usage
+ */
+static void tokenizer_usage(const char *arg0) {
+	fprintf(stdout, "Usage: %s [-h|--help] [--size MIB] [--runs N]\n", arg0);
+	fprintf(stdout, "Options:\n");
+	fprintf(stdout, "\t -h,--help  : This help\n");
+	fprintf(stdout, "\t --size MIB : Size of every generated output (default: 32)\n");
+	fprintf(stdout, "\t --runs N   : Runs of every parser, the best is kept (default: 5)\n");
+}
+
+int main(int argc, const char *argv[]) {
+	const struct input_t inputs[] = {
+		{ "loader", ":\r\n", loader_line },
+		{ "pacman", " \r\n", pacman_line },
+		{ "long lines", " \r\n", long_line },
+		{ "huge tokens", "\r\n", huge_line }
+	};
+	const char **arg;
+	char *end;
+	struct digest_t legacy, current;
+	uint64_t legacy_time, current_time;
+	unsigned long size, runs, value;
+	size_t i;
+	int fd, ret;
+	(void)argc;
+	size = 32;
+	runs = 5;
+	for (arg = argv + 1; *arg; ++arg) {
+		if (!strcmp(*arg, "-h") || !strcmp(*arg, "--help")) {
+			tokenizer_usage(*argv);
+			return EXIT_SUCCESS;
+		}
+		if (strcmp(*arg, "--size") && strcmp(*arg, "--runs")) {
+			fprintf(stderr, "Unknown option '%s'\n", *arg);
+			tokenizer_usage(*argv);
+			return EXIT_FAILURE;
+		}
+		if (!*(arg + 1)) {
+			fprintf(stderr, "Missing argument for '%s'\n", *arg);
+			tokenizer_usage(*argv);
+			return EXIT_FAILURE;
+		}
+		value = strtoul(*(arg + 1), &end, 10);
+		if (*end || !value) {
+			fprintf(stderr, "Invalid value '%s' for '%s'\n", *(arg + 1), *arg);
+			tokenizer_usage(*argv);
+			return EXIT_FAILURE;
+		}
+		if (!strcmp(*arg, "--size")) size = value;
+		else runs = value;
+		++arg;
+	}
+	ret = EXIT_SUCCESS;
+	printf("%-12s %8s %10s %10s %10s %8s\n", "output", "MiB", "tokens", "old ms", "new ms", "speedup");
+	for (i = 0; i < sizeof(inputs) / sizeof(inputs[0]); ++i) {
+		if ((fd = input_create(inputs + i, (size_t)size << 20)) < 0) return EXIT_FAILURE;
+		legacy_time = best_of(runs, run_legacy, fd, inputs + i, &legacy);
+		current_time = best_of(runs, run_current, fd, inputs + i, &current);
+		close(fd);
+		printf("%-12s %8lu %10zu %10.1f %10.1f %7.2fx\n", inputs[i].name, size, current.tokens,
+			(double)legacy_time / 1e6, (double)current_time / 1e6,
+			current_time ? (double)legacy_time / (double)current_time : 0.0);
+		if (legacy.hash != current.hash || legacy.bytes != current.bytes || legacy.tokens != current.tokens) {
+			fprintf(stderr, "%s: the parsers disagree (%zu and %zu tokens)\n",
+				inputs[i].name, legacy.tokens, current.tokens);
+			ret = EXIT_FAILURE;
+		}
+	}
+	return ret;
+}
@@ -0,0 +1,6883 @@
+/* 
+ * MIT License
+ *
+ * Copyright (c) 2017 Philipp Richter
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <alpm.h>
+
+#include <dirent.h>
+#include <ctype.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <fcntl.h>
+#include <elf.h>
+#include <glob.h>
+#include <fnmatch.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <poll.h>
+#include <spawn.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <linux/io_uring.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+
+#include "aurbrokenpkgcheck.h"
+
+/* MACROS */
+#define LIB_DIR "/lib"
+#define LD_PREFIX "ld-linux"
+#define LD_PREFIX_LENGTH 8
+#define PACMAN_CONF AURBROKENPKGCHECK_PACMAN_CONF
+#define PACMAN_CONF_MAX_DEPTH 8
+#define PACMAN_DB_PATH "/var/lib/pacman/"
+#define BUFFER_SIZE 256
+#define STREAM_BUFFER_SIZE 65536
+#define STREAM_DELIMS_MAX 4
+#define LD_SO_CONF "/etc/ld.so.conf"
+#define LD_SO_CONF_DIR "/etc/ld.so.conf.d"
+#define LD_SO_CONF_MAX_DEPTH 8
+#define LD_SO_CACHE "/etc/ld.so.cache"
+#define LD_SO_CACHE_MAGIC "glibc-ld.so.cache1.1"
+#define LD_SO_CACHE_MAGIC_LENGTH 20
+#define LD_SO_CACHE_OLD_MAGIC "ld.so-1.7.0"
+#define LD_SO_CACHE_OLD_MAGIC_LENGTH 11
+#define LIB_NAME_64 "lib"
+#define LIB_NAME_32 "lib32"
+#define HASHMAP_MIN_SIZE 64
+#define ARENA_CHUNK_SIZE 65536
+#define VERIFY_CHILDREN_PER_JOB 4
+#define FORMAT_TREE AURBROKENPKGCHECK_FORMAT_TREE
+#define FORMAT_NDJSON AURBROKENPKGCHECK_FORMAT_NDJSON
+#define RUN_CHECK 0
+#define RUN_PREDICT 1
+#define RUN_WATCH 2
+#define WRITER_BUFFER_SIZE 65536
+#define CHECK_DIRS 8
+#define PROBE_BATCH 32
+#define PROBE_STATX 0
+#define PROBE_OPEN 1
+#define PROBE_READ 2
+#define PROBE_CLOSE 3
+#define WATCH_QUIET_MS 1000
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE)
+#define LOW_IMPACT_PRESSURE 10
+#define LOW_IMPACT_SAMPLE_MS 200
+#define LOW_IMPACT_PAUSE_MS 200
+#define LOW_IMPACT_SLEEP_MS 50
+#define LOW_IMPACT_RESOURCES 3
+#define LOW_IMPACT_IOPRIO_WHO_PROCESS 1
+#define LOW_IMPACT_IOPRIO_CLASS_IDLE 3
+#define LOW_IMPACT_IOPRIO_CLASS_SHIFT 13
+#define STATS_PHASES_MAX 16
+#define STATS_SLOWEST_PACKAGES 10
+#define STATS_ADD(stats, counter, value) do { \
+		if ((stats) && (stats)->enabled) __atomic_fetch_add(&(stats)->counter, (uint64_t)(value), __ATOMIC_RELAXED); \
+	} while (0)
+#define SCAN_CACHE_DIR "aurbrokenpkgcheck"
+#define SCAN_CACHE_MAGIC "aurbrokenpkgcheck-cache 1"
+#define SCAN_CACHE_SKIP 1
+#define SCAN_CACHE_CLEAN 2
+#define NOT_FOUND_MESSAGE "cannot open shared object file: No such file or directory"
+#define UNDEFINED_SYMBOL_MESSAGE "undefined symbol"
+#define ELF_BUILD_ID_MAX 64
+#define ELF_KEY_SIZE (sizeof("build-id:") + 2 * ELF_BUILD_ID_MAX + sizeof(":") + 16)
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define ELF_NATIVE_DATA ELFDATA2MSB
+#else
+#define ELF_NATIVE_DATA ELFDATA2LSB
+#endif
+/* MACROS */
+
+/* STRUCTURES */
+
+/* Stores intermediate states between parses */
+struct stream_t {
+	/* Growable block buffer, allocated by the first stream_parser_read()
+	 * and freed by stream_parser_free()
+	 * DO NOT CHANGE */
+	char *buffer;
+	/* Allocated size of the buffer
+	 * DO NOT CHANGE */
+	size_t size;
+	/* Bytes at the start of the buffer holding the token not delimited yet
+	 * DO NOT CHANGE */
+	size_t length;
+	/* If left NULL will be set to "\r\n" by stream_parser_read()
+	 * CAN BE CHANGED IN THE CALLBACK */
+	const char *delims;
+	/* The delims the searches below were set up for
+	 * DO NOT CHANGE */
+	const char *searched_delims;
+	/* Number of delimiters searched with memchr(), 0 to use table instead
+	 * DO NOT CHANGE */
+	size_t searched_count;
+	/* Next position of every delimiter searched with memchr() in the block
+	 * DO NOT CHANGE */
+	char *searched[STREAM_DELIMS_MAX];
+	/* Flags the bytes of delims when there are too many for memchr()
+	 * DO NOT CHANGE */
+	unsigned char table[256];
+	/* represents the current token position
+	 * DO NOT CHANGE */
+	int pos;
+	/* true if string is the beginning of a new token
+	 * DO NOT CHANGE */
+	int beg;
+	/* true if string is the end of the current token
+	 * DO NOT CHANGE */
+	int end;
+	/* the current '\0' terminated token
+	 * DO NOT CHANGE */
+	char *string;
+	/* the length of the current token
+	 * DO NOT CHANGE */
+	size_t string_length;
+	/* the delimiter that was replaced by '\0' for the current token
+	 * DO NOT CHANGE */
+	char string_delim;
+	/* function to call once more data is available
+	 * CAN BE CHANGED IN THE CALLBACK */
+	void (*callback)(struct stream_t *);
+	/* optional data to pass between calls
+	 * CAN BE CHANGED IN THE CALLBACK */
+	void *data;
+};
+
+/* A child process run by struct exec_engine_t */
+struct exec_child_t {
+	/* the child, 0 if the slot is free */
+	pid_t pid;
+	/* read ends of the stdout and stderr pipes, -1 once closed */
+	int fds[2];
+	/* parser states of stdout and stderr, NULL to discard the output */
+	struct stream_t *streams[2];
+	/* called with the exit code once the child is reaped, may be NULL */
+	void (*exited)(int, void *);
+	/* optional data for exited */
+	void *data;
+};
+
+/* Runs several children at once, multiplexing all their pipes with poll() */
+struct exec_engine_t {
+	/* the child slots */
+	struct exec_child_t *children;
+	/* number of slots */
+	size_t max_children;
+	/* number of children in flight */
+	size_t running;
+	/* poll() array, two entries per slot */
+	struct pollfd *pollfds;
+	/* the counters of the context, NULL if they are not kept */
+	struct stats_t *stats;
+};
+
+/* A raw io_uring, see io_uring_setup(2) */
+struct uring_t {
+	/* the ring file descriptor, -1 if there is none */
+	int fd;
+	/* the mapping of both rings */
+	unsigned char *map;
+	/* size of map */
+	size_t map_size;
+	/* the submission entries */
+	struct io_uring_sqe *sqes;
+	/* size of sqes */
+	size_t sqes_size;
+	/* the submission ring, shared with the kernel */
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_array;
+	unsigned sq_mask;
+	/* the completion ring, shared with the kernel */
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	struct io_uring_cqe *cqes;
+	unsigned cq_mask;
+	/* number of submission entries */
+	unsigned entries;
+	/* entries queued but not submitted yet */
+	unsigned pending;
+	/* the counters of the context, NULL if they are not kept */
+	struct stats_t *stats;
+};
+
+/* The settings of pacman.conf that matter here */
+struct pacman_config_t {
+	/* RootDir, empty if unset */
+	char root_path[PATH_MAX];
+	/* DBPath, empty if unset */
+	char db_path[PATH_MAX];
+	/* the Architecture values, auto is replaced with the machine */
+	char **architectures;
+	/* number of architectures */
+	size_t architectures_count;
+	/* the repository sections, in order */
+	char **repos;
+	/* number of repos */
+	size_t repos_count;
+	/* flag set while parsing the [options] section */
+	int options;
+};
+
+/* Identity of a file on disk, it changes whenever the file is replaced or modified */
+struct file_stamp_t {
+	/* st_dev */
+	uint64_t dev;
+	/* st_ino */
+	uint64_t ino;
+	/* st_size */
+	uint64_t size;
+	/* st_mtim in nanoseconds */
+	int64_t mtime;
+};
+
+/* A file queued by check_package() */
+struct check_file_t {
+	/* index of the owning package in struct check_pool_t */
+	size_t package;
+	/* name of the file inside the root, from the alpm filelist */
+	const char *name;
+	/* the report for the error output, NULL if there is nothing to report */
+	char *report;
+	/* real length of report */
+	size_t report_length;
+	/* is set when the file is determined to be broken */
+	int broken;
+	/* the file as it was checked */
+	struct file_stamp_t stamp;
+	/* SCAN_CACHE_SKIP or SCAN_CACHE_CLEAN if the verdict can be cached, else 0 */
+	int verdict;
+	/* the cached verdict used instead of checking the file, or NULL */
+	const struct scan_cache_entry_t *cached;
+	/* paths of the libraries the file was resolved to, the array belongs to the
+	 * pool and the paths to the resolver */
+	const char **deps;
+	/* number of deps */
+	size_t deps_count;
+	/* the parsed ELF file for --predict, it belongs to the store, NULL if there is none */
+	const struct elf_object_t *obj;
+	/* when the check started and ended, only set for --stats and --trace */
+	uint64_t start;
+	uint64_t end;
+	/* index of the worker that checked the file */
+	size_t worker;
+};
+
+/* data for check_package stream handler */
+struct check_package_t {
+	/* the file currently getting checked */
+	struct check_file_t *file;
+	/* filename currently getting checked */
+	const char* filename;
+	/* the report stream, opened on the first write */
+	FILE *out;
+	/* the line we are at in the error output */
+	int line;
+	/* the token position we are at on the line */
+	int pos;
+	/* flag set if the filename has already been printed */
+	int filename_printed;
+	/* flag sets color output */
+	int colors;
+	/* FORMAT_TREE or FORMAT_NDJSON */
+	int format;
+	/* name of the package of the file, for FORMAT_NDJSON */
+	const char *package;
+	/* the root of the file for FORMAT_NDJSON, NULL with a single root */
+	const char *root;
+	/* number of problems reported for the file */
+	size_t problems;
+	/* flag set if a library of the file could not be recorded */
+	int deps_lost;
+	/* flag set if the reports leave a marker for the providers of a missing library */
+	int providers;
+	/* the missing library of the loader error line being parsed, else empty */
+	char missing[NAME_MAX + 1];
+};
+
+/* One slot of struct hashmap_t */
+struct hashmap_entry_t {
+	/* owned copy of the key, or the key itself if the map borrows them, NULL if the slot is empty */
+	char *key;
+	/* cached hash of the key */
+	size_t hash;
+	/* user value, may be NULL */
+	void *value;
+};
+
+/* Open addressing hash map with string keys */
+struct hashmap_t {
+	/* the slots, NULL until the first insertion */
+	struct hashmap_entry_t *entries;
+	/* number of slots, always a power of two */
+	size_t size;
+	/* number of used slots */
+	size_t count;
+	/* flag set if the keys are not copied, they must outlive the map */
+	int borrowed;
+};
+
+/* A block of struct arena_t */
+struct arena_chunk_t {
+	/* the previous block */
+	struct arena_chunk_t *next;
+	/* bytes used in data */
+	size_t used;
+	/* bytes available in data */
+	size_t size;
+	/* the memory handed out */
+	unsigned char data[];
+};
+
+/* Bump allocator, everything it handed out is freed at once */
+struct arena_t {
+	/* the current block, NULL before the first allocation */
+	struct arena_chunk_t *chunks;
+	/* counts the blocks as result allocations, NULL if they are not counted */
+	struct stats_t *stats;
+};
+
+/* A library some cached verdicts depend on */
+struct scan_cache_lib_t {
+	/* path of the library inside the root */
+	char *path;
+	/* the library as it was when the verdicts were made */
+	struct file_stamp_t stamp;
+	/* set if the library is still the same */
+	int valid;
+};
+
+/* The verdict of a file from the previous run */
+struct scan_cache_entry_t {
+	/* the file as it was when it got checked */
+	struct file_stamp_t stamp;
+	/* SCAN_CACHE_SKIP or SCAN_CACHE_CLEAN */
+	int verdict;
+	/* indexes of the libraries the file was resolved to */
+	size_t *libs;
+	/* number of libs */
+	size_t libs_count;
+};
+
+/* The verdicts of the previous run, read only while checking */
+struct scan_cache_t {
+	/* the cache file */
+	char filename[PATH_MAX];
+	/* the libraries of the previous run */
+	struct scan_cache_lib_t *libs;
+	/* number of libs */
+	size_t libs_count;
+	/* file name -> struct scan_cache_entry_t*, only the still valid ones */
+	struct hashmap_t files;
+};
+
+/* A mapped ELF file whose header has been validated */
+struct elf_image_t {
+	/* the file contents */
+	const unsigned char *map;
+	/* size of the mapping */
+	size_t size;
+	/* ELFCLASS32 or ELFCLASS64 */
+	unsigned char elfclass;
+	/* e_machine */
+	uint16_t machine;
+	/* e_type */
+	uint16_t type;
+	/* e_phoff */
+	uint64_t phoff;
+	/* e_phnum */
+	size_t phnum;
+};
+
+/* The interesting bits of an ELF object, all strings are owned */
+struct elf_object_t {
+	/* ELFCLASS32 or ELFCLASS64 */
+	unsigned char elfclass;
+	/* e_machine */
+	uint16_t machine;
+	/* e_type */
+	uint16_t type;
+	/* set if the object has a PT_DYNAMIC segment */
+	int dynamic;
+	/* PT_INTERP or NULL */
+	char *interp;
+	/* DT_RPATH or NULL */
+	char *rpath;
+	/* DT_RUNPATH or NULL */
+	char *runpath;
+	/* DT_NEEDED entries */
+	char **needed;
+	/* number of DT_NEEDED entries */
+	size_t needed_count;
+	/* the NT_GNU_BUILD_ID note */
+	unsigned char build_id[ELF_BUILD_ID_MAX];
+	/* real length of build_id, 0 if the object has none */
+	size_t build_id_length;
+	/* hash of PT_INTERP and of the DT_NEEDED, DT_RPATH and DT_RUNPATH strings */
+	uint64_t dynamic_hash;
+	/* the next object owned by struct elf_store_t */
+	struct elf_object_t *next;
+};
+
+/* A symbol version of an ELF object */
+struct elf_version_t {
+	/* the version name, it points into the mapping */
+	const char *name;
+	/* the soname the version is required from, NULL if the object defines it */
+	const char *file;
+	/* vd_flags or vna_flags */
+	uint16_t flags;
+};
+
+/* The dynamic symbols of a mapped ELF object, for --symbols */
+struct elf_symbols_t {
+	/* the mapping, it lives as long as the symbols */
+	struct elf_image_t img;
+	/* file offset of DT_SYMTAB */
+	uint64_t symtab;
+	/* number of dynamic symbols */
+	size_t count;
+	/* file offset of DT_STRTAB */
+	uint64_t strtab;
+	/* DT_STRSZ */
+	uint64_t strsz;
+	/* file offset of DT_VERSYM, 0 if the object has no versions */
+	uint64_t versym;
+	/* file offsets of the DT_GNU_HASH bloom filter, buckets and chains,
+	 * bloom is 0 if only DT_HASH is there */
+	uint64_t bloom;
+	uint64_t buckets;
+	uint64_t chains;
+	/* the DT_GNU_HASH header */
+	uint32_t nbuckets;
+	uint32_t symoffset;
+	uint32_t bloom_size;
+	uint32_t bloom_shift;
+	/* file offsets of the DT_HASH buckets and chains */
+	uint64_t sysv_buckets;
+	uint64_t sysv_chains;
+	/* number of DT_HASH buckets */
+	uint32_t sysv_nbuckets;
+	/* version index -> version, from DT_VERDEF and DT_VERNEED */
+	struct elf_version_t *versions;
+	/* number of versions */
+	size_t versions_count;
+	/* the next symbols owned by struct elf_store_t */
+	struct elf_symbols_t *next;
+};
+
+/* The ELF objects and symbols read, shared by the resolvers of every root
+ * so that identical files are only read once */
+struct elf_store_t {
+	/* file key or build id key -> struct elf_object_t*, NULL if the file is no usable ELF */
+	struct hashmap_t objects;
+	/* the objects of the map, they are owned here */
+	struct elf_object_t *objects_list;
+	/* file key or build id key -> struct elf_symbols_t*, NULL if the file has no usable symbols */
+	struct hashmap_t symbols;
+	/* the symbols of the map, they are owned here */
+	struct elf_symbols_t *symbols_list;
+	/* the counters and the throttling of the context owning the store, NULL for none */
+	struct stats_t *stats;
+	struct low_impact_t *low_impact;
+	/* protects everything */
+	pthread_mutex_t lock;
+};
+
+/* A dynamic loader found in the library directory */
+struct loader_t {
+	/* path of the loader, relative to the root it was found in */
+	char *path;
+	/* ELFCLASS32 or ELFCLASS64 */
+	unsigned char elfclass;
+	/* e_machine */
+	uint16_t machine;
+};
+
+/* Loader selection for --verify-with-ld */
+struct ld_bin_finder_t {
+	/* the loaders of the running system, enumerated once */
+	struct loader_t *loaders;
+	/* number of loaders */
+	size_t loaders_count;
+	/* "class:machine:interp" -> chosen loader path or NULL */
+	struct hashmap_t cache;
+	/* protects cache */
+	pthread_mutex_t lock;
+};
+
+/* Per root state of the native dependency resolver */
+struct resolver_t {
+	/* the installation root without trailing slash, empty for "/" */
+	char root_path[PATH_MAX];
+	/* real length of root_path */
+	size_t root_path_length;
+	/* soname -> NULL terminated array of paths from the ld.so.cache */
+	struct hashmap_t ld_cache;
+	/* directories listed in ld.so.conf and its includes */
+	char **conf_dirs;
+	/* number of conf_dirs */
+	size_t conf_dirs_count;
+	/* the loaders available inside the root */
+	struct loader_t *loaders;
+	/* number of loaders */
+	size_t loaders_count;
+	/* the parsed files, shared with the resolvers of the other roots */
+	struct elf_store_t *store;
+	/* path -> struct elf_object_t* of the store, NULL if the path is no usable ELF */
+	struct hashmap_t objects;
+	/* "class:machine:soname" -> path found in the system directories or NULL */
+	struct hashmap_t sonames;
+	/* path -> struct elf_symbols_t* of the store, NULL if the library has no usable symbols */
+	struct hashmap_t symbols;
+	/* flag set if the symbols get checked too */
+	int check_symbols;
+	/* protects objects, sonames and symbols, the rest is read only once initialized */
+	pthread_mutex_t lock;
+};
+
+/* The state of a dependency walk of resolver_check(), reused by a worker from file to file */
+struct resolver_walk_t {
+	/* the paths of the libraries loaded, they belong to the resolver */
+	struct hashmap_t visited;
+	/* needed soname -> the path it was found at or NULL, the names belong to the objects */
+	struct hashmap_t names;
+	/* the libraries to walk, in load order */
+	const char **queue;
+	/* allocated number of queue */
+	size_t queue_size;
+};
+
+/* Settings and caches shared by every check_package() call */
+struct check_context_t {
+	/* the alpm handle */
+	alpm_handle_t *handle;
+	/* the local database */
+	alpm_db_t *db_local;
+	/* the installation root */
+	const char *root_path;
+	/* the installation root opened with O_PATH, the files are looked up relative to it */
+	int root_fd;
+	/* the native dependency resolver */
+	struct resolver_t *resolver;
+	/* the loaders for --verify-with-ld, NULL if the dynamic loader isn't used */
+	struct ld_bin_finder_t *finder;
+	/* the verdicts of the previous run, NULL if caching is disabled */
+	const struct scan_cache_t *cache;
+	/* flag set if the libraries of the files are recorded, for the cache and --watch */
+	int deps;
+	/* flag sets color output */
+	int colors;
+	/* FORMAT_TREE or FORMAT_NDJSON */
+	int format;
+	/* flag set if the files get probed with io_uring */
+	int io_uring;
+	/* flag set if the workers only parse the ELF files for predict_breakage() */
+	int predict;
+	/* the root named in the reports when several roots get checked, else NULL */
+	const char *label;
+	/* the libraries of the installed packages, to tell the providers of missing ones */
+	struct soname_index_t *sonames;
+	/* the callback of the library getting the broken files instead of the reports, else NULL */
+	aurbrokenpkgcheck_callback_t callback;
+	/* the data of callback */
+	void *data;
+	/* the counters of --stats and --trace */
+	struct stats_t *stats;
+	/* the state of --low-impact */
+	struct low_impact_t *low_impact;
+};
+
+/* A package queued by check_package() */
+struct check_pkg_t {
+	/* package name */
+	const char *name;
+	/* number of files of the package not checked yet */
+	size_t remaining;
+	/* flag set once a file of the package is known to be broken */
+	int broken;
+};
+
+struct check_pool_t;
+
+/* A file probed ahead by struct check_probe_t */
+struct check_probe_file_t {
+	/* the statx result */
+	struct statx stx;
+	/* stx converted for check_file() */
+	struct stat statbuf;
+	/* result of statx, 1 until it completed */
+	int stat_res;
+	/* the opened file, -1 if it is not open */
+	int fd;
+	/* result of reading the header */
+	int read_res;
+	/* the first bytes of the file */
+	unsigned char header[SELFMAG];
+	/* 0 for an ELF file, 1 for any other file, -1 if unknown */
+	int elf;
+	/* flag set if statx completed */
+	int probed;
+};
+
+/* The batched probes of a worker, for --io-uring */
+struct check_probe_t {
+	/* the ring, its fd is -1 once it failed */
+	struct uring_t ring;
+	/* index of the first probed file in struct check_pool_t */
+	size_t first;
+	/* number of files probed */
+	size_t count;
+	/* the probed files */
+	struct check_probe_file_t files[PROBE_BATCH];
+};
+
+/* A directory kept open by a worker */
+struct check_dir_t {
+	/* the directory, relative to the root */
+	char name[PATH_MAX];
+	/* real length of name */
+	size_t length;
+	/* name opened with O_PATH, -1 if it is not open */
+	int fd;
+};
+
+/* What the resolver found for a file, shared with the copies of the file */
+struct check_result_t {
+	/* what resolver_check() returned */
+	int missing;
+	/* the problems one after the other, every name is followed by its message, all '\0' terminated */
+	char *problems;
+	/* number of problems */
+	size_t problems_count;
+	/* real length of problems */
+	size_t problems_length;
+	/* allocated length of problems, only for the result of struct check_worker_t */
+	size_t problems_size;
+	/* paths of the libraries the file was resolved to, they belong to the resolver */
+	const char **deps;
+	/* number of deps */
+	size_t deps_count;
+	/* allocated number of deps, only for the result of struct check_worker_t */
+	size_t deps_size;
+	/* flag set if a problem or a library could not be recorded */
+	int lost;
+	/* counts the growths of the buffers, only for the result of struct check_worker_t */
+	struct stats_t *stats;
+};
+
+/* A worker thread of struct check_pool_t */
+struct check_worker_t {
+	/* the thread */
+	pthread_t thread;
+	/* the pool the worker belongs to */
+	struct check_pool_t *pool;
+	/* the files [begin, end) left to this worker, the worker takes them
+	 * from the front while idle workers steal from the back */
+	size_t begin;
+	size_t end;
+	/* protects begin and end */
+	pthread_mutex_t lock;
+	/* the dynamic loaders confirming files, for --verify-with-ld */
+	struct exec_engine_t engine;
+	/* the batched probes, NULL without --io-uring */
+	struct check_probe_t *probe;
+	/* the directories of the last checked files */
+	struct check_dir_t dirs[CHECK_DIRS];
+	/* the slot of dirs replaced next */
+	size_t dirs_next;
+	/* the result being built, its buffers are reused from file to file */
+	struct check_result_t result;
+	/* the dependency walk, reused from file to file too */
+	struct resolver_walk_t walk;
+	/* the shared results and the libraries of the files, freed with the pool */
+	struct arena_t arena;
+};
+
+/* A file being confirmed by the dynamic loader */
+struct check_verify_t {
+	/* the pool the file belongs to */
+	struct check_pool_t *pool;
+	/* index of the file in the pool */
+	size_t index;
+	/* the report state of the file */
+	struct check_package_t cpt;
+	/* the parser of the loader error output */
+	struct stream_t st;
+	/* the checked filename */
+	char filename[PATH_MAX];
+};
+
+/* A soname in the reverse index of --targets */
+struct target_soname_t {
+	/* the soname, it points into the index key */
+	const char *name;
+	/* ELF class of the objects needing it */
+	unsigned char elfclass;
+	/* machine of the objects needing it */
+	uint16_t machine;
+	/* indexes of the foreign packages needing it */
+	size_t *packages;
+	/* number of packages */
+	size_t packages_count;
+	/* allocated number of packages */
+	size_t packages_size;
+};
+
+/* A soname the pending upgrades remove, for --predict */
+struct predict_soname_t {
+	/* the soname, it points into the key of the map of the removed sonames */
+	const char *name;
+	/* the installed package shipping it */
+	alpm_pkg_t *pkg;
+	/* the version of the package from the files databases, without it */
+	alpm_pkg_t *new_pkg;
+};
+
+/* A foreign package needing a removed soname */
+struct predict_break_t {
+	/* index of the package in the foreign packages */
+	size_t package;
+	/* the removed soname */
+	const struct predict_soname_t *soname;
+};
+
+/* A library file of an installed package, in struct soname_index_t */
+struct soname_provider_t {
+	/* the file name without its directory, it belongs to the alpm filelist */
+	const char *soname;
+	/* the owning package, it belongs to the alpm handle */
+	const char *package;
+	/* the next library with the same stem, the ones of a package follow each other */
+	struct soname_provider_t *next;
+};
+
+/* The libraries sharing a stem, "libfoo.so" for libfoo.so, libfoo.so.3 and libfoo.so.4.1 */
+struct soname_stem_t {
+	/* the libraries in package order */
+	struct soname_provider_t *first;
+	struct soname_provider_t *last;
+};
+
+/* The library files of the installed packages by stem, from their filelists
+ * Only the main thread uses it, it is built by the first lookup */
+struct soname_index_t {
+	/* the local database */
+	alpm_db_t *db_local;
+	/* flag set once the index is built */
+	int built;
+	/* stem -> struct soname_stem_t* */
+	struct hashmap_t stems;
+	/* the stems and the providers */
+	struct arena_t arena;
+	/* number of library files indexed */
+	size_t count;
+	/* how long the build took, in nanoseconds */
+	uint64_t build_time;
+};
+
+/* A buffered output that is only written at record boundaries */
+struct writer_t {
+	/* the file descriptor written to */
+	int fd;
+	/* flag set if every record is written at once, for terminals and
+	 * for outputs shared with the other writer */
+	int flush_records;
+	/* the buffered records */
+	char *data;
+	/* bytes buffered */
+	size_t length;
+	/* bytes allocated */
+	size_t size;
+};
+
+/* Checks the queued files on several threads, reports in queue order */
+struct check_pool_t {
+	/* the context passed to every check */
+	struct check_context_t *ctx;
+	/* the queued files, in package order */
+	struct check_file_t *files;
+	/* number of files */
+	size_t files_count;
+	/* allocated number of files */
+	size_t files_size;
+	/* the queued packages */
+	struct check_pkg_t *pkgs;
+	/* number of packages */
+	size_t pkgs_count;
+	/* allocated number of packages */
+	size_t pkgs_size;
+	/* the workers */
+	struct check_worker_t *workers;
+	/* number of workers */
+	size_t workers_count;
+	/* protects the remaining counters and the broken flags of the packages */
+	pthread_mutex_t lock;
+	/* signaled whenever a package is done, and when the pool stops */
+	pthread_cond_t done;
+	/* number of broken packages after which the pool stops, 0 for no limit */
+	size_t limit;
+	/* number of packages known to be broken */
+	size_t broken;
+	/* flag set once limit is reached, the workers take no new files */
+	int stop;
+	/* the standard output, package names or records */
+	struct writer_t out;
+	/* the error output, the reports of the tree format */
+	struct writer_t err;
+	/* "inode:dev:ino" and "build-id:hex" -> struct check_result_t*, for the copies
+	 * of a file, the results belong to the arenas of the workers */
+	struct hashmap_t results;
+	/* protects results */
+	pthread_mutex_t results_lock;
+};
+
+/* The state of --watch, kept between the passes */
+struct watch_t {
+	/* the inotify instance */
+	int fd;
+	/* the context, every pass opens a new alpm handle from its configuration */
+	struct aurbrokenpkgcheck_t *abc;
+	/* the eventfd of aurbrokenpkgcheck_cancel() */
+	int wake;
+	/* the lock held by pacman during a transaction */
+	char lock_path[PATH_MAX];
+	/* the watches of /etc and /etc/ld.so.conf.d, for the loader configuration */
+	int etc_wd;
+	int conf_wd;
+	/* directory inside the root -> NULL, the watched directories */
+	struct hashmap_t dirs;
+	/* library file name -> struct hashmap_t* of the names of the packages needing it */
+	struct hashmap_t dependents;
+	/* package name -> non NULL if the package is broken */
+	struct hashmap_t broken;
+	/* names of the files changed in the watched directories since the last pass */
+	struct hashmap_t changed;
+	/* "name version installdate" -> NULL, the packages to check as of the last pass */
+	struct hashmap_t installed;
+	/* flag set if events were lost or ld.so.conf changed, every package gets checked again */
+	int overflow;
+};
+
+/* A foreign package ranked by how likely it is broken, for --limit */
+struct foreign_priority_t {
+	/* index of the package in the foreign packages */
+	size_t package;
+	/* how much later than the package its dependencies were installed, in seconds */
+	int64_t score;
+};
+
+/* A timed phase of the run */
+struct stats_phase_t {
+	/* the phase name */
+	const char *name;
+	/* when the phase started */
+	uint64_t start;
+	/* how long it took */
+	uint64_t duration;
+};
+
+/* The timing of a package for --stats and --trace */
+struct stats_package_t {
+	/* index of the package in struct check_pool_t */
+	size_t package;
+	/* when its first file started */
+	uint64_t start;
+	/* when its last file ended */
+	uint64_t end;
+	/* the time taken by all its files */
+	uint64_t busy;
+};
+
+/* The counters of --stats and --trace */
+struct stats_t {
+	/* flag set if anything gets counted */
+	int enabled;
+	/* when the run started, in nanoseconds */
+	uint64_t origin;
+	/* processes started */
+	uint64_t spawns;
+	/* stat() and fstat() calls */
+	uint64_t stat_calls;
+	/* open() and fopen() calls */
+	uint64_t open_calls;
+	/* read() calls */
+	uint64_t read_calls;
+	/* mmap() calls */
+	uint64_t map_calls;
+	/* bytes read or mapped to be parsed */
+	uint64_t bytes;
+	/* ELF objects parsed */
+	uint64_t elf_objects;
+	/* files answered by the cache */
+	uint64_t cached_files;
+	/* files answered by a copy checked before */
+	uint64_t shared_files;
+	/* io_uring_enter() calls and the operations they submitted */
+	uint64_t uring_enters;
+	uint64_t uring_ops;
+	/* heap allocations made to record the results of the files */
+	uint64_t allocations;
+	/* the phases of the run in order */
+	struct stats_phase_t phases[STATS_PHASES_MAX];
+	/* number of phases */
+	size_t phases_count;
+};
+
+/* The state of --low-impact, shared by the workers */
+struct low_impact_t {
+	/* flag set for --low-impact */
+	int enabled;
+	/* flag set if the kernel reports the pressure stall information */
+	int available;
+	/* protects the fields up to the counters */
+	pthread_mutex_t lock;
+	/* the stall totals of cpu, io and memory at the last sample, in microseconds */
+	uint64_t stalls[LOW_IMPACT_RESOURCES];
+	/* when the pressure was sampled last and when it gets sampled next, in nanoseconds */
+	uint64_t sampled;
+	uint64_t next_sample;
+	/* the workers wait until then when a single one is too much already */
+	uint64_t paused_until;
+	/* number of workers of the pool */
+	size_t workers;
+	/* number of workers allowed to take files */
+	size_t active;
+	/* the fewest workers allowed during the run */
+	size_t fewest;
+	/* flag set once a worker found no files left, the waiting ones can end */
+	int drained;
+	/* number of samples and of samples over LOW_IMPACT_PRESSURE */
+	uint64_t samples;
+	uint64_t high_samples;
+	/* time the workers spent waiting, in nanoseconds */
+	uint64_t waited;
+	/* files dropped from the page cache once read */
+	uint64_t dropped;
+};
+
+/* The context of the library, see aurbrokenpkgcheck.h */
+struct aurbrokenpkgcheck_t {
+	/* the alpm handle of the caller or of aurbrokenpkgcheck_open(), NULL for none */
+	alpm_handle_t *handle;
+	/* flag set if handle was opened by aurbrokenpkgcheck_open() and gets released here */
+	int owned;
+	/* the configuration of aurbrokenpkgcheck_open() */
+	struct pacman_config_t conf;
+	/* the installation root of handle */
+	const char *root_path;
+	/* number of workers */
+	size_t jobs;
+	/* the AURBROKENPKGCHECK_* flags */
+	int flags;
+	/* the packages checked, NULL for the foreign ones */
+	const struct aurbrokenpkgcheck_filter_t *filter;
+	/* the transaction targets, package name -> NULL */
+	struct hashmap_t targets;
+	/* flag set if only the packages affected by the targets get checked */
+	int use_targets;
+	/* number of broken packages after which a check stops, 0 for no limit */
+	size_t limit;
+	/* the reports printed without a callback, FORMAT_TREE or FORMAT_NDJSON */
+	int format;
+	/* flag sets color output */
+	int colors;
+	/* flag set if the reports name the root */
+	int label;
+	/* the file of aurbrokenpkgcheck_trace() or NULL */
+	char *trace;
+	/* flag set once the statistics of the opened root were printed, the next check counts again */
+	int reported;
+	/* every thread updates the counters, they are only read once the workers are done */
+	struct stats_t stats;
+	/* the state of AURBROKENPKGCHECK_LOW_IMPACT */
+	struct low_impact_t low_impact;
+	/* the loaders of AURBROKENPKGCHECK_VERIFY_WITH_LD */
+	struct ld_bin_finder_t finder;
+	/* the parsed files, kept from check to check and from root to root */
+	struct elf_store_t store;
+	/* protects pool and canceled */
+	pthread_mutex_t lock;
+	/* the pool of the running check, else NULL */
+	struct check_pool_t *pool;
+	/* flag set once the running check is canceled */
+	int canceled;
+	/* eventfd written by aurbrokenpkgcheck_cancel(), it wakes aurbrokenpkgcheck_watch(), -1 if it failed */
+	int wake;
+};
+
+/* STRUCTURES */
+
+/*
+ * error handler
+ */
+static inline int error_handler(const char* function_name) {
+	perror(function_name);
+	return errno;
+}
+
+/*
+ * Monotonic time in nanoseconds
+ */
+static inline uint64_t stats_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Starts timing a phase of the run, it lasts until the next one starts
+ * or stats_phase_end() is called
+ */
+static void stats_phase_begin(struct stats_t *stats, const char *name) {
+	struct stats_phase_t *phase;
+	uint64_t now;
+	if (!stats->enabled) return;
+	now = stats_now();
+	if (stats->phases_count) {
+		phase = stats->phases + stats->phases_count - 1;
+		if (!phase->duration) phase->duration = now - phase->start;
+	}
+	if (stats->phases_count == STATS_PHASES_MAX) return;
+	phase = stats->phases + stats->phases_count++;
+	phase->name = name;
+	phase->start = now;
+	phase->duration = 0;
+}
+
+/*
+ * Starts counting again from zero, the phases included
+ */
+static void stats_reset(struct stats_t *stats) {
+	int enabled = stats->enabled;
+	memset(stats, 0, sizeof(struct stats_t));
+	if ((stats->enabled = enabled)) stats->origin = stats_now();
+}
+
+/*
+ * Ends the phase started last
+ */
+static void stats_phase_end(struct stats_t *stats) {
+	struct stats_phase_t *phase;
+	if (!stats->enabled || !stats->phases_count) return;
+	phase = stats->phases + stats->phases_count - 1;
+	if (!phase->duration) phase->duration = stats_now() - phase->start;
+}
+
+/*
+ * Reads the total time some tasks stalled on a resource, from /proc/pressure
+ * Anything other than 0 returned is an error
+ */
+static int low_impact_stall(const char *resource, uint64_t *total) {
+	char path[64], buffer[BUFFER_SIZE], *field;
+	ssize_t length;
+	int fd;
+	snprintf(path, sizeof(path), "/proc/pressure/%s", resource);
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) return 1;
+	length = read(fd, buffer, sizeof(buffer) - 1);
+	close(fd);
+	if (length <= 0) return 1;
+	buffer[length] = 0;
+	/* The first line is "some avg10=... avg60=... avg300=... total=..." */
+	if (strncmp(buffer, "some ", 5) || !(field = strstr(buffer, " total="))) return 1;
+	*total = strtoull(field + 7, NULL, 10);
+	return 0;
+}
+
+/*
+ * Reads the stall totals of cpu, io and memory
+ * Anything other than 0 returned is an error
+ */
+static int low_impact_stalls(uint64_t *totals) {
+	static const char *const resources[LOW_IMPACT_RESOURCES] = { "cpu", "io", "memory" };
+	size_t i;
+	for (i = 0; i < LOW_IMPACT_RESOURCES; ++i) {
+		if (low_impact_stall(resources[i], totals + i)) return 1;
+	}
+	return 0;
+}
+
+/*
+ * Enables --low-impact: the process and everything it starts get the idle IO priority
+ */
+static void low_impact_init(struct low_impact_t *low_impact) {
+	low_impact->enabled = 1;
+	pthread_mutex_init(&low_impact->lock, NULL);
+	if (syscall(SYS_ioprio_set, LOW_IMPACT_IOPRIO_WHO_PROCESS, 0,
+		LOW_IMPACT_IOPRIO_CLASS_IDLE << LOW_IMPACT_IOPRIO_CLASS_SHIFT) < 0)
+		error_handler("ioprio_set()");
+	if (!(low_impact->available = !low_impact_stalls(low_impact->stalls)))
+		fprintf(stderr, "No pressure stall information, the workers are not throttled\n");
+}
+
+/*
+ * Starts a check on workers workers, all of them are allowed at first
+ */
+static void low_impact_reset(struct low_impact_t *low_impact, size_t workers) {
+	if (!low_impact->enabled) return;
+	low_impact->workers = low_impact->active = low_impact->fewest = workers;
+	low_impact->sampled = stats_now();
+	low_impact->next_sample = low_impact->sampled + LOW_IMPACT_SAMPLE_MS * 1000000ULL;
+	low_impact->paused_until = 0;
+	low_impact->drained = 0;
+	low_impact->samples = low_impact->high_samples = 0;
+	low_impact->waited = low_impact->dropped = 0;
+	if (low_impact->available) low_impact_stalls(low_impact->stalls);
+}
+
+/*
+ * Turns the stalls since the last sample into a pressure and adapts the workers
+ * Half of the workers stop taking files while the pressure is over LOW_IMPACT_PRESSURE
+ * percents, and one comes back at every sample under half of it
+ * A single worker still too much is paused for LOW_IMPACT_PAUSE_MS, then runs
+ * until the next sample, so the check ends even on a system always under pressure
+ * Needs low_impact->lock
+ */
+static void low_impact_sample(struct low_impact_t *low_impact, uint64_t now) {
+	uint64_t stalls[LOW_IMPACT_RESOURCES], pressure, elapsed;
+	size_t i;
+	low_impact->next_sample = now + LOW_IMPACT_SAMPLE_MS * 1000000ULL;
+	if (!low_impact->available || low_impact_stalls(stalls)) return;
+	/* The highest share of the elapsed time some tasks stalled on a resource */
+	elapsed = (now - low_impact->sampled) / 1000 + 1;
+	for (i = 0, pressure = 0; i < LOW_IMPACT_RESOURCES; ++i) {
+		if (stalls[i] >= low_impact->stalls[i] && (stalls[i] - low_impact->stalls[i]) * 100 / elapsed > pressure)
+			pressure = (stalls[i] - low_impact->stalls[i]) * 100 / elapsed;
+		low_impact->stalls[i] = stalls[i];
+	}
+	low_impact->sampled = now;
+	++low_impact->samples;
+	if (pressure >= LOW_IMPACT_PRESSURE) {
+		++low_impact->high_samples;
+		if (low_impact->active > 1) low_impact->active /= 2;
+		else {
+			low_impact->paused_until = now + LOW_IMPACT_PAUSE_MS * 1000000ULL;
+			low_impact->next_sample = low_impact->paused_until + LOW_IMPACT_SAMPLE_MS * 1000000ULL;
+		}
+		if (low_impact->active < low_impact->fewest) low_impact->fewest = low_impact->active;
+	}
+	else if (pressure < LOW_IMPACT_PRESSURE / 2 && low_impact->active < low_impact->workers) ++low_impact->active;
+}
+
+/*
+ * Waits until the worker of index worker may take files
+ */
+static void low_impact_pace(struct low_impact_t *low_impact, size_t worker) {
+	const struct timespec sleep = { 0, LOW_IMPACT_SLEEP_MS * 1000000L };
+	uint64_t start, now;
+	int allowed;
+	if (!low_impact->enabled) return;
+	for (start = now = stats_now(); ; now = stats_now()) {
+		pthread_mutex_lock(&low_impact->lock);
+		if (now >= low_impact->next_sample) low_impact_sample(low_impact, now);
+		allowed = (worker < low_impact->active && now >= low_impact->paused_until) || low_impact->drained;
+		pthread_mutex_unlock(&low_impact->lock);
+		if (allowed) break;
+		nanosleep(&sleep, NULL);
+	}
+	if (now > start) __atomic_fetch_add(&low_impact->waited, now - start, __ATOMIC_RELAXED);
+}
+
+/*
+ * Lets the waiting workers end, there is no file left to take
+ */
+static void low_impact_drain(struct low_impact_t *low_impact) {
+	if (!low_impact->enabled) return;
+	pthread_mutex_lock(&low_impact->lock);
+	low_impact->drained = 1;
+	pthread_mutex_unlock(&low_impact->lock);
+}
+
+/*
+ * Called after opening a file to read, tells the kernel the pages won't be needed again
+ * low_impact may be NULL, the files are read like without --low-impact then
+ * Returns 1 if the start of the file was in the page cache already, then it
+ * stays there, 0 if low_impact_end() should drop it again
+ */
+static int low_impact_begin(struct low_impact_t *low_impact, int fd) {
+	struct iovec iov;
+	char byte;
+	if (!low_impact || !low_impact->enabled) return 1;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_NOREUSE);
+	/* RWF_NOWAIT fails instead of reading from the disk */
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+	return preadv2(fd, &iov, 1, 0, RWF_NOWAIT) >= 0 || errno != EAGAIN;
+}
+
+/*
+ * Drops the pages of a file the check read into the page cache, cached is what
+ * low_impact_begin() returned, mapped pages are kept by the kernel
+ */
+static void low_impact_end(struct low_impact_t *low_impact, int fd, int cached) {
+	if (cached) return;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	__atomic_fetch_add(&low_impact->dropped, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Prints how much --low-impact throttled the check of a root
+ */
+static void low_impact_print(const struct low_impact_t *low_impact) {
+	if (!low_impact->enabled) return;
+	fprintf(stderr, "%-8s : %.0f ms waited, %llu of %llu samples over %d%% pressure, "
+		"%zu of %zu workers at the lowest, %llu files dropped from the page cache\n",
+		"Throttle", (double)low_impact->waited / 1e6,
+		(unsigned long long)low_impact->high_samples, (unsigned long long)low_impact->samples,
+		LOW_IMPACT_PRESSURE, low_impact->fewest, low_impact->workers, (unsigned long long)low_impact->dropped);
+}
+
+/*
+ * Init the struct stream_t
+ */
+static inline void stream_parser_init(struct stream_t *st) {
+	memset(st, 0, sizeof(struct stream_t));
+	st->beg = 1;
+}
+
+/*
+ * Frees the buffer of the struct stream_t
+ */
+static void stream_parser_free(struct stream_t *st) {
+	free(st->buffer);
+	st->buffer = NULL;
+	st->size = st->length = 0;
+}
+
+/*
+ * Sets up the search of st->delims, a few delimiters are searched with
+ * memchr() which scans many bytes at once, more go through a table
+ */
+static void stream_parser_delims(struct stream_t *st) {
+	size_t count = strlen(st->delims), i;
+	st->searched_delims = st->delims;
+	st->searched_count = count <= STREAM_DELIMS_MAX ? count : 0;
+	for (i = 0; i < st->searched_count; ++i) st->searched[i] = NULL;
+	if (st->searched_count) return;
+	memset(st->table, 0, sizeof(st->table));
+	for (i = 0; i < count; ++i) st->table[(unsigned char)st->delims[i]] = 1;
+}
+
+/*
+ * Returns the first delimiter in [from, end), end if there is none
+ * Every delimiter remembers where memchr() found it, so each byte is only
+ * scanned once per delimiter whatever the number of tokens
+ */
+static char *stream_parser_find(struct stream_t *st, char *from, char *end) {
+	char *first;
+	size_t i;
+	if (!st->searched_count) {
+		for (; from < end && !st->table[(unsigned char)*from]; ++from) ;
+		return from;
+	}
+	first = end;
+	for (i = 0; i < st->searched_count; ++i) {
+		if (!st->searched[i] || st->searched[i] < from) {
+			st->searched[i] = memchr(from, st->delims[i], (size_t)(end - from));
+			if (!st->searched[i]) st->searched[i] = end;
+		}
+		if (st->searched[i] < first) first = st->searched[i];
+	}
+	return first;
+}
+
+/*
+ * Hands a whole token of the buffer to the callback
+ * delim is the delimiter that ended the token, '\0' at the end of the stream
+ */
+static void stream_parser_token(struct stream_t *st, char *token, size_t length, char delim) {
+	st->string = token;
+	st->string_length = length;
+	st->string_delim = delim;
+	st->string[length] = '\0';
+	st->beg = 1;
+	st->end = delim != '\0';
+	st->callback(st);
+	if (st->end) ++st->pos;
+}
+
+/*
+ * Reads one block from fd and hands its complete tokens to the callback
+ * The token left unfinished at the end of the block stays in the buffer,
+ * which grows as needed, so the callback always gets whole tokens
+ * At the end of the stream the last token is handed over without delimiter
+ * The states between blocks are stored in struct stream_t, so blocks of
+ * different streams may be interleaved as long as each has its own struct
+ * Returns the result of read()
+ */
+static ssize_t stream_parser_read(int fd, struct stream_t *st) {
+	char *grown, *token, *end, *p;
+	size_t size;
+	ssize_t length;
+	if (!st->delims) st->delims = "\r\n";
+	/* Keep a whole block free after the unfinished token, and a byte for '\0' */
+	if (st->size - st->length < STREAM_BUFFER_SIZE) {
+		for (size = st->size ? st->size * 2 : STREAM_BUFFER_SIZE + 1;
+			size - st->length < STREAM_BUFFER_SIZE; size *= 2) ;
+		if (!(grown = realloc(st->buffer, size))) {
+			error_handler("realloc()");
+			return -1;
+		}
+		st->buffer = grown;
+		st->size = size;
+	}
+	if ((length = read(fd, st->buffer + st->length, st->size - st->length - 1)) < 0) return length;
+	if (!length) {
+		if (st->length) stream_parser_token(st, st->buffer, st->length, '\0');
+		st->length = 0;
+		return length;
+	}
+	end = st->buffer + st->length + length;
+	/* The unfinished token has no delimiter, only the new bytes are searched */
+	if (st->delims != st->searched_delims) stream_parser_delims(st);
+	else memset(st->searched, 0, sizeof(st->searched));
+	for (token = st->buffer, p = st->buffer + st->length;
+		(p = stream_parser_find(st, p, end)) < end;
+		token = ++p) {
+		stream_parser_token(st, token, (size_t)(p - token), *p);
+		/* The callback may have changed the delimiters */
+		if (st->delims != st->searched_delims) stream_parser_delims(st);
+	}
+	st->length = (size_t)(end - token);
+	memmove(st->buffer, token, st->length);
+	return length;
+}
+
+/*
+ * Inits the engine, at most max_children run at the same time, stats, if not
+ * NULL, counts the children and the reads of their outputs
+ * Anything other than 0 returned is an error
+ */
+static int exec_engine_init(struct exec_engine_t *engine, size_t max_children, struct stats_t *stats) {
+	memset(engine, 0, sizeof(struct exec_engine_t));
+	engine->max_children = max_children ? max_children : 1;
+	engine->stats = stats;
+	if (!(engine->children = calloc(engine->max_children, sizeof(struct exec_child_t)))
+		|| !(engine->pollfds = calloc(2 * engine->max_children, sizeof(struct pollfd)))) {
+		free(engine->children);
+		return error_handler("calloc()");
+	}
+	return 0;
+}
+
+/*
+ * Frees the engine, every child must have been waited for
+ */
+static void exec_engine_free(struct exec_engine_t *engine) {
+	free(engine->children);
+	free(engine->pollfds);
+}
+
+/*
+ * Reads what is available on one pipe of a child
+ * The pipe is closed once the end of the stream is reached
+ */
+static void exec_engine_read(struct exec_engine_t *engine, struct exec_child_t *child, int index) {
+	char buffer[BUFFER_SIZE];
+	ssize_t length;
+	STATS_ADD(engine->stats, read_calls, 1);
+	if (child->streams[index]) {
+		if ((length = stream_parser_read(child->fds[index], child->streams[index])) > 0)
+			STATS_ADD(engine->stats, bytes, length);
+	}
+	/* Nobody is interested, just consume the output */
+	else length = read(child->fds[index], buffer, BUFFER_SIZE);
+	if (length < 0 && (errno == EAGAIN || errno == EINTR)) return;
+	if (length <= 0) {
+		close(child->fds[index]);
+		child->fds[index] = -1;
+	}
+}
+
+/*
+ * Waits up to timeout milliseconds (-1 for ever) for output of the children
+ * and dispatches it, children whose pipes are both closed are reaped and
+ * their exited callback is called
+ * Anything other than 0 returned is an error
+ */
+static int exec_engine_poll(struct exec_engine_t *engine, int timeout) {
+	struct exec_child_t *child;
+	size_t i, nfds;
+	int wstatus, ret;
+	if (!engine->running) return 0;
+	for (i = 0, nfds = 0; i < engine->max_children; ++i) {
+		child = engine->children + i;
+		if (!child->pid) continue;
+		if (child->fds[0] >= 0) {
+			engine->pollfds[nfds].fd = child->fds[0];
+			engine->pollfds[nfds++].events = POLLIN;
+		}
+		if (child->fds[1] >= 0) {
+			engine->pollfds[nfds].fd = child->fds[1];
+			engine->pollfds[nfds++].events = POLLIN;
+		}
+	}
+	if (nfds && (ret = poll(engine->pollfds, nfds, timeout)) < 0) {
+		if (errno == EINTR) return 0;
+		return error_handler("poll()");
+	}
+	for (i = 0, nfds = 0; i < engine->max_children; ++i) {
+		child = engine->children + i;
+		if (!child->pid) continue;
+		if (child->fds[0] >= 0 && engine->pollfds[nfds++].revents) exec_engine_read(engine, child, 0);
+		if (child->fds[1] >= 0 && engine->pollfds[nfds++].revents) exec_engine_read(engine, child, 1);
+		if (child->fds[0] >= 0 || child->fds[1] >= 0) continue;
+		/* Both outputs are closed, the child is done */
+		ret = -1;
+		if (waitpid(child->pid, &wstatus, 0) < 0) error_handler("waitpid()");
+		else if (WIFEXITED(wstatus)) ret = WEXITSTATUS(wstatus);
+		child->pid = 0;
+		--engine->running;
+		if (child->exited) child->exited(ret, child->data);
+	}
+	return 0;
+}
+
+/*
+ * Waits for every child of the engine
+ * Anything other than 0 returned is an error
+ */
+static int exec_engine_wait(struct exec_engine_t *engine) {
+	while (engine->running) {
+		if (exec_engine_poll(engine, -1)) return 1;
+	}
+	return 0;
+}
+
+/*
+ * Spawns a command delegating stdout and stderr output to stream parsers
+ * NULL may be used for the streams to discard the output
+ * exited is called with the program exit code, or -1 if it did not exit
+ * normally, once it's done, it must not spawn children on the same engine
+ * If all the slots are used, this waits for a child to finish first
+ * Anything other than 0 returned is an error and exited won't be called
+ */
+static int exec_engine_spawn(
+	struct exec_engine_t *engine,
+	char *const* argv,
+	struct stream_t *stdout_st,
+	struct stream_t *stderr_st,
+	void (*exited)(int, void *),
+	void *data) {
+	posix_spawn_file_actions_t actions;
+	struct exec_child_t *child;
+	int stdout_pipefd[2], stderr_pipefd[2], ret;
+	size_t i;
+	while (engine->running == engine->max_children) {
+		if (exec_engine_poll(engine, -1)) return 1;
+	}
+	for (i = 0; engine->children[i].pid; ++i) ;
+	child = engine->children + i;
+	/* Other threads may spawn at the same time, the pipes must not leak into their children */
+	if (pipe2(stdout_pipefd, O_CLOEXEC) < 0) return error_handler("pipe()");
+	if (pipe2(stderr_pipefd, O_CLOEXEC) < 0) {
+		close(stdout_pipefd[0]); close(stdout_pipefd[1]);
+		return error_handler("pipe()");
+	}
+	/* dup2() clears O_CLOEXEC on the standard outputs of the child */
+	if (!(ret = posix_spawn_file_actions_init(&actions))) {
+		posix_spawn_file_actions_addclose(&actions, STDIN_FILENO);
+		posix_spawn_file_actions_adddup2(&actions, stdout_pipefd[1], STDOUT_FILENO);
+		posix_spawn_file_actions_adddup2(&actions, stderr_pipefd[1], STDERR_FILENO);
+		ret = posix_spawnp(&child->pid, argv[0], &actions, NULL, argv, environ);
+		posix_spawn_file_actions_destroy(&actions);
+		STATS_ADD(engine->stats, spawns, 1);
+	}
+	close(stdout_pipefd[1]);
+	close(stderr_pipefd[1]);
+	if (ret) {
+		close(stdout_pipefd[0]);
+		close(stderr_pipefd[0]);
+		child->pid = 0;
+		errno = ret;
+		return error_handler(argv[0]);
+	}
+	/* poll() tells when to read, a read must never block the other children */
+	fcntl(stdout_pipefd[0], F_SETFL, O_NONBLOCK);
+	fcntl(stderr_pipefd[0], F_SETFL, O_NONBLOCK);
+	child->fds[0] = stdout_pipefd[0];
+	child->fds[1] = stderr_pipefd[0];
+	child->streams[0] = stdout_st;
+	child->streams[1] = stderr_st;
+	child->exited = exited;
+	child->data = data;
+	++engine->running;
+	return 0;
+}
+
+/*
+ * Frees the ring, operations still in flight are cancelled by the kernel
+ */
+static void uring_free(struct uring_t *ring) {
+	if (ring->sqes) munmap(ring->sqes, ring->sqes_size);
+	if (ring->map) munmap(ring->map, ring->map_size);
+	if (ring->fd >= 0) close(ring->fd);
+	memset(ring, 0, sizeof(struct uring_t));
+	ring->fd = -1;
+}
+
+/*
+ * Tells whether the kernel of the ring supports every operation of ops
+ * Kernels older than 5.6 have no probe, nor most of the file operations
+ */
+static int uring_supports(const struct uring_t *ring, const uint8_t *ops, size_t ops_count) {
+	struct io_uring_probe *probe;
+	size_t i;
+	int supported;
+	if (!(probe = calloc(1, sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op)))) {
+		error_handler("calloc()");
+		return 0;
+	}
+	supported = !syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST);
+	for (i = 0; supported && i < ops_count; ++i)
+		supported = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+	return supported;
+}
+
+/*
+ * Sets up an io_uring with room for entries submissions, with the raw system
+ * calls since liburing is not needed for the few operations used here
+ * ops are the operations that will be submitted, the kernel must support all of them
+ * stats, if not NULL, counts the system calls of the ring
+ * Anything other than 0 returned means io_uring is not available
+ */
+static int uring_init(
+	struct uring_t *ring,
+	unsigned entries,
+	const uint8_t *ops,
+	size_t ops_count,
+	struct stats_t *stats) {
+	struct io_uring_params params;
+	unsigned char *map;
+	size_t sq_size, cq_size;
+	memset(ring, 0, sizeof(struct uring_t));
+	ring->stats = stats;
+	memset(&params, 0, sizeof(struct io_uring_params));
+	if ((ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params)) < 0) {
+		ring->fd = -1;
+		return 1;
+	}
+	/* 5.4 and 5.5 set up rings but would fail every file operation with -EINVAL */
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !uring_supports(ring, ops, ops_count)) {
+		uring_free(ring);
+		return 1;
+	}
+	sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->map_size = sq_size > cq_size ? sq_size : cq_size;
+	map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (map == MAP_FAILED) {
+		ring->map = NULL;
+		uring_free(ring);
+		return 1;
+	}
+	ring->map = map;
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		uring_free(ring);
+		return 1;
+	}
+	ring->sq_head = (unsigned *)(map + params.sq_off.head);
+	ring->sq_tail = (unsigned *)(map + params.sq_off.tail);
+	ring->sq_mask = *(unsigned *)(map + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(map + params.sq_off.array);
+	ring->cq_head = (unsigned *)(map + params.cq_off.head);
+	ring->cq_tail = (unsigned *)(map + params.cq_off.tail);
+	ring->cq_mask = *(unsigned *)(map + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(map + params.cq_off.cqes);
+	ring->entries = params.sq_entries;
+	return 0;
+}
+
+/*
+ * Returns a cleared submission entry, it is queued by uring_run()
+ * NULL is returned if the submission ring is full
+ */
+static struct io_uring_sqe *uring_sqe(struct uring_t *ring, uint64_t user_data) {
+	struct io_uring_sqe *sqe;
+	unsigned tail = *ring->sq_tail + ring->pending;
+	if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->entries) return NULL;
+	sqe = ring->sqes + (tail & ring->sq_mask);
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->user_data = user_data;
+	ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+	++ring->pending;
+	return sqe;
+}
+
+/*
+ * Submits the queued entries and waits for expected completions,
+ * complete is called with the user data and the result of each of them
+ * Anything other than 0 returned is an error, the ring must not be used anymore
+ */
+static int uring_run(
+	struct uring_t *ring,
+	size_t expected,
+	void (*complete)(uint64_t, int, void *),
+	void *data) {
+	struct io_uring_cqe *cqe;
+	unsigned head;
+	long submitted;
+	/* The entries are visible to the kernel once the tail moves */
+	__atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->pending, __ATOMIC_RELEASE);
+	while (expected) {
+		STATS_ADD(ring->stats, uring_enters, 1);
+		STATS_ADD(ring->stats, uring_ops, ring->pending);
+		submitted = syscall(__NR_io_uring_enter, ring->fd, ring->pending, expected, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (submitted < 0) {
+			if (errno == EINTR) continue;
+			return error_handler("io_uring_enter()");
+		}
+		ring->pending -= (unsigned)submitted;
+		head = *ring->cq_head;
+		for (; expected && head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE); ++head, --expected) {
+			cqe = ring->cqes + (head & ring->cq_mask);
+			complete(cqe->user_data, cqe->res, data);
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+/*
+ * Appends a copy of value to a string array
+ * Anything other than 0 returned is an error
+ */
+static int pacman_config_append(char ***array, size_t *count, const char *value) {
+	char **grown;
+	if (!(grown = realloc(*array, (*count + 1) * sizeof(char *)))) return error_handler("realloc()");
+	*array = grown;
+	if (!(grown[*count] = strdup(value))) return error_handler("strdup()");
+	++*count;
+	return 0;
+}
+
+/*
+ * Stores the option key of the [options] section, if it is one we use
+ * Anything other than 0 returned is an error
+ */
+static int pacman_config_option(struct pacman_config_t *conf, const char *key, char *value) {
+	struct utsname name;
+	char *arch, *save;
+	if (!strcmp(key, "RootDir")) {
+		strncpy(conf->root_path, value, PATH_MAX - 1);
+	}
+	else if (!strcmp(key, "DBPath")) {
+		strncpy(conf->db_path, value, PATH_MAX - 1);
+	}
+	else if (!strcmp(key, "Architecture")) {
+		for (arch = strtok_r(value, " \t", &save); arch; arch = strtok_r(NULL, " \t", &save)) {
+			/* auto stands for the machine we run on */
+			if (!strcmp(arch, "auto")) {
+				if (uname(&name) < 0) return error_handler("uname()");
+				arch = name.machine;
+			}
+			if (pacman_config_append(&conf->architectures, &conf->architectures_count, arch))
+				return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Parses a pacman.conf file, Include directives are followed up to
+ * PACMAN_CONF_MAX_DEPTH levels and keep the section they appear in
+ * Anything other than 0 returned is an error
+ */
+static int pacman_config_parse(struct pacman_config_t *conf, const char *path, int depth, struct stats_t *stats) {
+	FILE *in;
+	glob_t paths;
+	char *line, *key, *value, *end;
+	size_t line_size, i;
+	int ret;
+	STATS_ADD(stats, open_calls, 1);
+	if (!(in = fopen(path, "r"))) return error_handler(path);
+	line = NULL;
+	line_size = 0;
+	ret = 0;
+	while (!ret && getline(&line, &line_size, in) > 0) {
+		/* Comments go up to the end of the line */
+		if ((end = strchr(line, '#'))) *end = 0;
+		for (key = line; isspace((unsigned char)*key); ++key) ;
+		for (end = key + strlen(key); end > key && isspace((unsigned char)end[-1]); --end) ;
+		*end = 0;
+		if (!*key) continue;
+		if (*key == '[' && end[-1] == ']') {
+			end[-1] = 0;
+			/* Every section but [options] is a repository */
+			if ((conf->options = !strcmp(key + 1, "options"))) continue;
+			for (i = 0; i < conf->repos_count && strcmp(conf->repos[i], key + 1); ++i) ;
+			if (i == conf->repos_count) ret = pacman_config_append(&conf->repos, &conf->repos_count, key + 1);
+			continue;
+		}
+		value = NULL;
+		if ((end = strchr(key, '='))) {
+			for (value = end + 1; isspace((unsigned char)*value); ++value) ;
+			for (; end > key && isspace((unsigned char)end[-1]); --end) ;
+			*end = 0;
+		}
+		if (!value) continue;
+		if (!strcmp(key, "Include")) {
+			if (depth >= PACMAN_CONF_MAX_DEPTH) continue;
+			if (glob(value, 0, NULL, &paths)) continue;
+			for (i = 0; i < paths.gl_pathc && !ret; ++i)
+				ret = pacman_config_parse(conf, paths.gl_pathv[i], depth + 1, stats);
+			globfree(&paths);
+		}
+		else if (conf->options) ret = pacman_config_option(conf, key, value);
+	}
+	free(line);
+	fclose(in);
+	return ret;
+}
+
+/*
+ * Reads the pacman configuration the way pacman does
+ * root_path and db_path override the configuration if they are set, the
+ * database path defaults to one inside the root like for pacman --root
+ * stats, if not NULL, counts the files opened
+ * Anything other than 0 returned is an error
+ */
+static int pacman_config_init(
+	struct pacman_config_t *conf,
+	const char *path,
+	const char *root_path,
+	const char *db_path,
+	struct stats_t *stats) {
+	int length;
+	memset(conf, 0, sizeof(struct pacman_config_t));
+	if (pacman_config_parse(conf, path, 0, stats)) return 1;
+	if (root_path) strncpy(conf->root_path, root_path, PATH_MAX - 1);
+	if (db_path) strncpy(conf->db_path, db_path, PATH_MAX - 1);
+	if (!conf->root_path[0]) strcpy(conf->root_path, "/");
+	if (!conf->db_path[0]) {
+		length = snprintf(conf->db_path, PATH_MAX, "%s%s%s", conf->root_path,
+			conf->root_path[strlen(conf->root_path) - 1] == '/' ? "" : "/", PACMAN_DB_PATH + 1);
+		if (length < 0 || length >= PATH_MAX) return 1;
+	}
+	return 0;
+}
+
+/*
+ * Frees the lists of the configuration
+ */
+static void pacman_config_free(struct pacman_config_t *conf) {
+	size_t i;
+	for (i = 0; i < conf->architectures_count; ++i) free(conf->architectures[i]);
+	free(conf->architectures);
+	for (i = 0; i < conf->repos_count; ++i) free(conf->repos[i]);
+	free(conf->repos);
+}
+
+/* Just a filter checking for the allowed ld prefix for scandir() */
+static inline int ld_filter(const struct dirent* entry) {
+	return !strncmp(LD_PREFIX, entry->d_name, LD_PREFIX_LENGTH);
+}
+
+/*
+ * Simple check for the ELF magic bytes on the file, filename is relative to dirfd
+ * The read is counted in stats and spared to the page cache with low_impact
+ * Anything other than 0 returned is not an ELF or an error
+ */
+static int check_for_elf_header(
+	int dirfd,
+	const char* filename,
+	struct stats_t *stats,
+	struct low_impact_t *low_impact) {
+	int fd, cached;
+	char elfbuffer[4];
+	ssize_t len;
+	STATS_ADD(stats, open_calls, 1);
+	if ((fd = openat(dirfd, filename, O_RDONLY | O_CLOEXEC)) < 0)
+		return error_handler(filename);
+	cached = low_impact_begin(low_impact, fd);
+	STATS_ADD(stats, read_calls, 1);
+	STATS_ADD(stats, bytes, 4);
+	if ((len = read(fd, elfbuffer, 4)) < 0) {
+		int ret = error_handler(filename);
+		close(fd);
+		return ret;
+	}
+	low_impact_end(low_impact, fd, cached);
+	close(fd);
+	return (len != 4
+		|| elfbuffer[0] != ELFMAG0 
+		|| elfbuffer[1] != ELFMAG1
+		|| elfbuffer[2] != ELFMAG2
+		|| elfbuffer[3] != ELFMAG3);
+}
+
+/*
+ * FNV-1a hash of a string
+ */
+static size_t hashmap_hash(const char *key) {
+	uint64_t hash = 14695981039346656037ULL;
+	for (; *key; ++key) {
+		hash ^= (unsigned char)*key;
+		hash *= 1099511628211ULL;
+	}
+	return (size_t)hash;
+}
+
+/*
+ * Returns the slot holding key or the empty slot where it belongs
+ * The map must already have slots
+ */
+static struct hashmap_entry_t *hashmap_slot(
+	const struct hashmap_t *map,
+	const char *key,
+	size_t hash) {
+	size_t i;
+	for (i = hash & (map->size - 1);
+		map->entries[i].key
+		&& (map->entries[i].hash != hash || strcmp(map->entries[i].key, key));
+		i = (i + 1) & (map->size - 1)) ;
+	return map->entries + i;
+}
+
+/*
+ * Doubles the number of slots
+ * Anything other than 0 returned is an error
+ */
+static int hashmap_grow(struct hashmap_t *map) {
+	struct hashmap_t grown;
+	size_t i;
+	grown.size = map->size ? map->size * 2 : HASHMAP_MIN_SIZE;
+	grown.count = map->count;
+	grown.borrowed = map->borrowed;
+	if (!(grown.entries = calloc(grown.size, sizeof(struct hashmap_entry_t))))
+		return error_handler("calloc()");
+	for (i = 0; i < map->size; ++i) {
+		if (map->entries[i].key)
+			*hashmap_slot(&grown, map->entries[i].key, map->entries[i].hash) = map->entries[i];
+	}
+	free(map->entries);
+	*map = grown;
+	return 0;
+}
+
+/*
+ * Returns the entry stored for key or NULL if there is none
+ * The entry pointer is only valid until the next insertion,
+ * the key string stays valid until the map is freed
+ */
+static struct hashmap_entry_t *hashmap_get(const struct hashmap_t *map, const char *key) {
+	struct hashmap_entry_t *entry;
+	if (!map->count) return NULL;
+	entry = hashmap_slot(map, key, hashmap_hash(key));
+	return entry->key ? entry : NULL;
+}
+
+/*
+ * Returns the entry stored for key, a new entry with a NULL value is
+ * inserted if there is none, in which case inserted is set
+ * NULL is returned if the memory could not be allocated
+ */
+static struct hashmap_entry_t *hashmap_put(
+	struct hashmap_t *map,
+	const char *key,
+	int *inserted) {
+	struct hashmap_entry_t *entry;
+	size_t hash = hashmap_hash(key);
+	*inserted = 0;
+	/* Keep the load factor under 3/4 */
+	if ((map->count + 1) * 4 > map->size * 3 && hashmap_grow(map)) return NULL;
+	entry = hashmap_slot(map, key, hash);
+	if (!entry->key) {
+		if (map->borrowed) entry->key = (char *)key;
+		else if (!(entry->key = strdup(key))) {
+			error_handler("strdup()");
+			return NULL;
+		}
+		entry->hash = hash;
+		entry->value = NULL;
+		++map->count;
+		*inserted = 1;
+	}
+	return entry;
+}
+
+/*
+ * Frees the map, free_value is called on every non NULL value if set
+ */
+static void hashmap_free(struct hashmap_t *map, void (*free_value)(void *)) {
+	size_t i;
+	for (i = 0; i < map->size; ++i) {
+		if (!map->entries[i].key) continue;
+		if (!map->borrowed) free(map->entries[i].key);
+		if (free_value && map->entries[i].value) free_value(map->entries[i].value);
+	}
+	free(map->entries);
+	memset(map, 0, sizeof(struct hashmap_t));
+}
+
+/*
+ * Empties a map whose keys are borrowed, its slots are kept for the next use
+ */
+static void hashmap_clear(struct hashmap_t *map) {
+	if (!map->count) return;
+	memset(map->entries, 0, map->size * sizeof(struct hashmap_entry_t));
+	map->count = 0;
+}
+
+/*
+ * Returns size bytes of the arena aligned for any type, NULL on error
+ */
+static void *arena_alloc(struct arena_t *arena, size_t size) {
+	struct arena_chunk_t *chunk = arena->chunks;
+	size_t chunk_size;
+	void *data;
+	size = (size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+	if (!chunk || chunk->size - chunk->used < size) {
+		/* Larger requests get a block of their own */
+		chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+		STATS_ADD(arena->stats, allocations, 1);
+		if (!(chunk = malloc(sizeof(struct arena_chunk_t) + chunk_size))) {
+			error_handler("malloc()");
+			return NULL;
+		}
+		chunk->used = 0;
+		chunk->size = chunk_size;
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+	}
+	data = chunk->data + chunk->used;
+	chunk->used += size;
+	return data;
+}
+
+/*
+ * Copies size bytes of data into the arena, NULL on error
+ */
+static void *arena_memdup(struct arena_t *arena, const void *data, size_t size) {
+	void *copy;
+	if ((copy = arena_alloc(arena, size))) memcpy(copy, data, size);
+	return copy;
+}
+
+/*
+ * Frees everything the arena handed out
+ */
+static void arena_free(struct arena_t *arena) {
+	struct arena_chunk_t *chunk;
+	while ((chunk = arena->chunks)) {
+		arena->chunks = chunk->next;
+		free(chunk);
+	}
+}
+
+/*
+ * Validates the ELF header of a mapped file
+ * Only objects in the native byte order are handled
+ * Anything other than 0 returned means the file is not usable
+ */
+static int elf_image_init(struct elf_image_t *img, const unsigned char *map, size_t size) {
+	size_t phentsize;
+	if (size < EI_NIDENT || memcmp(map, ELFMAG, SELFMAG) || map[EI_DATA] != ELF_NATIVE_DATA)
+		return 1;
+	img->map = map;
+	img->size = size;
+	img->elfclass = map[EI_CLASS];
+	if (img->elfclass == ELFCLASS64) {
+		Elf64_Ehdr ehdr;
+		if (size < sizeof(Elf64_Ehdr)) return 1;
+		memcpy(&ehdr, map, sizeof(Elf64_Ehdr));
+		img->type = ehdr.e_type;
+		img->machine = ehdr.e_machine;
+		img->phoff = ehdr.e_phoff;
+		img->phnum = ehdr.e_phnum;
+		phentsize = sizeof(Elf64_Phdr);
+		if (img->phnum && ehdr.e_phentsize != phentsize) return 1;
+	}
+	else if (img->elfclass == ELFCLASS32) {
+		Elf32_Ehdr ehdr;
+		if (size < sizeof(Elf32_Ehdr)) return 1;
+		memcpy(&ehdr, map, sizeof(Elf32_Ehdr));
+		img->type = ehdr.e_type;
+		img->machine = ehdr.e_machine;
+		img->phoff = ehdr.e_phoff;
+		img->phnum = ehdr.e_phnum;
+		phentsize = sizeof(Elf32_Phdr);
+		if (img->phnum && ehdr.e_phentsize != phentsize) return 1;
+	}
+	else return 1;
+	/* All the program headers must be inside the file */
+	if (img->phoff > size || (size - img->phoff) / phentsize < img->phnum) return 1;
+	return 0;
+}
+
+/*
+ * Reads the program header at index, 32bit headers are widened
+ */
+static void elf_image_phdr(const struct elf_image_t *img, size_t index, Elf64_Phdr *phdr) {
+	if (img->elfclass == ELFCLASS64) {
+		memcpy(phdr, img->map + img->phoff + index * sizeof(Elf64_Phdr), sizeof(Elf64_Phdr));
+	}
+	else {
+		Elf32_Phdr phdr32;
+		memcpy(&phdr32, img->map + img->phoff + index * sizeof(Elf32_Phdr), sizeof(Elf32_Phdr));
+		phdr->p_type = phdr32.p_type;
+		phdr->p_flags = phdr32.p_flags;
+		phdr->p_offset = phdr32.p_offset;
+		phdr->p_vaddr = phdr32.p_vaddr;
+		phdr->p_paddr = phdr32.p_paddr;
+		phdr->p_filesz = phdr32.p_filesz;
+		phdr->p_memsz = phdr32.p_memsz;
+		phdr->p_align = phdr32.p_align;
+	}
+}
+
+/*
+ * Reads the dynamic entry at index of the dynamic section at offset
+ * Anything other than 0 returned means the entry is outside of the file
+ */
+static int elf_image_dyn(
+	const struct elf_image_t *img,
+	uint64_t offset,
+	size_t index,
+	Elf64_Dyn *dyn) {
+	size_t entsize = (img->elfclass == ELFCLASS64) ? sizeof(Elf64_Dyn) : sizeof(Elf32_Dyn);
+	if (offset > img->size || (img->size - offset) / entsize <= index) return 1;
+	if (img->elfclass == ELFCLASS64) {
+		memcpy(dyn, img->map + offset + index * entsize, entsize);
+	}
+	else {
+		Elf32_Dyn dyn32;
+		memcpy(&dyn32, img->map + offset + index * entsize, entsize);
+		dyn->d_tag = dyn32.d_tag;
+		dyn->d_un.d_val = dyn32.d_un.d_val;
+	}
+	return 0;
+}
+
+/*
+ * Translates a virtual address into a file offset using the PT_LOAD segments
+ * Anything other than 0 returned means the address is not backed by the file
+ */
+static int elf_image_offset(const struct elf_image_t *img, uint64_t vaddr, uint64_t *offset) {
+	size_t i;
+	Elf64_Phdr phdr;
+	for (i = 0; i < img->phnum; ++i) {
+		elf_image_phdr(img, i, &phdr);
+		if (phdr.p_type != PT_LOAD
+			|| vaddr < phdr.p_vaddr
+			|| vaddr - phdr.p_vaddr >= phdr.p_filesz) continue;
+		*offset = vaddr - phdr.p_vaddr + phdr.p_offset;
+		return *offset >= img->size;
+	}
+	return 1;
+}
+
+/*
+ * Returns a copy of the '\0' terminated string at offset inside [offset, limit)
+ * NULL is returned if the string is not terminated inside the limit
+ */
+static char *elf_image_strdup(const struct elf_image_t *img, uint64_t offset, uint64_t limit) {
+	const unsigned char *end;
+	if (limit > img->size) limit = img->size;
+	if (offset >= limit) return NULL;
+	if (!(end = memchr(img->map + offset, 0, (size_t)(limit - offset)))) return NULL;
+	return strndup((const char *)(img->map + offset), (size_t)(end - (img->map + offset)));
+}
+
+/*
+ * Frees a struct elf_object_t
+ */
+static void elf_object_free(void *data) {
+	struct elf_object_t *obj = (struct elf_object_t *)data;
+	size_t i;
+	for (i = 0; i < obj->needed_count; ++i) free(obj->needed[i]);
+	free(obj->needed);
+	free(obj->interp);
+	free(obj->rpath);
+	free(obj->runpath);
+	free(obj);
+}
+
+/*
+ * Reads a 32bit word of the mapping, the offset must be inside the file
+ */
+static inline uint32_t elf_image_word(const struct elf_image_t *img, uint64_t offset) {
+	uint32_t word;
+	memcpy(&word, img->map + offset, sizeof(uint32_t));
+	return word;
+}
+
+/*
+ * Copies the NT_GNU_BUILD_ID note of the PT_NOTE segments into build_id,
+ * length is left at 0 if there is none
+ */
+static void elf_image_build_id(const struct elf_image_t *img, unsigned char *build_id, size_t *length) {
+	Elf64_Phdr phdr;
+	uint64_t offset, end, align, namesz, descsz, name;
+	uint32_t type;
+	size_t i;
+	*length = 0;
+	for (i = 0; i < img->phnum; ++i) {
+		elf_image_phdr(img, i, &phdr);
+		if (phdr.p_type != PT_NOTE || phdr.p_offset > img->size || phdr.p_filesz > img->size - phdr.p_offset)
+			continue;
+		/* The notes are aligned on 4 bytes, or on 8 in segments aligned that way */
+		align = phdr.p_align == 8 ? 8 : 4;
+		offset = phdr.p_offset;
+		end = phdr.p_offset + phdr.p_filesz;
+		while (offset <= end && end - offset >= 3 * sizeof(uint32_t)) {
+			namesz = elf_image_word(img, offset);
+			descsz = elf_image_word(img, offset + 4);
+			type = elf_image_word(img, offset + 8);
+			name = offset + 3 * sizeof(uint32_t);
+			offset = name + ((namesz + align - 1) & ~(align - 1));
+			if (offset > end || descsz > end - offset) break;
+			if (type == NT_GNU_BUILD_ID && namesz == sizeof("GNU") && !memcmp(img->map + name, "GNU", sizeof("GNU"))) {
+				if (!descsz || descsz > ELF_BUILD_ID_MAX) return;
+				memcpy(build_id, img->map + offset, descsz);
+				*length = descsz;
+				return;
+			}
+			offset += (descsz + align - 1) & ~(align - 1);
+		}
+	}
+}
+
+/*
+ * FNV-1a hash of the '\0' terminated string at offset inside [offset, limit)
+ * and of its tag, continuing hash
+ */
+static uint64_t elf_image_hash_string(
+	const struct elf_image_t *img,
+	uint64_t hash,
+	uint64_t tag,
+	uint64_t offset,
+	uint64_t limit) {
+	hash ^= tag;
+	hash *= 1099511628211ULL;
+	if (limit > img->size) limit = img->size;
+	for (; offset < limit && img->map[offset]; ++offset) {
+		hash ^= img->map[offset];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/*
+ * Hashes PT_INTERP and the DT_NEEDED, DT_RPATH and DT_RUNPATH strings in
+ * the order of the file
+ * patchelf rewrites them without touching the build id, the copies of a
+ * file only share their results when this hash matches too
+ */
+static uint64_t elf_image_dynamic_hash(const struct elf_image_t *img) {
+	Elf64_Phdr phdr;
+	Elf64_Dyn dyn;
+	uint64_t hash = 14695981039346656037ULL, dynamic_offset = 0, strtab, strsz, strtab_offset;
+	size_t i;
+	int dynamic = 0;
+	for (i = 0; i < img->phnum; ++i) {
+		elf_image_phdr(img, i, &phdr);
+		if (phdr.p_type == PT_INTERP) {
+			hash = elf_image_hash_string(img, hash, PT_INTERP, phdr.p_offset, phdr.p_offset + phdr.p_filesz);
+		}
+		else if (phdr.p_type == PT_DYNAMIC && !dynamic) {
+			dynamic = 1;
+			dynamic_offset = phdr.p_offset;
+		}
+	}
+	if (!dynamic) return hash;
+	strtab = strsz = 0;
+	for (i = 0; !elf_image_dyn(img, dynamic_offset, i, &dyn) && dyn.d_tag != DT_NULL; ++i) {
+		if (dyn.d_tag == DT_STRTAB) strtab = dyn.d_un.d_ptr;
+		else if (dyn.d_tag == DT_STRSZ) strsz = dyn.d_un.d_val;
+	}
+	if (!strtab || elf_image_offset(img, strtab, &strtab_offset)) return hash;
+	for (i = 0; !elf_image_dyn(img, dynamic_offset, i, &dyn) && dyn.d_tag != DT_NULL; ++i) {
+		if ((dyn.d_tag != DT_NEEDED && dyn.d_tag != DT_RPATH && dyn.d_tag != DT_RUNPATH)
+			|| dyn.d_un.d_val >= strsz) continue;
+		hash = elf_image_hash_string(img, hash, (uint64_t)dyn.d_tag,
+			strtab_offset + dyn.d_un.d_val, strtab_offset + strsz);
+	}
+	return hash;
+}
+
+/*
+ * Writes the key of a build id and of the dynamic hash of a file for
+ * struct elf_store_t and struct check_pool_t, key holds ELF_KEY_SIZE bytes
+ */
+static void elf_build_id_key(char *key, const unsigned char *build_id, size_t length, uint64_t dynamic_hash) {
+	static const char hex[] = "0123456789abcdef";
+	size_t i, position;
+	position = sizeof("build-id:") - 1;
+	memcpy(key, "build-id:", position);
+	for (i = 0; i < length; ++i) {
+		key[position++] = hex[build_id[i] >> 4];
+		key[position++] = hex[build_id[i] & 15];
+	}
+	snprintf(key + position, ELF_KEY_SIZE - position, ":%016llx", (unsigned long long)dynamic_hash);
+}
+
+/*
+ * Writes the key of a file for struct elf_store_t, key holds ELF_KEY_SIZE bytes
+ * The size and the modification time tell apart a file rewritten in place
+ */
+static void elf_store_key(char *key, const struct stat *statbuf) {
+	snprintf(key, ELF_KEY_SIZE, "inode:%llx:%llx:%llx:%llx.%lx",
+		(unsigned long long)statbuf->st_dev, (unsigned long long)statbuf->st_ino,
+		(unsigned long long)statbuf->st_size, (unsigned long long)statbuf->st_mtim.tv_sec,
+		(unsigned long)statbuf->st_mtim.tv_nsec);
+}
+
+
+/*
+ * Collects PT_INTERP and the DT_NEEDED, DT_RPATH and DT_RUNPATH entries
+ * Returns NULL if the memory could not be allocated
+ */
+static struct elf_object_t *elf_object_parse(const struct elf_image_t *img) {
+	struct elf_object_t *obj;
+	Elf64_Phdr phdr;
+	Elf64_Dyn dyn;
+	uint64_t dynamic_offset, strtab, strsz, strtab_offset;
+	size_t i, needed_count;
+	if (!(obj = calloc(1, sizeof(struct elf_object_t)))) {
+		error_handler("calloc()");
+		return NULL;
+	}
+	obj->elfclass = img->elfclass;
+	obj->machine = img->machine;
+	obj->type = img->type;
+	dynamic_offset = 0;
+	for (i = 0; i < img->phnum; ++i) {
+		elf_image_phdr(img, i, &phdr);
+		if (phdr.p_type == PT_INTERP && !obj->interp) {
+			obj->interp = elf_image_strdup(img, phdr.p_offset, phdr.p_offset + phdr.p_filesz);
+		}
+		else if (phdr.p_type == PT_DYNAMIC) {
+			obj->dynamic = 1;
+			dynamic_offset = phdr.p_offset;
+		}
+	}
+	elf_image_build_id(img, obj->build_id, &obj->build_id_length);
+	if (obj->build_id_length) obj->dynamic_hash = elf_image_dynamic_hash(img);
+	if (!obj->dynamic) return obj;
+	/* First pass for the string table location and the number of DT_NEEDED */
+	strtab = strsz = 0;
+	needed_count = 0;
+	for (i = 0; !elf_image_dyn(img, dynamic_offset, i, &dyn) && dyn.d_tag != DT_NULL; ++i) {
+		if (dyn.d_tag == DT_STRTAB) strtab = dyn.d_un.d_ptr;
+		else if (dyn.d_tag == DT_STRSZ) strsz = dyn.d_un.d_val;
+		else if (dyn.d_tag == DT_NEEDED) ++needed_count;
+	}
+	if (!strtab || elf_image_offset(img, strtab, &strtab_offset)) {
+		/* Without strings there is nothing to resolve */
+		obj->dynamic = 0;
+		return obj;
+	}
+	if (needed_count && !(obj->needed = calloc(needed_count, sizeof(char *)))) {
+		error_handler("calloc()");
+		elf_object_free(obj);
+		return NULL;
+	}
+	for (i = 0; !elf_image_dyn(img, dynamic_offset, i, &dyn) && dyn.d_tag != DT_NULL; ++i) {
+		char *string;
+		if (dyn.d_tag != DT_NEEDED && dyn.d_tag != DT_RPATH && dyn.d_tag != DT_RUNPATH)
+			continue;
+		if (dyn.d_un.d_val >= strsz
+			|| !(string = elf_image_strdup(img,
+				strtab_offset + dyn.d_un.d_val, strtab_offset + strsz))) continue;
+		if (dyn.d_tag == DT_NEEDED) obj->needed[obj->needed_count++] = string;
+		else if (dyn.d_tag == DT_RPATH && !obj->rpath) obj->rpath = string;
+		else if (dyn.d_tag == DT_RUNPATH && !obj->runpath) obj->runpath = string;
+		else free(string);
+	}
+	return obj;
+}
+
+/*
+ * Records value, already owned by the store or NULL, under key of map
+ * Returns the value kept for key, it may come from another thread
+ */
+static void *elf_store_alias(struct elf_store_t *store, struct hashmap_t *map, const char *key, void *value) {
+	struct hashmap_entry_t *entry;
+	int inserted;
+	pthread_mutex_lock(&store->lock);
+	if ((entry = hashmap_put(map, key, &inserted))) {
+		if (inserted) entry->value = value;
+		else value = entry->value;
+	}
+	pthread_mutex_unlock(&store->lock);
+	return value;
+}
+
+/*
+ * Hands a parsed object over to the store under the file key and the build id key
+ * Returns the object kept for the file, it may come from another thread
+ */
+static struct elf_object_t *elf_store_object(
+	struct elf_store_t *store,
+	const char *key,
+	const char *build_id_key,
+	struct elf_object_t *obj) {
+	struct hashmap_entry_t *entry;
+	int inserted;
+	pthread_mutex_lock(&store->lock);
+	if (!(entry = hashmap_put(&store->objects, key, &inserted)) || !inserted) {
+		/* Another thread read the same file in the meantime */
+		if (obj) elf_object_free(obj);
+		obj = entry ? (struct elf_object_t *)(entry->value) : NULL;
+		pthread_mutex_unlock(&store->lock);
+		return obj;
+	}
+	entry->value = obj;
+	if (obj) {
+		obj->next = store->objects_list;
+		store->objects_list = obj;
+		if (build_id_key && (entry = hashmap_put(&store->objects, build_id_key, &inserted)) && inserted)
+			entry->value = obj;
+	}
+	pthread_mutex_unlock(&store->lock);
+	return obj;
+}
+
+/*
+ * Maps filename and parses it, the read is counted and throttled by store if it is not NULL
+ * With keep set the object is shared by the identical files, found by their
+ * inode or their build id, and belongs to the store, else it belongs to the caller
+ * Returns NULL if the file can't be read or isn't a usable ELF object
+ */
+static struct elf_object_t *elf_object_load(struct elf_store_t *store, const char *filename, int keep) {
+	struct stats_t *stats = store ? store->stats : NULL;
+	struct low_impact_t *low_impact = store ? store->low_impact : NULL;
+	int fd;
+	struct stat statbuf;
+	struct elf_image_t img;
+	struct elf_object_t *obj;
+	struct hashmap_entry_t *entry;
+	unsigned char build_id[ELF_BUILD_ID_MAX];
+	char key[ELF_KEY_SIZE], build_id_key[ELF_KEY_SIZE];
+	size_t build_id_length;
+	void *map;
+	int cached;
+	STATS_ADD(stats, open_calls, 1);
+	if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0) return NULL;
+	STATS_ADD(stats, stat_calls, 1);
+	if (fstat(fd, &statbuf) < 0 || !S_ISREG(statbuf.st_mode) || statbuf.st_size < EI_NIDENT) {
+		close(fd);
+		return NULL;
+	}
+	if (keep) {
+		elf_store_key(key, &statbuf);
+		pthread_mutex_lock(&store->lock);
+		entry = hashmap_get(&store->objects, key);
+		obj = entry ? (struct elf_object_t *)(entry->value) : NULL;
+		pthread_mutex_unlock(&store->lock);
+		if (entry) {
+			close(fd);
+			return obj;
+		}
+	}
+	/* The file stays open to drop its pages once parsed */
+	cached = low_impact_begin(low_impact, fd);
+	STATS_ADD(stats, map_calls, 1);
+	map = mmap(NULL, (size_t)statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+	STATS_ADD(stats, bytes, statbuf.st_size);
+	if (elf_image_init(&img, map, (size_t)statbuf.st_size)) {
+		munmap(map, (size_t)statbuf.st_size);
+		low_impact_end(low_impact, fd, cached);
+		close(fd);
+		return keep ? elf_store_alias(store, &store->objects, key, NULL) : NULL;
+	}
+	build_id_length = 0;
+	if (keep) {
+		/* A copy of the file, in another root for instance, has the same build id, unless patchelf changed it */
+		elf_image_build_id(&img, build_id, &build_id_length);
+		if (build_id_length) {
+			elf_build_id_key(build_id_key, build_id, build_id_length, elf_image_dynamic_hash(&img));
+			pthread_mutex_lock(&store->lock);
+			entry = hashmap_get(&store->objects, build_id_key);
+			obj = entry ? (struct elf_object_t *)(entry->value) : NULL;
+			pthread_mutex_unlock(&store->lock);
+			if (obj) {
+				munmap(map, (size_t)statbuf.st_size);
+				low_impact_end(low_impact, fd, cached);
+				close(fd);
+				return elf_store_alias(store, &store->objects, key, obj);
+			}
+		}
+	}
+	STATS_ADD(stats, elf_objects, 1);
+	obj = elf_object_parse(&img);
+	munmap(map, (size_t)statbuf.st_size);
+	low_impact_end(low_impact, fd, cached);
+	close(fd);
+	if (!keep) return obj;
+	return elf_store_object(store, key, build_id_length ? build_id_key : NULL, obj);
+}
+
+/*
+ * Returns the '\0' terminated string at offset of the dynamic string table
+ * NULL is returned if it is outside of the table
+ */
+static const char *elf_symbols_string(const struct elf_symbols_t *syms, uint64_t offset) {
+	uint64_t limit = syms->strtab + syms->strsz;
+	if (limit > syms->img.size) limit = syms->img.size;
+	if (offset >= syms->strsz || syms->strtab + offset >= limit
+		|| !memchr(syms->img.map + syms->strtab + offset, 0, (size_t)(limit - syms->strtab - offset)))
+		return NULL;
+	return (const char *)(syms->img.map + syms->strtab + offset);
+}
+
+/*
+ * Reads the symbol at index, 32bit symbols are widened
+ */
+static void elf_symbols_sym(const struct elf_symbols_t *syms, size_t index, Elf64_Sym *sym) {
+	if (syms->img.elfclass == ELFCLASS64) {
+		memcpy(sym, syms->img.map + syms->symtab + index * sizeof(Elf64_Sym), sizeof(Elf64_Sym));
+	}
+	else {
+		Elf32_Sym sym32;
+		memcpy(&sym32, syms->img.map + syms->symtab + index * sizeof(Elf32_Sym), sizeof(Elf32_Sym));
+		sym->st_name = sym32.st_name;
+		sym->st_info = sym32.st_info;
+		sym->st_other = sym32.st_other;
+		sym->st_shndx = sym32.st_shndx;
+		sym->st_value = sym32.st_value;
+		sym->st_size = sym32.st_size;
+	}
+}
+
+/*
+ * Returns the DT_VERSYM entry of the symbol at index, 1 (global) without versions
+ */
+static inline uint16_t elf_symbols_versym(const struct elf_symbols_t *syms, size_t index) {
+	uint16_t versym;
+	if (!syms->versym) return 1;
+	memcpy(&versym, syms->img.map + syms->versym + index * sizeof(uint16_t), sizeof(uint16_t));
+	return versym;
+}
+
+/*
+ * Records the version at index, the table grows as needed
+ * Anything other than 0 returned is an error
+ */
+static int elf_symbols_add_version(
+	struct elf_symbols_t *syms,
+	size_t index,
+	const char *name,
+	const char *file,
+	uint16_t flags) {
+	struct elf_version_t *grown;
+	if (!name) return 0;
+	if (index >= syms->versions_count) {
+		if (!(grown = realloc(syms->versions, (index + 1) * sizeof(struct elf_version_t))))
+			return error_handler("realloc()");
+		memset(grown + syms->versions_count, 0,
+			(index + 1 - syms->versions_count) * sizeof(struct elf_version_t));
+		syms->versions = grown;
+		syms->versions_count = index + 1;
+	}
+	syms->versions[index].name = name;
+	syms->versions[index].file = file;
+	syms->versions[index].flags = flags;
+	return 0;
+}
+
+/*
+ * Reads the versions the object defines and the ones it requires
+ * Anything other than 0 returned is an error
+ */
+static int elf_symbols_parse_versions(
+	struct elf_symbols_t *syms,
+	uint64_t verdef,
+	size_t verdefnum,
+	uint64_t verneed,
+	size_t verneednum) {
+	Elf64_Verdef vd;
+	Elf64_Verdaux vda;
+	Elf64_Verneed vn;
+	Elf64_Vernaux vna;
+	uint64_t aux;
+	size_t i, j;
+	/* The layouts are the same for both classes */
+	for (i = 0; verdef && i < verdefnum; ++i) {
+		if (verdef + sizeof(vd) > syms->img.size) break;
+		memcpy(&vd, syms->img.map + verdef, sizeof(vd));
+		aux = verdef + vd.vd_aux;
+		/* The base version is the soname, no symbol refers to it */
+		if (!(vd.vd_flags & VER_FLG_BASE) && vd.vd_cnt && aux + sizeof(vda) <= syms->img.size) {
+			memcpy(&vda, syms->img.map + aux, sizeof(vda));
+			if (elf_symbols_add_version(syms, vd.vd_ndx & 0x7fff,
+				elf_symbols_string(syms, vda.vda_name), NULL, vd.vd_flags)) return 1;
+		}
+		if (!vd.vd_next) break;
+		verdef += vd.vd_next;
+	}
+	for (i = 0; verneed && i < verneednum; ++i) {
+		const char *file;
+		if (verneed + sizeof(vn) > syms->img.size) break;
+		memcpy(&vn, syms->img.map + verneed, sizeof(vn));
+		file = elf_symbols_string(syms, vn.vn_file);
+		for (j = 0, aux = verneed + vn.vn_aux; file && j < vn.vn_cnt; ++j) {
+			if (aux + sizeof(vna) > syms->img.size) break;
+			memcpy(&vna, syms->img.map + aux, sizeof(vna));
+			if (elf_symbols_add_version(syms, vna.vna_other & 0x7fff,
+				elf_symbols_string(syms, vna.vna_name), file, vna.vna_flags)) return 1;
+			if (!vna.vna_next) break;
+			aux += vna.vna_next;
+		}
+		if (!vn.vn_next) break;
+		verneed += vn.vn_next;
+	}
+	return 0;
+}
+
+/*
+ * Reads the DT_GNU_HASH header, the number of symbols is taken from the
+ * end of the last chain
+ * Anything other than 0 returned means the table is not usable
+ */
+static int elf_symbols_parse_gnu_hash(struct elf_symbols_t *syms, uint64_t offset) {
+	size_t word = (syms->img.elfclass == ELFCLASS64) ? sizeof(uint64_t) : sizeof(uint32_t);
+	uint32_t i, last;
+	if (offset + 4 * sizeof(uint32_t) > syms->img.size) return 1;
+	syms->nbuckets = elf_image_word(&syms->img, offset);
+	syms->symoffset = elf_image_word(&syms->img, offset + 4);
+	syms->bloom_size = elf_image_word(&syms->img, offset + 8);
+	syms->bloom_shift = elf_image_word(&syms->img, offset + 12);
+	syms->bloom = offset + 16;
+	syms->buckets = syms->bloom + (uint64_t)syms->bloom_size * word;
+	syms->chains = syms->buckets + (uint64_t)syms->nbuckets * sizeof(uint32_t);
+	if (!syms->nbuckets || !syms->bloom_size || syms->chains > syms->img.size) return 1;
+	for (i = 0, last = 0; i < syms->nbuckets; ++i) {
+		uint32_t bucket = elf_image_word(&syms->img, syms->buckets + (uint64_t)i * sizeof(uint32_t));
+		if (bucket > last) last = bucket;
+	}
+	if (last < syms->symoffset) {
+		syms->count = syms->symoffset;
+		return 0;
+	}
+	/* The lowest bit marks the end of a chain */
+	for (;; ++last) {
+		uint64_t chain = syms->chains + (uint64_t)(last - syms->symoffset) * sizeof(uint32_t);
+		if (chain + sizeof(uint32_t) > syms->img.size) return 1;
+		if (elf_image_word(&syms->img, chain) & 1) break;
+	}
+	syms->count = (size_t)last + 1;
+	return 0;
+}
+
+/*
+ * Frees a struct elf_symbols_t along with its mapping
+ */
+static void elf_symbols_free(void *data) {
+	struct elf_symbols_t *syms = (struct elf_symbols_t *)data;
+	munmap((void *)syms->img.map, syms->img.size);
+	free(syms->versions);
+	free(syms);
+}
+
+/*
+ * Locates the dynamic symbol table, the hash tables and the versions of a
+ * mapped image, the mapping now belongs to the symbols and is kept for the lookups
+ * Returns NULL and unmaps the image if it has no usable dynamic symbols
+ */
+static struct elf_symbols_t *elf_symbols_parse(const struct elf_image_t *mapped) {
+	struct elf_symbols_t *syms;
+	struct elf_image_t img = *mapped;
+	Elf64_Phdr phdr;
+	Elf64_Dyn dyn;
+	uint64_t dynamic_offset, symtab, strtab, gnu_hash, hash, versym, verdef, verneed, offset;
+	size_t i, verdefnum, verneednum, entsize;
+	if (!(syms = calloc(1, sizeof(struct elf_symbols_t)))) {
+		munmap((void *)img.map, img.size);
+		return NULL;
+	}
+	syms->img = img;
+	dynamic_offset = 0;
+	for (i = 0; i < img.phnum; ++i) {
+		elf_image_phdr(&img, i, &phdr);
+		if (phdr.p_type == PT_DYNAMIC) dynamic_offset = phdr.p_offset;
+	}
+	symtab = strtab = gnu_hash = hash = versym = verdef = verneed = 0;
+	verdefnum = verneednum = 0;
+	for (i = 0; dynamic_offset && !elf_image_dyn(&img, dynamic_offset, i, &dyn) && dyn.d_tag != DT_NULL; ++i) {
+		switch (dyn.d_tag) {
+			case DT_SYMTAB: symtab = dyn.d_un.d_ptr; break;
+			case DT_STRTAB: strtab = dyn.d_un.d_ptr; break;
+			case DT_STRSZ: syms->strsz = dyn.d_un.d_val; break;
+			case DT_GNU_HASH: gnu_hash = dyn.d_un.d_ptr; break;
+			case DT_HASH: hash = dyn.d_un.d_ptr; break;
+			case DT_VERSYM: versym = dyn.d_un.d_ptr; break;
+			case DT_VERDEF: verdef = dyn.d_un.d_ptr; break;
+			case DT_VERDEFNUM: verdefnum = (size_t)dyn.d_un.d_val; break;
+			case DT_VERNEED: verneed = dyn.d_un.d_ptr; break;
+			case DT_VERNEEDNUM: verneednum = (size_t)dyn.d_un.d_val; break;
+			default: break;
+		}
+	}
+	if (!symtab || !strtab
+		|| elf_image_offset(&img, symtab, &syms->symtab)
+		|| elf_image_offset(&img, strtab, &syms->strtab)) {
+		elf_symbols_free(syms);
+		return NULL;
+	}
+	/* The hash tables are the only way to know the number of symbols */
+	if (gnu_hash && !elf_image_offset(&img, gnu_hash, &offset) && !elf_symbols_parse_gnu_hash(syms, offset)) ;
+	else if (hash && !elf_image_offset(&img, hash, &offset) && offset + 2 * sizeof(uint32_t) <= img.size) {
+		syms->bloom = 0;
+		syms->sysv_nbuckets = elf_image_word(&img, offset);
+		syms->count = elf_image_word(&img, offset + 4);
+		syms->sysv_buckets = offset + 2 * sizeof(uint32_t);
+		syms->sysv_chains = syms->sysv_buckets + (uint64_t)syms->sysv_nbuckets * sizeof(uint32_t);
+		if (!syms->sysv_nbuckets || syms->sysv_chains + (uint64_t)syms->count * sizeof(uint32_t) > img.size) {
+			elf_symbols_free(syms);
+			return NULL;
+		}
+	}
+	else {
+		elf_symbols_free(syms);
+		return NULL;
+	}
+	entsize = (img.elfclass == ELFCLASS64) ? sizeof(Elf64_Sym) : sizeof(Elf32_Sym);
+	if (syms->symtab > img.size || (img.size - syms->symtab) / entsize < syms->count)
+		syms->count = (size_t)((img.size - syms->symtab) / entsize);
+	if (versym && (elf_image_offset(&img, versym, &syms->versym)
+		|| (img.size - syms->versym) / sizeof(uint16_t) < syms->count))
+		syms->versym = 0;
+	if (verdef && elf_image_offset(&img, verdef, &verdef)) verdef = 0;
+	if (verneed && elf_image_offset(&img, verneed, &verneed)) verneed = 0;
+	if (elf_symbols_parse_versions(syms, verdef, verdefnum, verneed, verneednum)) {
+		elf_symbols_free(syms);
+		return NULL;
+	}
+	return syms;
+}
+
+/*
+ * Hands parsed symbols over to the store under the file key and the build id key
+ * Returns the symbols kept for the file, they may come from another thread
+ */
+static struct elf_symbols_t *elf_store_symbols(
+	struct elf_store_t *store,
+	const char *key,
+	const char *build_id_key,
+	struct elf_symbols_t *syms) {
+	struct hashmap_entry_t *entry;
+	int inserted;
+	pthread_mutex_lock(&store->lock);
+	if (!(entry = hashmap_put(&store->symbols, key, &inserted)) || !inserted) {
+		/* Another thread read the same file in the meantime */
+		if (syms) elf_symbols_free(syms);
+		syms = entry ? (struct elf_symbols_t *)(entry->value) : NULL;
+		pthread_mutex_unlock(&store->lock);
+		return syms;
+	}
+	entry->value = syms;
+	if (syms) {
+		syms->next = store->symbols_list;
+		store->symbols_list = syms;
+		if (build_id_key && (entry = hashmap_put(&store->symbols, build_id_key, &inserted)) && inserted)
+			entry->value = syms;
+	}
+	pthread_mutex_unlock(&store->lock);
+	return syms;
+}
+
+/*
+ * Maps filename and locates its dynamic symbol table, its hash tables and
+ * its versions, the mapping is kept for the lookups, it is counted and
+ * throttled by store if it is not NULL
+ * With keep set the symbols are shared by the identical files, found by their
+ * inode or their build id, and belong to the store, else they belong to the caller
+ * Returns NULL if the file has no usable dynamic symbols
+ */
+static struct elf_symbols_t *elf_symbols_load(struct elf_store_t *store, const char *filename, int keep) {
+	struct stats_t *stats = store ? store->stats : NULL;
+	struct elf_symbols_t *syms;
+	struct elf_image_t img;
+	struct stat statbuf;
+	struct hashmap_entry_t *entry;
+	unsigned char build_id[ELF_BUILD_ID_MAX];
+	char key[ELF_KEY_SIZE], build_id_key[ELF_KEY_SIZE];
+	size_t build_id_length;
+	void *map;
+	int fd;
+	STATS_ADD(stats, open_calls, 1);
+	if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0) return NULL;
+	STATS_ADD(stats, stat_calls, 1);
+	if (fstat(fd, &statbuf) < 0 || !S_ISREG(statbuf.st_mode) || statbuf.st_size < EI_NIDENT) {
+		close(fd);
+		return NULL;
+	}
+	if (keep) {
+		elf_store_key(key, &statbuf);
+		pthread_mutex_lock(&store->lock);
+		entry = hashmap_get(&store->symbols, key);
+		syms = entry ? (struct elf_symbols_t *)(entry->value) : NULL;
+		pthread_mutex_unlock(&store->lock);
+		if (entry) {
+			close(fd);
+			return syms;
+		}
+	}
+	/* The symbols keep the file mapped, its pages are only marked as used once */
+	low_impact_begin(store ? store->low_impact : NULL, fd);
+	STATS_ADD(stats, map_calls, 1);
+	map = mmap(NULL, (size_t)statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return NULL;
+	STATS_ADD(stats, bytes, statbuf.st_size);
+	if (elf_image_init(&img, map, (size_t)statbuf.st_size)) {
+		munmap(map, (size_t)statbuf.st_size);
+		return keep ? elf_store_alias(store, &store->symbols, key, NULL) : NULL;
+	}
+	build_id_length = 0;
+	if (keep) {
+		/* A copy of the file, in another root for instance, has the same build id, unless patchelf changed it */
+		elf_image_build_id(&img, build_id, &build_id_length);
+		if (build_id_length) {
+			elf_build_id_key(build_id_key, build_id, build_id_length, elf_image_dynamic_hash(&img));
+			pthread_mutex_lock(&store->lock);
+			entry = hashmap_get(&store->symbols, build_id_key);
+			syms = entry ? (struct elf_symbols_t *)(entry->value) : NULL;
+			pthread_mutex_unlock(&store->lock);
+			if (syms) {
+				munmap(map, (size_t)statbuf.st_size);
+				return elf_store_alias(store, &store->symbols, key, syms);
+			}
+		}
+	}
+	STATS_ADD(stats, elf_objects, 1);
+	syms = elf_symbols_parse(&img);
+	if (!keep) return syms;
+	return elf_store_symbols(store, key, build_id_length ? build_id_key : NULL, syms);
+}
+
+/*
+ * Inits an empty store, the reads are counted in stats and throttled by low_impact
+ */
+static void elf_store_init(struct elf_store_t *store, struct stats_t *stats, struct low_impact_t *low_impact) {
+	memset(store, 0, sizeof(struct elf_store_t));
+	store->stats = stats;
+	store->low_impact = low_impact;
+	pthread_mutex_init(&store->lock, NULL);
+}
+
+/*
+ * Releases the objects and the symbols of the store along with their mappings
+ */
+static void elf_store_free(struct elf_store_t *store) {
+	struct elf_object_t *obj, *next_obj;
+	struct elf_symbols_t *syms, *next_syms;
+	/* Several keys can share the same value, the lists own them */
+	hashmap_free(&store->objects, NULL);
+	hashmap_free(&store->symbols, NULL);
+	for (obj = store->objects_list; obj; obj = next_obj) {
+		next_obj = obj->next;
+		elf_object_free(obj);
+	}
+	for (syms = store->symbols_list; syms; syms = next_syms) {
+		next_syms = syms->next;
+		elf_symbols_free(syms);
+	}
+	pthread_mutex_destroy(&store->lock);
+}
+
+/*
+ * The DT_GNU_HASH hash function
+ */
+static uint32_t elf_gnu_hash(const char *name) {
+	uint32_t hash = 5381;
+	for (; *name; ++name) hash = (hash << 5) + hash + (unsigned char)*name;
+	return hash;
+}
+
+/*
+ * The DT_HASH hash function
+ */
+static uint32_t elf_sysv_hash(const char *name) {
+	uint32_t hash = 0, high;
+	for (; *name; ++name) {
+		hash = (hash << 4) + (unsigned char)*name;
+		if ((high = hash & 0xf0000000)) hash ^= high >> 24;
+		hash &= ~high;
+	}
+	return hash;
+}
+
+/*
+ * Returns true if the symbol at index defines name in the requested version
+ * version is NULL for an unversioned reference, the rules are the ones of
+ * the dynamic loader
+ */
+static int elf_symbols_match(
+	const struct elf_symbols_t *syms,
+	size_t index,
+	const char *name,
+	const char *version) {
+	const struct elf_version_t *def;
+	const char *sym_name;
+	Elf64_Sym sym;
+	uint16_t versym;
+	unsigned char type, bind;
+	elf_symbols_sym(syms, index, &sym);
+	type = ELF64_ST_TYPE(sym.st_info);
+	bind = ELF64_ST_BIND(sym.st_info);
+	if (sym.st_shndx == SHN_UNDEF
+		|| (sym.st_value == 0 && sym.st_shndx != SHN_ABS && type != STT_TLS)
+		|| (type > STT_FUNC && type != STT_COMMON && type != STT_TLS && type != STT_GNU_IFUNC)
+		|| (bind != STB_GLOBAL && bind != STB_WEAK && bind != STB_GNU_UNIQUE)
+		|| !(sym_name = elf_symbols_string(syms, sym.st_name))
+		|| strcmp(sym_name, name))
+		return 0;
+	/* Objects without versions satisfy every reference */
+	if (!syms->versym) return 1;
+	versym = elf_symbols_versym(syms, index);
+	def = ((size_t)(versym & 0x7fff) < syms->versions_count) ? syms->versions + (versym & 0x7fff) : NULL;
+	/* An unversioned reference takes anything but a hidden version */
+	if (!version) return (versym & 0x7fff) < 3 || !(versym & 0x8000);
+	if (def && def->name) return !strcmp(def->name, version);
+	/* A global unversioned definition is fine unless it is hidden */
+	return !(versym & 0x8000);
+}
+
+/*
+ * Returns true if syms defines name in the requested version
+ * gnu_hash is elf_gnu_hash(name)
+ */
+static int elf_symbols_lookup(
+	const struct elf_symbols_t *syms,
+	const char *name,
+	uint32_t gnu_hash,
+	const char *version) {
+	size_t word = (syms->img.elfclass == ELFCLASS64) ? 64 : 32;
+	uint64_t bloom, mask;
+	uint32_t index, chain, steps;
+	if (syms->bloom) {
+		/* The bloom filter rejects most of the libraries not defining the symbol */
+		uint64_t bloom_offset = syms->bloom + (gnu_hash / word) % syms->bloom_size * (word / 8);
+		if (word == 64) memcpy(&bloom, syms->img.map + bloom_offset, sizeof(uint64_t));
+		else bloom = elf_image_word(&syms->img, bloom_offset);
+		mask = ((uint64_t)1 << (gnu_hash % word)) | ((uint64_t)1 << ((gnu_hash >> syms->bloom_shift) % word));
+		if ((bloom & mask) != mask) return 0;
+		index = elf_image_word(&syms->img, syms->buckets + (gnu_hash % syms->nbuckets) * sizeof(uint32_t));
+		if (index < syms->symoffset) return 0;
+		for (; index < syms->count; ++index) {
+			chain = elf_image_word(&syms->img, syms->chains + (uint64_t)(index - syms->symoffset) * sizeof(uint32_t));
+			if ((chain | 1) == (gnu_hash | 1) && elf_symbols_match(syms, index, name, version)) return 1;
+			if (chain & 1) break;
+		}
+		return 0;
+	}
+	index = elf_image_word(&syms->img,
+		syms->sysv_buckets + (elf_sysv_hash(name) % syms->sysv_nbuckets) * sizeof(uint32_t));
+	/* Chains are bounded by the number of symbols in case they loop */
+	for (steps = 0; index && index < syms->count && steps < syms->count; ++steps) {
+		if (elf_symbols_match(syms, index, name, version)) return 1;
+		index = elf_image_word(&syms->img, syms->sysv_chains + (uint64_t)index * sizeof(uint32_t));
+	}
+	return 0;
+}
+
+/*
+ * Builds the real filename of a path inside the root
+ * Anything other than 0 returned means the result did not fit
+ */
+static int resolver_filename(
+	const struct resolver_t *res,
+	char *filename,
+	size_t maxsize,
+	const char *path) {
+	int length = snprintf(filename, maxsize, "%s%s", res->root_path, path);
+	return length < 0 || (size_t)length >= maxsize;
+}
+
+/*
+ * Returns the parsed object for path, every path is only loaded once
+ * key is set to a copy of path living as long as the resolver
+ * NULL is returned if path is no usable ELF object
+ */
+static struct elf_object_t *resolver_object(
+	struct resolver_t *res,
+	const char *path,
+	const char **key) {
+	struct hashmap_entry_t *entry;
+	struct elf_object_t *obj;
+	char filename[PATH_MAX];
+	int inserted;
+	pthread_mutex_lock(&res->lock);
+	if ((entry = hashmap_get(&res->objects, path))) {
+		*key = entry->key;
+		obj = (struct elf_object_t *)(entry->value);
+		pthread_mutex_unlock(&res->lock);
+		return obj;
+	}
+	pthread_mutex_unlock(&res->lock);
+	/* The file is read without holding the lock */
+	obj = resolver_filename(res, filename, PATH_MAX, path) ? NULL : elf_object_load(res->store, filename, 1);
+	pthread_mutex_lock(&res->lock);
+	if (!(entry = hashmap_put(&res->objects, path, &inserted))) {
+		pthread_mutex_unlock(&res->lock);
+		return NULL;
+	}
+	/* The object belongs to the store, another thread may have loaded the same path in the meantime */
+	if (inserted) entry->value = obj;
+	*key = entry->key;
+	obj = (struct elf_object_t *)(entry->value);
+	pthread_mutex_unlock(&res->lock);
+	return obj;
+}
+
+/*
+ * Returns true if obj is a shared object the given requester may load
+ */
+static inline int resolver_compatible(
+	const struct elf_object_t *obj,
+	unsigned char elfclass,
+	uint16_t machine) {
+	return obj && obj->type == ET_DYN && obj->elfclass == elfclass && obj->machine == machine;
+}
+
+/*
+ * Looks for soname inside dir
+ * Returns the path of the library or NULL if it is not there
+ */
+static const char *resolver_search_dir(
+	struct resolver_t *res,
+	const char *dir,
+	const char *soname,
+	unsigned char elfclass,
+	uint16_t machine) {
+	char path[PATH_MAX];
+	const char *key;
+	int length = snprintf(path, PATH_MAX, "%s%s%s",
+		dir, (dir[0] && dir[strlen(dir) - 1] == '/') ? "" : "/", soname);
+	if (length < 0 || length >= PATH_MAX) return NULL;
+	return resolver_compatible(resolver_object(res, path, &key), elfclass, machine) ? key : NULL;
+}
+
+/*
+ * Returns the length of the dynamic string token name at entry if it matches
+ * entry points to the '$', both $NAME and ${NAME} are recognized
+ */
+static size_t resolver_token(const char *entry, const char *end, const char *name) {
+	size_t length = strlen(name);
+	++entry;
+	if (entry < end && *entry == '{') {
+		return ((size_t)(end - entry) >= length + 2
+			&& !strncmp(entry + 1, name, length)
+			&& entry[length + 1] == '}') ? length + 3 : 0;
+	}
+	if ((size_t)(end - entry) < length || strncmp(entry, name, length)) return 0;
+	if (entry + length < end && (isalnum((unsigned char)entry[length]) || entry[length] == '_'))
+		return 0;
+	return length + 1;
+}
+
+/*
+ * Expands $ORIGIN and $LIB inside a search path entry
+ * Anything other than 0 returned means the entry must be ignored
+ */
+static int resolver_expand(
+	char *expanded,
+	size_t maxsize,
+	const char *entry,
+	size_t length,
+	const char *origin,
+	unsigned char elfclass) {
+	const char *end = entry + length;
+	const char *value;
+	size_t pos, skip, value_length;
+	for (pos = 0; entry < end; entry += skip) {
+		if (*entry == '$') {
+			if ((skip = resolver_token(entry, end, "ORIGIN"))) value = origin;
+			else if ((skip = resolver_token(entry, end, "LIB")))
+				value = (elfclass == ELFCLASS64) ? LIB_NAME_64 : LIB_NAME_32;
+			/* $PLATFORM and unknown tokens are not supported */
+			else return 1;
+			value_length = strlen(value);
+		}
+		else {
+			value = entry;
+			value_length = skip = 1;
+		}
+		if (pos + value_length >= maxsize) return 1;
+		memcpy(expanded + pos, value, value_length);
+		pos += value_length;
+	}
+	expanded[pos] = 0;
+	/* Relative entries would depend on the working directory of the process */
+	return expanded[0] != '/';
+}
+
+/*
+ * Looks for soname inside a ':' separated list of directories
+ * origin is the directory of the object the list belongs to
+ * Returns the path of the library or NULL if it was not found
+ */
+static const char *resolver_search_list(
+	struct resolver_t *res,
+	const char *list,
+	const char *origin,
+	const char *soname,
+	unsigned char elfclass,
+	uint16_t machine) {
+	char dir[PATH_MAX];
+	const char *found;
+	size_t length;
+	for (; *list; list += length + (list[length] != 0)) {
+		length = strcspn(list, ":");
+		if (!length
+			|| resolver_expand(dir, PATH_MAX, list, length, origin, elfclass)) continue;
+		if ((found = resolver_search_dir(res, dir, soname, elfclass, machine))) return found;
+	}
+	return NULL;
+}
+
+/*
+ * Looks for soname in the ld.so.cache, the ld.so.conf directories and
+ * the default directories, in that order
+ * The answer is memoized per ELF class and machine
+ * Returns the path of the library or NULL if it was not found
+ */
+static const char *resolver_search_system(
+	struct resolver_t *res,
+	const char *soname,
+	unsigned char elfclass,
+	uint16_t machine) {
+	static const char *const default_dirs_64[] = { "/usr/lib", "/lib", "/usr/lib64", "/lib64", NULL };
+	static const char *const default_dirs_32[] = { "/usr/lib32", "/lib32", "/usr/lib", "/lib", NULL };
+	struct hashmap_entry_t *entry, *cache_entry;
+	const char *const *dir;
+	const char *found;
+	char **cached, key[NAME_MAX + 32];
+	int inserted;
+	snprintf(key, sizeof(key), "%u:%u:%s", (unsigned int)elfclass, (unsigned int)machine, soname);
+	pthread_mutex_lock(&res->lock);
+	if ((entry = hashmap_get(&res->sonames, key))) {
+		found = (const char *)(entry->value);
+		pthread_mutex_unlock(&res->lock);
+		return found;
+	}
+	pthread_mutex_unlock(&res->lock);
+	/* The ld.so.cache map and the directory lists are read only after resolver_init() */
+	found = NULL;
+	if ((cache_entry = hashmap_get(&res->ld_cache, soname))) {
+		for (cached = (char **)(cache_entry->value); *cached && !found; ++cached) {
+			const char *path;
+			if (resolver_compatible(resolver_object(res, *cached, &path), elfclass, machine))
+				found = path;
+		}
+	}
+	for (dir = (const char *const *)res->conf_dirs; !found && dir && *dir; ++dir)
+		found = resolver_search_dir(res, *dir, soname, elfclass, machine);
+	for (dir = (elfclass == ELFCLASS64) ? default_dirs_64 : default_dirs_32; !found && *dir; ++dir)
+		found = resolver_search_dir(res, *dir, soname, elfclass, machine);
+	pthread_mutex_lock(&res->lock);
+	if ((entry = hashmap_put(&res->sonames, key, &inserted))) entry->value = (void *)found;
+	pthread_mutex_unlock(&res->lock);
+	return found;
+}
+
+/*
+ * Copies the directory part of path into origin
+ */
+static void resolver_origin(char *origin, size_t maxsize, const char *path) {
+	const char *slash = strrchr(path, '/');
+	size_t length = slash ? (size_t)(slash - path) : 0;
+	if (length >= maxsize) length = maxsize - 1;
+	memcpy(origin, path, length);
+	origin[length] = 0;
+}
+
+/*
+ * Finds the library soname needed by obj the way the dynamic loader does
+ * main is the object being checked, its DT_RPATH applies to every dependency
+ * Returns the path of the library or NULL if it was not found
+ */
+static const char *resolver_find(
+	struct resolver_t *res,
+	const struct elf_object_t *main_obj,
+	const char *main_path,
+	const struct elf_object_t *obj,
+	const char *path,
+	const char *soname) {
+	char origin[PATH_MAX];
+	const char *found;
+	if (strchr(soname, '/')) {
+		/* Names with a slash are loaded as is */
+		if (soname[0] != '/'
+			|| !resolver_compatible(resolver_object(res, soname, &found), obj->elfclass, obj->machine))
+			return NULL;
+		return found;
+	}
+	/* DT_RPATH is ignored if the object has a DT_RUNPATH */
+	if (!obj->runpath) {
+		if (obj->rpath) {
+			resolver_origin(origin, PATH_MAX, path);
+			if ((found = resolver_search_list(res, obj->rpath, origin, soname,
+				obj->elfclass, obj->machine))) return found;
+		}
+		if (obj != main_obj && main_obj->rpath && !main_obj->runpath) {
+			resolver_origin(origin, PATH_MAX, main_path);
+			if ((found = resolver_search_list(res, main_obj->rpath, origin, soname,
+				obj->elfclass, obj->machine))) return found;
+		}
+	}
+	else {
+		resolver_origin(origin, PATH_MAX, path);
+		if ((found = resolver_search_list(res, obj->runpath, origin, soname,
+			obj->elfclass, obj->machine))) return found;
+	}
+	return resolver_search_system(res, soname, obj->elfclass, obj->machine);
+}
+
+/*
+ * Returns true if a loader of the root is able to run obj
+ */
+static int resolver_checkable(const struct resolver_t *res, const struct elf_object_t *obj) {
+	size_t i;
+	if (!obj->dynamic || (obj->type != ET_EXEC && obj->type != ET_DYN)) return 0;
+	for (i = 0; i < res->loaders_count; ++i) {
+		if (res->loaders[i].elfclass == obj->elfclass && res->loaders[i].machine == obj->machine)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Returns the dynamic symbols of the library at path, every library is only
+ * mapped once and its table is shared by all the files linking it
+ * NULL is returned if path has no usable dynamic symbols
+ */
+static const struct elf_symbols_t *resolver_symbols(struct resolver_t *res, const char *path) {
+	struct hashmap_entry_t *entry;
+	struct elf_symbols_t *syms;
+	char filename[PATH_MAX];
+	int inserted;
+	pthread_mutex_lock(&res->lock);
+	if ((entry = hashmap_get(&res->symbols, path))) {
+		syms = (struct elf_symbols_t *)(entry->value);
+		pthread_mutex_unlock(&res->lock);
+		return syms;
+	}
+	pthread_mutex_unlock(&res->lock);
+	/* The file is read without holding the lock */
+	syms = resolver_filename(res, filename, PATH_MAX, path) ? NULL : elf_symbols_load(res->store, filename, 1);
+	pthread_mutex_lock(&res->lock);
+	if (!(entry = hashmap_put(&res->symbols, path, &inserted))) {
+		pthread_mutex_unlock(&res->lock);
+		return NULL;
+	}
+	/* The symbols belong to the store, another thread may have loaded the same path in the meantime */
+	if (inserted) entry->value = syms;
+	syms = (struct elf_symbols_t *)(entry->value);
+	pthread_mutex_unlock(&res->lock);
+	return syms;
+}
+
+/*
+ * Checks the versions and the undefined symbols of the object at path against
+ * the libraries loaded for it, like the loader binding everything at startup
+ * scope holds the loaded libraries in load order, names maps every needed
+ * soname to the path it was found at
+ * Shared objects often leave symbols to the program loading them, so only
+ * their versioned references are checked
+ * Returns the number of problems passed to missing
+ */
+static int resolver_check_symbols(
+	struct resolver_t *res,
+	const char *path,
+	const struct elf_object_t *main_obj,
+	const char *const *scope,
+	size_t scope_count,
+	const struct hashmap_t *names,
+	void (*missing)(const char *, const char *, void *),
+	void *data) {
+	const struct elf_symbols_t **libs, *lib;
+	const struct elf_version_t *need;
+	struct elf_symbols_t *syms;
+	struct hashmap_entry_t *entry;
+	char filename[PATH_MAX], message[PATH_MAX];
+	const char *name, *version;
+	unsigned char *failed;
+	Elf64_Sym sym;
+	size_t i, j;
+	uint16_t versym;
+	uint32_t hash;
+	int ret, complete;
+	if (resolver_filename(res, filename, PATH_MAX, path) || !(syms = elf_symbols_load(res->store, filename, 0))) return 0;
+	libs = calloc(scope_count + 1, sizeof(struct elf_symbols_t *));
+	failed = calloc(syms->versions_count + 1, 1);
+	if (!libs || !failed) {
+		error_handler("calloc()");
+		free(libs);
+		free(failed);
+		elf_symbols_free(syms);
+		return 0;
+	}
+	ret = 0;
+	/* Every required version must be defined by the library it is required from */
+	for (i = 0; i < syms->versions_count; ++i) {
+		need = syms->versions + i;
+		if (!need->name || !need->file || (need->flags & VER_FLG_WEAK)
+			|| !(entry = hashmap_get(names, need->file)) || !entry->value)
+			continue;
+		/* Without any version the loader only warns */
+		if (!(lib = resolver_symbols(res, (const char *)(entry->value))) || !lib->versions_count) continue;
+		for (j = 0; j < lib->versions_count
+			&& (!lib->versions[j].name || lib->versions[j].file || strcmp(lib->versions[j].name, need->name)); ++j) ;
+		if (j < lib->versions_count) continue;
+		failed[i] = 1;
+		snprintf(message, sizeof(message), "version `%s' not found", need->name);
+		if (missing) missing(need->file, message, data);
+		++ret;
+	}
+	/* The loader itself is always part of the scope */
+	complete = 1;
+	for (i = 0; i < scope_count; ++i) complete &= !!(libs[i] = resolver_symbols(res, scope[i]));
+	if (main_obj->interp) libs[scope_count++] = resolver_symbols(res, main_obj->interp);
+	/* A library without symbol table would make up undefined symbols */
+	for (i = 1; complete && i < syms->count; ++i) {
+		elf_symbols_sym(syms, i, &sym);
+		if (sym.st_shndx != SHN_UNDEF || ELF64_ST_BIND(sym.st_info) != STB_GLOBAL
+			|| !(name = elf_symbols_string(syms, sym.st_name)) || !*name)
+			continue;
+		versym = elf_symbols_versym(syms, i) & 0x7fff;
+		version = NULL;
+		if (versym >= 2 && versym < syms->versions_count) {
+			/* The missing version is reported already */
+			if (failed[versym]) continue;
+			version = syms->versions[versym].name;
+		}
+		if (!version && !main_obj->interp) continue;
+		hash = elf_gnu_hash(name);
+		for (j = 0; j < scope_count && !(libs[j] && elf_symbols_lookup(libs[j], name, hash, version)); ++j) ;
+		if (j < scope_count) continue;
+		if (version) snprintf(message, sizeof(message), "%s, version %s", name, version);
+		if (missing) missing(UNDEFINED_SYMBOL_MESSAGE, version ? message : name, data);
+		++ret;
+	}
+	free(libs);
+	free(failed);
+	elf_symbols_free(syms);
+	return ret;
+}
+
+/*
+ * Inits the state of a dependency walk, its maps borrow the names and paths
+ * of the objects and of the resolver
+ */
+static void resolver_walk_init(struct resolver_walk_t *walk) {
+	memset(walk, 0, sizeof(struct resolver_walk_t));
+	walk->visited.borrowed = 1;
+	walk->names.borrowed = 1;
+}
+
+/*
+ * Frees the state of a dependency walk
+ */
+static void resolver_walk_free(struct resolver_walk_t *walk) {
+	hashmap_free(&walk->visited, NULL);
+	hashmap_free(&walk->names, NULL);
+	free(walk->queue);
+}
+
+/*
+ * Resolves every dependency of the object at path, recursively
+ * walk is reused from call to call, so the maps and the queue keep their memory
+ * missing is called once with the name and the message of every problem, it may be NULL
+ * found is called once with the path of every library loaded, it may be NULL
+ * the paths passed to found live as long as the resolver
+ * Returns the number of missing sonames, or -1 if path can't be checked
+ */
+static int resolver_check(
+	struct resolver_t *res,
+	struct resolver_walk_t *walk,
+	const char *path,
+	void (*missing)(const char *, const char *, void *),
+	void (*found)(const char *, void *),
+	void *data) {
+	struct elf_object_t *main_obj, *obj;
+	struct hashmap_entry_t *entry;
+	const char **grown, *lib;
+	size_t queue_count, i, j;
+	int inserted, ret;
+	if (!(main_obj = resolver_object(res, path, &lib)) || !resolver_checkable(res, main_obj))
+		return -1;
+	hashmap_clear(&walk->visited);
+	hashmap_clear(&walk->names);
+	if (!walk->queue_size) {
+		if (!(walk->queue = malloc(16 * sizeof(char *)))) {
+			error_handler("malloc()");
+			return -1;
+		}
+		walk->queue_size = 16;
+	}
+	walk->queue[0] = lib;
+	queue_count = 1;
+	ret = 0;
+	hashmap_put(&walk->visited, lib, &inserted);
+	/* Breadth first walk over the dependency tree, every library is visited once */
+	for (i = 0; i < queue_count; ++i) {
+		const char *obj_path = walk->queue[i];
+		obj = resolver_object(res, obj_path, &lib);
+		for (j = 0; j < obj->needed_count; ++j) {
+			/* Like the loader, a name that was already loaded (or reported) is reused,
+			 * whatever the search path of the object needing it again */
+			if (hashmap_get(&walk->names, obj->needed[j])) continue;
+			lib = resolver_find(res, main_obj, path, obj, obj_path, obj->needed[j]);
+			if ((entry = hashmap_put(&walk->names, obj->needed[j], &inserted))) entry->value = (void *)lib;
+			if (!lib) {
+				if (missing) missing(obj->needed[j], NOT_FOUND_MESSAGE, data);
+				++ret;
+				continue;
+			}
+			if (!(entry = hashmap_put(&walk->visited, lib, &inserted)) || !inserted) continue;
+			if (found) found(lib, data);
+			if (queue_count == walk->queue_size) {
+				if (!(grown = realloc(walk->queue, 2 * walk->queue_size * sizeof(char *)))) {
+					error_handler("realloc()");
+					continue;
+				}
+				walk->queue = grown;
+				walk->queue_size *= 2;
+			}
+			walk->queue[queue_count++] = lib;
+		}
+	}
+	/* Symbols are only worth looking at once every library is there */
+	if (!ret && res->check_symbols)
+		ret = resolver_check_symbols(res, path, main_obj, walk->queue + 1, queue_count - 1, &walk->names, missing, data);
+	return ret;
+}
+
+/*
+ * Adds a directory from ld.so.conf to the resolver
+ */
+static void resolver_add_conf_dir(struct resolver_t *res, const char *dir) {
+	char **grown;
+	size_t i;
+	for (i = 0; i < res->conf_dirs_count; ++i)
+		if (!strcmp(res->conf_dirs[i], dir)) return;
+	/* Keep the list NULL terminated */
+	if (!(grown = realloc(res->conf_dirs, (res->conf_dirs_count + 2) * sizeof(char *)))) {
+		error_handler("realloc()");
+		return;
+	}
+	res->conf_dirs = grown;
+	if (!(res->conf_dirs[res->conf_dirs_count] = strdup(dir))) {
+		error_handler("strdup()");
+		return;
+	}
+	res->conf_dirs[++res->conf_dirs_count] = NULL;
+}
+
+static void resolver_parse_conf(struct resolver_t *res, const char *path, int depth);
+
+/*
+ * Follows an include directive of ld.so.conf
+ * Relative patterns are relative to the directory of the including file
+ */
+static void resolver_parse_conf_include(
+	struct resolver_t *res,
+	const char *path,
+	char *patterns,
+	int depth) {
+	char pattern[PATH_MAX], origin[PATH_MAX];
+	char *save, *token;
+	glob_t globbuf;
+	size_t i;
+	resolver_origin(origin, PATH_MAX, path);
+	for (token = strtok_r(patterns, " \t", &save); token; token = strtok_r(NULL, " \t", &save)) {
+		int length = snprintf(pattern, PATH_MAX, "%s%s%s%s",
+			res->root_path, (token[0] == '/') ? "" : origin, (token[0] == '/') ? "" : "/", token);
+		if (length < 0 || length >= PATH_MAX) continue;
+		if (glob(pattern, 0, NULL, &globbuf)) continue;
+		/* glob() sorts the results, which is the order ldconfig uses as well */
+		for (i = 0; i < globbuf.gl_pathc; ++i)
+			resolver_parse_conf(res, globbuf.gl_pathv[i] + res->root_path_length, depth);
+		globfree(&globbuf);
+	}
+}
+
+/*
+ * Collects the directories of an ld.so.conf file and its includes
+ * path is relative to the root, depth protects against include loops
+ */
+static void resolver_parse_conf(struct resolver_t *res, const char *path, int depth) {
+	char filename[PATH_MAX];
+	char *line, *start, *end, *save;
+	size_t maxsize;
+	FILE *file;
+	if (depth > LD_SO_CONF_MAX_DEPTH || resolver_filename(res, filename, PATH_MAX, path)) return;
+	STATS_ADD(res->store->stats, open_calls, 1);
+	if (!(file = fopen(filename, "re"))) return;
+	line = NULL;
+	maxsize = 0;
+	while (getline(&line, &maxsize, file) >= 0) {
+		line[strcspn(line, "#\r\n")] = 0;
+		for (start = line; isspace((unsigned char)*start); ++start) ;
+		for (end = start + strlen(start); end > start && isspace((unsigned char)end[-1]); --end) ;
+		*end = 0;
+		if (!*start) continue;
+		if (!strncmp(start, "include", 7) && isspace((unsigned char)start[7])) {
+			resolver_parse_conf_include(res, path, start + 8, depth + 1);
+			continue;
+		}
+		if (!strncmp(start, "hwcap", 5) && isspace((unsigned char)start[5])) continue;
+		for (start = strtok_r(start, " \t:,", &save); start; start = strtok_r(NULL, " \t:,", &save)) {
+			/* Drop the legacy "dir=type" suffix */
+			start[strcspn(start, "=")] = 0;
+			if (start[0] == '/') resolver_add_conf_dir(res, start);
+		}
+	}
+	free(line);
+	fclose(file);
+}
+
+/*
+ * Appends path to the ld.so.cache entries of soname
+ */
+static void resolver_add_cache_entry(struct resolver_t *res, const char *soname, const char *path) {
+	struct hashmap_entry_t *entry;
+	char **paths, **grown;
+	size_t count;
+	int inserted;
+	if (!(entry = hashmap_put(&res->ld_cache, soname, &inserted))) return;
+	paths = (char **)(entry->value);
+	for (count = 0; paths && paths[count]; ++count) ;
+	/* Keep the array NULL terminated */
+	if (!(grown = realloc(paths, (count + 2) * sizeof(char *)))) {
+		error_handler("realloc()");
+		return;
+	}
+	entry->value = grown;
+	if (!(grown[count] = strdup(path))) error_handler("strdup()");
+	else ++count;
+	grown[count] = NULL;
+}
+
+/*
+ * Frees an ld.so.cache entry array
+ */
+static void resolver_free_cache_entry(void *data) {
+	char **paths;
+	for (paths = (char **)data; *paths; ++paths) free(*paths);
+	free(data);
+}
+
+/*
+ * Loads the root's ld.so.cache
+ * Both the new format and the old format with the new one appended are handled
+ * A missing cache is fine, ld.so.conf and the default directories remain
+ */
+static void resolver_load_cache(struct resolver_t *res) {
+	/* struct cache_file_new and struct file_entry_new from glibc's dl-cache.h */
+	const size_t header_size = 48, entry_size = 24, old_header_size = 16, old_entry_size = 12;
+	char filename[PATH_MAX];
+	struct stat statbuf;
+	const unsigned char *map, *base;
+	size_t size, offset, strings_size, i;
+	uint32_t nlibs, key, value;
+	int fd;
+	if (resolver_filename(res, filename, PATH_MAX, LD_SO_CACHE)) return;
+	STATS_ADD(res->store->stats, open_calls, 1);
+	if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0) return;
+	STATS_ADD(res->store->stats, stat_calls, 1);
+	if (fstat(fd, &statbuf) < 0 || statbuf.st_size <= 0) {
+		close(fd);
+		return;
+	}
+	size = (size_t)statbuf.st_size;
+	STATS_ADD(res->store->stats, map_calls, 1);
+	map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return;
+	STATS_ADD(res->store->stats, bytes, size);
+	offset = 0;
+	if (size >= old_header_size
+		&& !memcmp(map, LD_SO_CACHE_OLD_MAGIC, LD_SO_CACHE_OLD_MAGIC_LENGTH)) {
+		memcpy(&nlibs, map + LD_SO_CACHE_OLD_MAGIC_LENGTH + 1, sizeof(uint32_t));
+		/* The new format follows the old entries, aligned for its 64bit fields */
+		offset = (old_header_size + (size_t)nlibs * old_entry_size + 7) & ~(size_t)7;
+	}
+	if (offset > size || size - offset < header_size
+		|| memcmp(map + offset, LD_SO_CACHE_MAGIC, LD_SO_CACHE_MAGIC_LENGTH)) {
+		munmap((void *)map, size);
+		return;
+	}
+	/* The string offsets are relative to the new format header */
+	base = map + offset;
+	strings_size = size - offset;
+	memcpy(&nlibs, base + LD_SO_CACHE_MAGIC_LENGTH, sizeof(uint32_t));
+	for (i = 0; i < nlibs && header_size + (i + 1) * entry_size <= strings_size; ++i) {
+		const unsigned char *entry = base + header_size + i * entry_size;
+		memcpy(&key, entry + 4, sizeof(uint32_t));
+		memcpy(&value, entry + 8, sizeof(uint32_t));
+		if (key >= strings_size || value >= strings_size
+			|| !memchr(base + key, 0, strings_size - key)
+			|| !memchr(base + value, 0, strings_size - value)) continue;
+		resolver_add_cache_entry(res, (const char *)(base + key), (const char *)(base + value));
+	}
+	munmap((void *)map, size);
+}
+
+/*
+ * Collects the ld-linux loaders of LIB_DIR inside root_path
+ * along with their ELF class and machine, store, if not NULL, counts the reads
+ */
+static void loaders_scan(
+	const char *root_path,
+	struct elf_store_t *store,
+	struct loader_t **loaders,
+	size_t *loaders_count) {
+	struct dirent **list;
+	struct elf_object_t *obj;
+	struct loader_t *grown;
+	char path[PATH_MAX], filename[PATH_MAX];
+	int nbentries, i, length;
+	*loaders = NULL;
+	*loaders_count = 0;
+	length = snprintf(filename, PATH_MAX, "%s%s", root_path, LIB_DIR);
+	if (length < 0 || length >= PATH_MAX
+		|| (nbentries = scandir(filename, &list, ld_filter, alphasort)) < 0) return;
+	for (i = 0; i < nbentries; ++i) {
+		snprintf(path, PATH_MAX, "%s/%s", LIB_DIR, list[i]->d_name);
+		snprintf(filename, PATH_MAX, "%s%s", root_path, path);
+		free(list[i]);
+		if (!(obj = elf_object_load(store, filename, 0))) continue;
+		if (!(grown = realloc(*loaders, (*loaders_count + 1) * sizeof(struct loader_t)))) {
+			error_handler("realloc()");
+			elf_object_free(obj);
+			continue;
+		}
+		*loaders = grown;
+		grown[*loaders_count].elfclass = obj->elfclass;
+		grown[*loaders_count].machine = obj->machine;
+		elf_object_free(obj);
+		if (!(grown[*loaders_count].path = strdup(path))) {
+			error_handler("strdup()");
+			continue;
+		}
+		++*loaders_count;
+	}
+	free(list);
+}
+
+/*
+ * Frees the loaders collected by loaders_scan()
+ */
+static void loaders_free(struct loader_t *loaders, size_t loaders_count) {
+	size_t i;
+	for (i = 0; i < loaders_count; ++i) free(loaders[i].path);
+	free(loaders);
+}
+
+/*
+ * Inits the resolver for root_path, reading its ld.so.cache and ld.so.conf
+ * The files are parsed through store, which must outlive the resolver
+ */
+static void resolver_init(struct resolver_t *res, const char *root_path, struct elf_store_t *store) {
+	memset(res, 0, sizeof(struct resolver_t));
+	pthread_mutex_init(&res->lock, NULL);
+	res->store = store;
+	strncpy(res->root_path, root_path, PATH_MAX - 1);
+	res->root_path_length = strlen(res->root_path);
+	/* Paths inside the root always start with a '/' */
+	for (; res->root_path_length && res->root_path[res->root_path_length - 1] == '/';
+		--res->root_path_length) res->root_path[res->root_path_length - 1] = 0;
+	/* Only files with a matching loader get checked */
+	loaders_scan(res->root_path, res->store, &res->loaders, &res->loaders_count);
+	resolver_load_cache(res);
+	resolver_parse_conf(res, LD_SO_CONF, 0);
+}
+
+/*
+ * Releases everything held by the resolver
+ */
+static void resolver_free(struct resolver_t *res) {
+	size_t i;
+	hashmap_free(&res->ld_cache, resolver_free_cache_entry);
+	hashmap_free(&res->objects, NULL);
+	hashmap_free(&res->sonames, NULL);
+	hashmap_free(&res->symbols, NULL);
+	for (i = 0; i < res->conf_dirs_count; ++i) free(res->conf_dirs[i]);
+	free(res->conf_dirs);
+	loaders_free(res->loaders, res->loaders_count);
+	pthread_mutex_destroy(&res->lock);
+}
+
+/*
+ * Enumerates the loaders of the running system, done once per run
+ */
+static void ld_bin_finder_init(struct ld_bin_finder_t *finder) {
+	memset(finder, 0, sizeof(struct ld_bin_finder_t));
+	pthread_mutex_init(&finder->lock, NULL);
+	loaders_scan("", NULL, &finder->loaders, &finder->loaders_count);
+}
+
+/*
+ * Releases the loaders and the cached choices
+ */
+static void ld_bin_finder_free(struct ld_bin_finder_t *finder) {
+	loaders_free(finder->loaders, finder->loaders_count);
+	hashmap_free(&finder->cache, NULL);
+	pthread_mutex_destroy(&finder->lock);
+}
+
+/*
+ * Finds the best ld for obj without running anything
+ * The loader named by PT_INTERP is preferred, libraries get the first loader
+ * of the same ELF class and machine
+ * The choice is cached per class, machine and interpreter
+ * Returns the path of the loader or NULL if none can handle obj
+ */
+static const char *ld_bin_finder(struct ld_bin_finder_t *finder, const struct elf_object_t *obj) {
+	struct hashmap_entry_t *entry;
+	const char *interp_name, *name, *ld_bin;
+	char key[PATH_MAX + 32];
+	size_t i;
+	int inserted;
+	snprintf(key, sizeof(key), "%u:%u:%s",
+		(unsigned int)obj->elfclass, (unsigned int)obj->machine, obj->interp ? obj->interp : "");
+	pthread_mutex_lock(&finder->lock);
+	if (!(entry = hashmap_put(&finder->cache, key, &inserted)) || !inserted) {
+		ld_bin = entry ? (const char *)(entry->value) : NULL;
+		pthread_mutex_unlock(&finder->lock);
+		return ld_bin;
+	}
+	interp_name = obj->interp ? strrchr(obj->interp, '/') : NULL;
+	interp_name = interp_name ? interp_name + 1 : obj->interp;
+	for (i = 0; i < finder->loaders_count; ++i) {
+		if (finder->loaders[i].elfclass != obj->elfclass
+			|| finder->loaders[i].machine != obj->machine) continue;
+		name = strrchr(finder->loaders[i].path, '/') + 1;
+		if (!entry->value) entry->value = finder->loaders[i].path;
+		/* An exact match on the interpreter wins over the first compatible one */
+		if (interp_name && !strcmp(interp_name, name)) {
+			entry->value = finder->loaders[i].path;
+			break;
+		}
+	}
+	ld_bin = (const char *)(entry->value);
+	pthread_mutex_unlock(&finder->lock);
+	return ld_bin;
+}
+
+/*
+ * Fills stamp from the result of stat()
+ */
+static void file_stamp_init(struct file_stamp_t *stamp, const struct stat *statbuf) {
+	stamp->dev = (uint64_t)statbuf->st_dev;
+	stamp->ino = (uint64_t)statbuf->st_ino;
+	stamp->size = (uint64_t)statbuf->st_size;
+	stamp->mtime = (int64_t)statbuf->st_mtim.tv_sec * 1000000000 + (int64_t)statbuf->st_mtim.tv_nsec;
+}
+
+/*
+ * Stamps a path inside the root, a missing file gets a zeroed stamp
+ */
+static void file_stamp_path(struct file_stamp_t *stamp, const struct resolver_t *res, const char *path) {
+	char filename[PATH_MAX];
+	struct stat statbuf;
+	memset(stamp, 0, sizeof(struct file_stamp_t));
+	STATS_ADD(res->store->stats, stat_calls, 1);
+	if (!resolver_filename(res, filename, PATH_MAX, path) && !stat(filename, &statbuf))
+		file_stamp_init(stamp, &statbuf);
+}
+
+/*
+ * Returns true if both stamps describe the same file contents
+ */
+static inline int file_stamp_equal(const struct file_stamp_t *a, const struct file_stamp_t *b) {
+	return a->dev == b->dev && a->ino == b->ino && a->size == b->size && a->mtime == b->mtime;
+}
+
+/*
+ * Writes a stamp followed by a space
+ */
+static void file_stamp_write(FILE *out, const struct file_stamp_t *stamp) {
+	fprintf(out, "%llu %llu %llu %lld ",
+		(unsigned long long)stamp->dev,
+		(unsigned long long)stamp->ino,
+		(unsigned long long)stamp->size,
+		(long long)stamp->mtime);
+}
+
+/*
+ * Parses a number followed by a space
+ * Returns what follows or NULL if the line is malformed
+ */
+static char *scan_cache_field(char *line, uint64_t *value) {
+	char *end;
+	errno = 0;
+	*value = (uint64_t)strtoull(line, &end, 10);
+	return (end == line || *end != ' ' || errno) ? NULL : end + 1;
+}
+
+/*
+ * Parses a stamp written by file_stamp_write()
+ * Returns what follows or NULL if the line is malformed
+ */
+static char *file_stamp_parse(char *line, struct file_stamp_t *stamp) {
+	uint64_t mtime;
+	if (!(line = scan_cache_field(line, &stamp->dev))
+		|| !(line = scan_cache_field(line, &stamp->ino))
+		|| !(line = scan_cache_field(line, &stamp->size))
+		|| !(line = scan_cache_field(line, &mtime)))
+		return NULL;
+	stamp->mtime = (int64_t)mtime;
+	return line;
+}
+
+/*
+ * Stamps the files deciding where the system libraries are found
+ * A change of any of them invalidates every cached verdict
+ */
+static void scan_cache_system(struct file_stamp_t *stamps, const struct resolver_t *res) {
+	file_stamp_path(stamps, res, LD_SO_CACHE);
+	file_stamp_path(stamps + 1, res, LD_SO_CONF);
+}
+
+/*
+ * Hashes the package selection of filter, the order of the repositories and of
+ * the patterns does not matter
+ * Returns 0 for the foreign packages of any name, the default selection
+ */
+static uint64_t scan_cache_selection(const struct aurbrokenpkgcheck_filter_t *filter) {
+	uint64_t values[3], hash = 14695981039346656037ULL;
+	size_t i;
+	if (!filter || (!filter->all && !filter->repos_count && !filter->globs_count)) return 0;
+	values[0] = (uint64_t)(filter->all != 0);
+	values[1] = values[2] = 0;
+	for (i = 0; i < filter->repos_count; ++i) values[1] += hashmap_hash(filter->repos[i]);
+	for (i = 0; i < filter->globs_count; ++i) values[2] += hashmap_hash(filter->globs[i]);
+	for (i = 0; i < 3; ++i) {
+		hash ^= values[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash ? hash : 1;
+}
+
+/*
+ * Picks the cache file of the root and of the package selection of filter
+ * under $XDG_CACHE_HOME, creating its directory
+ * Anything other than 0 returned means there is no place for a cache
+ */
+static int scan_cache_init(
+	struct scan_cache_t *cache,
+	const struct resolver_t *res,
+	const struct aurbrokenpkgcheck_filter_t *filter) {
+	const char *base;
+	char dir[PATH_MAX], selection[32], *p;
+	uint64_t hash;
+	int length;
+	memset(cache, 0, sizeof(struct scan_cache_t));
+	if ((base = getenv("XDG_CACHE_HOME")) && base[0] == '/')
+		length = snprintf(dir, PATH_MAX, "%s/%s", base, SCAN_CACHE_DIR);
+	else if ((base = getenv("HOME")) && base[0] == '/')
+		length = snprintf(dir, PATH_MAX, "%s/.cache/%s", base, SCAN_CACHE_DIR);
+	else return 1;
+	if (length < 0 || length >= PATH_MAX) return 1;
+	/* The parents may be missing too */
+	for (p = dir + 1; *p; ++p) {
+		if (*p != '/') continue;
+		*p = 0;
+		mkdir(dir, 0755);
+		*p = '/';
+	}
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST) return error_handler(dir);
+	/* A full check of another selection would drop the verdicts of these packages */
+	selection[0] = 0;
+	if ((hash = scan_cache_selection(filter))) snprintf(selection, sizeof(selection), "-select-%016llx", (unsigned long long)hash);
+	/* Every root gets its own cache, a clean verdict without symbols means less */
+	length = snprintf(cache->filename, PATH_MAX, "%s/root-%016llx%s%s.cache",
+		dir, (unsigned long long)hashmap_hash(res->root_path), selection, res->check_symbols ? "-symbols" : "");
+	return length < 0 || length >= PATH_MAX;
+}
+
+/*
+ * Reads the verdicts of the previous run from the cache file
+ * Only the files that did not change, along with all their libraries, are kept
+ * A missing or outdated cache is no error, it is simply empty
+ */
+static void scan_cache_load(struct scan_cache_t *cache, const struct resolver_t *res) {
+	struct file_stamp_t system[2], stamps[2], stamp;
+	struct scan_cache_entry_t *entry;
+	struct hashmap_entry_t *slot;
+	void *grown;
+	FILE *in;
+	char *line, *rest;
+	size_t line_size, libs_size, i;
+	uint64_t verdict, count, index;
+	ssize_t length;
+	int inserted;
+	STATS_ADD(res->store->stats, open_calls, 1);
+	if (!(in = fopen(cache->filename, "r"))) return;
+	line = NULL;
+	line_size = 0;
+	libs_size = 0;
+	/* The header names the root */
+	if ((length = getline(&line, &line_size, in)) <= 0
+		|| strncmp(line, SCAN_CACHE_MAGIC "\t", sizeof(SCAN_CACHE_MAGIC))
+		|| (size_t)length != sizeof(SCAN_CACHE_MAGIC) + res->root_path_length + 1
+		|| strncmp(line + sizeof(SCAN_CACHE_MAGIC), res->root_path, res->root_path_length))
+		goto done;
+	/* A changed library configuration may move any library */
+	scan_cache_system(system, res);
+	if (getline(&line, &line_size, in) <= 0 || line[0] != 'S' || line[1] != ' '
+		|| !(rest = file_stamp_parse(line + 2, stamps))
+		|| !file_stamp_parse(rest, stamps + 1)
+		|| !file_stamp_equal(system, stamps) || !file_stamp_equal(system + 1, stamps + 1))
+		goto done;
+	while ((length = getline(&line, &line_size, in)) > 0) {
+		/* A truncated last line is ignored */
+		if (line[length - 1] != '\n') break;
+		line[length - 1] = 0;
+		if (line[0] == 'L' && line[1] == ' ') {
+			if (!(rest = file_stamp_parse(line + 2, &stamp)) || *rest != '\t') break;
+			if (cache->libs_count == libs_size) {
+				libs_size = libs_size ? libs_size * 2 : 256;
+				if (!(grown = realloc(cache->libs, libs_size * sizeof(struct scan_cache_lib_t)))) {
+					error_handler("realloc()");
+					break;
+				}
+				cache->libs = grown;
+			}
+			if (!(cache->libs[cache->libs_count].path = strdup(rest + 1))) {
+				error_handler("strdup()");
+				break;
+			}
+			cache->libs[cache->libs_count].stamp = stamp;
+			/* Every library is stamped once for all the files depending on it */
+			file_stamp_path(&stamp, res, rest + 1);
+			cache->libs[cache->libs_count].valid = file_stamp_equal(&stamp, &cache->libs[cache->libs_count].stamp);
+			++cache->libs_count;
+		}
+		else if (line[0] == 'F' && line[1] == ' ') {
+			if (!(rest = file_stamp_parse(line + 2, &stamp))
+				|| !(rest = scan_cache_field(rest, &verdict))
+				|| !(rest = scan_cache_field(rest, &count))
+				|| count > cache->libs_count)
+				break;
+			if (!(entry = malloc(sizeof(struct scan_cache_entry_t) + (size_t)count * sizeof(size_t)))) {
+				error_handler("malloc()");
+				break;
+			}
+			entry->stamp = stamp;
+			entry->verdict = (int)verdict;
+			entry->libs = (size_t *)(entry + 1);
+			entry->libs_count = (size_t)count;
+			for (i = 0; rest && i < entry->libs_count; ++i) {
+				if ((rest = scan_cache_field(rest, &index)) && index < cache->libs_count)
+					entry->libs[i] = (size_t)index;
+				else rest = NULL;
+			}
+			if (!rest || *rest != '\t') {
+				free(entry);
+				break;
+			}
+			/* Files depending on a changed library get checked again */
+			for (i = 0; i < entry->libs_count && cache->libs[entry->libs[i]].valid; ++i) ;
+			if (i < entry->libs_count
+				|| (entry->verdict != SCAN_CACHE_SKIP && entry->verdict != SCAN_CACHE_CLEAN)
+				|| !(slot = hashmap_put(&cache->files, rest + 1, &inserted))
+				|| !inserted) {
+				free(entry);
+				continue;
+			}
+			slot->value = entry;
+		}
+		else break;
+	}
+done:
+	free(line);
+	fclose(in);
+}
+
+/*
+ * Returns the cached verdict of a file if neither it nor its libraries changed
+ */
+static const struct scan_cache_entry_t *scan_cache_lookup(
+	const struct scan_cache_t *cache,
+	const char *name,
+	const struct file_stamp_t *stamp) {
+	struct hashmap_entry_t *entry;
+	const struct scan_cache_entry_t *cached;
+	if (!(entry = hashmap_get(&cache->files, name))) return NULL;
+	cached = (const struct scan_cache_entry_t *)(entry->value);
+	return file_stamp_equal(&cached->stamp, stamp) ? cached : NULL;
+}
+
+/*
+ * Returns the number of libraries of a checked file
+ */
+static inline size_t scan_cache_file_libs(const struct check_file_t *file) {
+	return file->cached ? file->cached->libs_count : file->deps_count;
+}
+
+/*
+ * Returns the path of a library of a checked file
+ * stamp is set to the cached stamp of the library, or NULL if it was just resolved
+ */
+static const char *scan_cache_file_lib(
+	const struct scan_cache_t *cache,
+	const struct check_file_t *file,
+	size_t index,
+	const struct file_stamp_t **stamp) {
+	if (!file->cached) {
+		*stamp = NULL;
+		return file->deps[index];
+	}
+	*stamp = &cache->libs[file->cached->libs[index]].stamp;
+	return cache->libs[file->cached->libs[index]].path;
+}
+
+/*
+ * Returns true if the verdict of a checked file can be written to the cache
+ */
+static int scan_cache_cacheable(const struct scan_cache_t *cache, const struct check_file_t *file) {
+	const struct file_stamp_t *stamp;
+	size_t i;
+	/* The cache is line based */
+	if (!file->verdict || strchr(file->name, '\n')) return 0;
+	for (i = 0; i < scan_cache_file_libs(file); ++i) {
+		if (strchr(scan_cache_file_lib(cache, file, i, &stamp), '\n')) return 0;
+	}
+	return 1;
+}
+
+/*
+ * Gives a library of the cache file its index, the first time it is met
+ * stamp is its cached stamp, NULL to stamp it now
+ * Anything other than 0 returned is an error
+ */
+static int scan_cache_save_lib(
+	const struct resolver_t *res,
+	struct hashmap_t *indexes,
+	struct scan_cache_lib_t **libs,
+	size_t *libs_count,
+	size_t *libs_size,
+	const char *path,
+	const struct file_stamp_t *stamp) {
+	struct hashmap_entry_t *entry;
+	void *grown;
+	int inserted;
+	if (!(entry = hashmap_put(indexes, path, &inserted))) return 1;
+	if (!inserted) return 0;
+	if (*libs_count == *libs_size) {
+		*libs_size = *libs_size ? *libs_size * 2 : 256;
+		if (!(grown = realloc(*libs, *libs_size * sizeof(struct scan_cache_lib_t)))) return error_handler("realloc()");
+		*libs = grown;
+	}
+	/* The index is stored off by one to tell it from an empty value */
+	entry->value = (void *)(uintptr_t)(*libs_count + 1);
+	(*libs)[*libs_count].path = entry->key;
+	if (stamp) (*libs)[*libs_count].stamp = *stamp;
+	else file_stamp_path(&(*libs)[*libs_count].stamp, res, path);
+	++*libs_count;
+	return 0;
+}
+
+/*
+ * Writes the cacheable verdicts of this run to the cache file
+ * If merge is set only some packages were checked, so the verdicts loaded for
+ * the files this run did not visit are written again, else they are dropped
+ * The file is replaced at once, anything other than 0 returned is an error
+ */
+static int scan_cache_save(
+	const struct scan_cache_t *cache,
+	const struct resolver_t *res,
+	const struct check_file_t *files,
+	size_t files_count,
+	int merge) {
+	struct file_stamp_t system[2];
+	struct scan_cache_lib_t *libs;
+	const struct scan_cache_entry_t *cached;
+	const struct file_stamp_t *stamp;
+	struct hashmap_t indexes, visited;
+	struct hashmap_entry_t *entry;
+	const char *path;
+	char filename[PATH_MAX];
+	FILE *out;
+	size_t libs_count, libs_size, i, j;
+	int inserted, length, ret;
+	length = snprintf(filename, PATH_MAX, "%s.tmp", cache->filename);
+	if (length < 0 || length >= PATH_MAX) return 1;
+	memset(&indexes, 0, sizeof(struct hashmap_t));
+	memset(&visited, 0, sizeof(struct hashmap_t));
+	visited.borrowed = 1;
+	libs = NULL;
+	libs_count = libs_size = 0;
+	ret = 0;
+	/* Every library is written once, the files refer to it by index */
+	for (i = 0; i < files_count && !ret; ++i) {
+		/* A visited file keeps no older verdict, even a broken one */
+		if (merge && !hashmap_put(&visited, files[i].name, &inserted)) ret = 1;
+		if (!scan_cache_cacheable(cache, files + i)) continue;
+		for (j = 0; j < scan_cache_file_libs(files + i) && !ret; ++j) {
+			path = scan_cache_file_lib(cache, files + i, j, &stamp);
+			ret = scan_cache_save_lib(res, &indexes, &libs, &libs_count, &libs_size, path, stamp);
+		}
+	}
+	for (i = 0; merge && i < cache->files.size && !ret; ++i) {
+		if (!cache->files.entries[i].key || hashmap_get(&visited, cache->files.entries[i].key)) continue;
+		cached = (const struct scan_cache_entry_t *)(cache->files.entries[i].value);
+		for (j = 0; j < cached->libs_count && !ret; ++j) {
+			ret = scan_cache_save_lib(res, &indexes, &libs, &libs_count, &libs_size,
+				cache->libs[cached->libs[j]].path, &cache->libs[cached->libs[j]].stamp);
+		}
+	}
+	STATS_ADD(res->store->stats, open_calls, 1);
+	if (!ret && !(out = fopen(filename, "w"))) ret = error_handler(filename);
+	if (!ret) {
+		fprintf(out, "%s\t%s\n", SCAN_CACHE_MAGIC, res->root_path);
+		scan_cache_system(system, res);
+		fputs("S ", out);
+		file_stamp_write(out, system);
+		file_stamp_write(out, system + 1);
+		fputc('\n', out);
+		for (i = 0; i < libs_count; ++i) {
+			fputs("L ", out);
+			file_stamp_write(out, &libs[i].stamp);
+			fprintf(out, "\t%s\n", libs[i].path);
+		}
+		for (i = 0; i < files_count; ++i) {
+			if (!scan_cache_cacheable(cache, files + i)) continue;
+			fputs("F ", out);
+			file_stamp_write(out, &files[i].stamp);
+			fprintf(out, "%d %zu ", files[i].verdict, scan_cache_file_libs(files + i));
+			for (j = 0; j < scan_cache_file_libs(files + i); ++j) {
+				entry = hashmap_get(&indexes, scan_cache_file_lib(cache, files + i, j, &stamp));
+				fprintf(out, "%zu ", (size_t)(uintptr_t)(entry->value) - 1);
+			}
+			fprintf(out, "\t%s\n", files[i].name);
+		}
+		for (i = 0; merge && i < cache->files.size; ++i) {
+			if (!cache->files.entries[i].key || hashmap_get(&visited, cache->files.entries[i].key)) continue;
+			cached = (const struct scan_cache_entry_t *)(cache->files.entries[i].value);
+			fputs("F ", out);
+			file_stamp_write(out, &cached->stamp);
+			fprintf(out, "%d %zu ", cached->verdict, cached->libs_count);
+			for (j = 0; j < cached->libs_count; ++j) {
+				entry = hashmap_get(&indexes, cache->libs[cached->libs[j]].path);
+				fprintf(out, "%zu ", (size_t)(uintptr_t)(entry->value) - 1);
+			}
+			fprintf(out, "\t%s\n", cache->files.entries[i].key);
+		}
+		ret = ferror(out);
+		if (fclose(out) || ret) ret = error_handler(filename);
+		else if (rename(filename, cache->filename) < 0) ret = error_handler(cache->filename);
+		if (ret) unlink(filename);
+	}
+	free(libs);
+	hashmap_free(&indexes, NULL);
+	hashmap_free(&visited, NULL);
+	return ret;
+}
+
+/*
+ * Frees the cached verdicts
+ */
+static void scan_cache_free(struct scan_cache_t *cache) {
+	size_t i;
+	for (i = 0; i < cache->libs_count; ++i) free(cache->libs[i].path);
+	free(cache->libs);
+	hashmap_free(&cache->files, free);
+}
+
+/*
+ * Writes the part of a library file name up to ".so" into stem, "libfoo.so" for "libfoo.so.3"
+ * Anything other than 0 returned means the name is no shared library
+ */
+static int soname_stem(const char *name, char *stem, size_t size) {
+	const char *so;
+	for (so = strstr(name, ".so"); so && so[3] && so[3] != '.'; so = strstr(so + 1, ".so")) ;
+	if (!so || (size_t)(so - name) + 3 >= size) return 1;
+	memcpy(stem, name, (size_t)(so - name) + 3);
+	stem[so - name + 3] = 0;
+	return 0;
+}
+
+/*
+ * Inits an empty index of the libraries of the packages of db_local, built by soname_index_get()
+ */
+static void soname_index_init(struct soname_index_t *index, alpm_db_t *db_local) {
+	memset(index, 0, sizeof(struct soname_index_t));
+	index->db_local = db_local;
+}
+
+/*
+ * Frees the index, the names belong to the alpm handle
+ */
+static void soname_index_free(struct soname_index_t *index) {
+	hashmap_free(&index->stems, NULL);
+	arena_free(&index->arena);
+}
+
+/*
+ * Adds a file of a package to the index if it is a library
+ * The copies of a library in several directories of a package are only added once
+ */
+static void soname_index_add(struct soname_index_t *index, const char *package, const char *filename) {
+	struct soname_provider_t *provider;
+	struct soname_stem_t *stem;
+	struct hashmap_entry_t *entry;
+	const char *soname;
+	char key[NAME_MAX + 1];
+	int inserted;
+	soname = (soname = strrchr(filename, '/')) ? soname + 1 : filename;
+	if (!*soname || soname_stem(soname, key, sizeof(key))) return;
+	if (!(entry = hashmap_put(&index->stems, key, &inserted))) return;
+	if (inserted && !(entry->value = arena_alloc(&index->arena, sizeof(struct soname_stem_t)))) return;
+	if (!(stem = (struct soname_stem_t *)(entry->value))) return;
+	if (inserted) stem->first = stem->last = NULL;
+	for (provider = stem->first; provider; provider = provider->next) {
+		if (provider->package == package && !strcmp(provider->soname, soname)) return;
+	}
+	if (!(provider = arena_alloc(&index->arena, sizeof(struct soname_provider_t)))) return;
+	provider->soname = soname;
+	provider->package = package;
+	provider->next = NULL;
+	if (stem->last) stem->last->next = provider;
+	else stem->first = provider;
+	stem->last = provider;
+	++index->count;
+}
+
+/*
+ * Indexes the files of every installed package, from their filelists only
+ * Only the main thread talks to alpm, so only it builds the index
+ */
+static void soname_index_build(struct soname_index_t *index) {
+	const alpm_filelist_t *filelist;
+	const char *package;
+	alpm_list_t *i;
+	uint64_t start;
+	size_t j;
+	start = stats_now();
+	for (i = alpm_db_get_pkgcache(index->db_local); i; i = alpm_list_next(i)) {
+		package = alpm_pkg_get_name((alpm_pkg_t *)(i->data));
+		if (!(filelist = alpm_pkg_get_files((alpm_pkg_t *)(i->data)))) continue;
+		for (j = 0; j < filelist->count; ++j) soname_index_add(index, package, filelist->files[j].name);
+	}
+	index->build_time = stats_now() - start;
+	index->built = 1;
+}
+
+/*
+ * Returns the index, built on the first call so a run without any missing
+ * library never reads the filelists of the other packages
+ */
+static const struct soname_index_t *soname_index_get(struct soname_index_t *index) {
+	if (!index->built) soname_index_build(index);
+	return index;
+}
+
+/*
+ * Finds the libraries installed with the same stem as the library name
+ * Returns NULL if there are none
+ */
+static const struct soname_provider_t *soname_index_lookup(const struct soname_index_t *index, const char *name) {
+	const struct hashmap_entry_t *entry;
+	char key[NAME_MAX + 1];
+	if (soname_stem(name, key, sizeof(key))) return NULL;
+	entry = hashmap_get(&index->stems, key);
+	return entry && entry->value ? ((const struct soname_stem_t *)(entry->value))->first : NULL;
+}
+
+/*
+ * Returns the length of the UTF-8 sequence starting at c, 0 if it is invalid
+ * or cut by end, the overlong forms and the surrogates are invalid too
+ */
+static size_t utf8_sequence_length(const unsigned char *c, const unsigned char *end) {
+	unsigned char low = 0x80, high = 0xbf;
+	size_t length, i;
+	if (*c < 0x80) return 1;
+	if (*c >= 0xc2 && *c <= 0xdf) length = 2;
+	else if (*c >= 0xe0 && *c <= 0xef) length = 3;
+	else if (*c >= 0xf0 && *c <= 0xf4) length = 4;
+	else return 0;
+	/* The second byte rules out the overlong forms, the surrogates and what is past U+10FFFF */
+	if (*c == 0xe0) low = 0xa0;
+	else if (*c == 0xed) high = 0x9f;
+	else if (*c == 0xf0) low = 0x90;
+	else if (*c == 0xf4) high = 0x8f;
+	if ((size_t)(end - c) < length || c[1] < low || c[1] > high) return 0;
+	for (i = 2; i < length; ++i)
+		if (c[i] < 0x80 || c[i] > 0xbf) return 0;
+	return length;
+}
+
+/*
+ * Writes length chars as the inside of a JSON string
+ * The file names need not be UTF-8, every byte of an invalid sequence becomes U+FFFD
+ */
+static void json_write_chars(FILE *out, const char *chars, size_t length) {
+	const unsigned char *c, *end;
+	size_t sequence;
+	for (c = (const unsigned char *)chars, end = c + length; c < end; c += sequence ? sequence : 1) {
+		if (!(sequence = utf8_sequence_length(c, end))) fputs("\\ufffd", out);
+		else if (*c == '"' || *c == '\\') fprintf(out, "\\%c", *c);
+		else if (*c < 0x20) fprintf(out, "\\u%04x", *c);
+		else fwrite(c, 1, sequence, out);
+	}
+}
+
+/*
+ * Writes string as a JSON string, quotes included
+ */
+static void json_write_string(FILE *out, const char *string) {
+	fputc('"', out);
+	json_write_chars(out, string, strlen(string));
+	fputc('"', out);
+}
+
+/*
+ * Returns the report stream of the file, opening it if needed
+ */
+static FILE *check_package_out(struct check_package_t *cpt) {
+	if (!cpt->out && !(cpt->out = open_memstream(&cpt->file->report, &cpt->file->report_length))) {
+		error_handler("open_memstream()");
+		/* Better unordered than lost */
+		cpt->out = stderr;
+	}
+	return cpt->out;
+}
+
+/*
+ * Marks the file as broken and prints its filename, only once
+ */
+static void check_package_print_header(struct check_package_t *cpt) {
+	cpt->file->broken = 1;
+	if (cpt->filename_printed) return;
+	cpt->filename_printed = 1;
+	if (cpt->format == FORMAT_NDJSON) {
+		/* The record stays open until check_package_finish() */
+		check_package_out(cpt);
+		if (cpt->root) {
+			fprintf(cpt->out, "{\"root\":");
+			json_write_string(cpt->out, cpt->root);
+			fprintf(cpt->out, ",\"package\":");
+		}
+		else fprintf(cpt->out, "{\"package\":");
+		json_write_string(cpt->out, cpt->package);
+		fprintf(cpt->out, ",\"file\":");
+		json_write_string(cpt->out, cpt->filename);
+		fprintf(cpt->out, ",\"problems\":[");
+		return;
+	}
+	/* This is the filename line */
+	fprintf(check_package_out(cpt), "    └── %s\n", cpt->filename);
+}
+
+/*
+ * Closes the report of the file once everything is reported
+ */
+static void check_package_finish(struct check_package_t *cpt) {
+	if (cpt->format == FORMAT_NDJSON && cpt->filename_printed) fprintf(cpt->out, "]}\n");
+	if (cpt->out && cpt->out != stderr) fclose(cpt->out);
+	cpt->out = NULL;
+}
+
+/*
+ * Prints the installed libraries sharing the stem of the missing library name,
+ * one line per package, with FORMAT_NDJSON they are the "providers" of the problem
+ */
+static void soname_index_print(const struct soname_index_t *index, FILE *out, const char *name, int format, int colors) {
+	const struct soname_provider_t *first, *group, *provider;
+	if (!(first = soname_index_lookup(index, name))) return;
+	if (format == FORMAT_NDJSON) fprintf(out, ",\"providers\":[");
+	for (group = provider = first; group; group = provider) {
+		if (format == FORMAT_NDJSON) {
+			fprintf(out, "%s{\"package\":", group == first ? "" : ",");
+			json_write_string(out, group->package);
+			fprintf(out, ",\"sonames\":[");
+		}
+		else if (colors) fprintf(out, "            └── \033[0;34m%s\033[0m provides ", group->package);
+		else fprintf(out, "            └── %s provides ", group->package);
+		/* The libraries of a package follow each other */
+		for (; provider && provider->package == group->package; provider = provider->next) {
+			if (format == FORMAT_NDJSON) {
+				if (provider != group) fprintf(out, ",");
+				json_write_string(out, provider->soname);
+			}
+			else fprintf(out, "%s%s", provider == group ? "" : ", ", provider->soname);
+		}
+		fprintf(out, format == FORMAT_NDJSON ? "]}" : "\n");
+	}
+	if (format == FORMAT_NDJSON) fprintf(out, "]");
+}
+
+/*
+ * Leaves a marker for the providers of the missing library name in the report,
+ * the name between two '\0', which no report holds otherwise
+ * The workers don't touch the index, check_pool_print_report() replaces the marker
+ */
+static void check_package_print_providers(struct check_package_t *cpt, const char *name) {
+	/* A report that could not be buffered goes straight to the error output */
+	if (!cpt->providers || cpt->out == stderr) return;
+	fputc(0, cpt->out);
+	fputs(name, cpt->out);
+	fputc(0, cpt->out);
+}
+
+/*
+ * The resolver callback for check_package
+ * Prints the problem the way the dynamic loader would report it, followed
+ * by the packages providing other versions of a missing library
+ * data carries a struct check_package_t
+ */
+static void resolver_missing_check_package(const char *name, const char *message, void *data) {
+	struct check_package_t* cpt = (struct check_package_t*)data;
+	int missing = !strcmp(message, NOT_FOUND_MESSAGE);
+	check_package_print_header(cpt);
+	if (cpt->format == FORMAT_NDJSON) {
+		fprintf(cpt->out, "%s{\"name\":", cpt->problems ? "," : "");
+		json_write_string(cpt->out, name);
+		fprintf(cpt->out, ",\"message\":");
+		json_write_string(cpt->out, message);
+		if (missing) check_package_print_providers(cpt, name);
+		fprintf(cpt->out, "}");
+	}
+	else {
+		if (cpt->colors) fprintf(cpt->out, "        └──\033[0;31m %s: %s\033[0m\n", name, message);
+		else fprintf(cpt->out, "        └── %s: %s\n", name, message);
+		if (missing) check_package_print_providers(cpt, name);
+	}
+	++cpt->problems;
+}
+
+/*
+ * Remembers the library of a loader error line while it is parsed, st holds the
+ * token at position pos of the line, the name at 2 and the message from 3
+ * The name is forgotten when the message is not the one of a missing library
+ */
+static void stream_parser_check_package_missing(struct stream_t *st, struct check_package_t *cpt) {
+	const char *string = st->string;
+	size_t length = st->string_length;
+	if (!cpt->providers || !st->beg || cpt->pos < 2 || cpt->pos > 3) return;
+	for (; length && *string == ' '; ++string, --length) ;
+	if (cpt->pos == 3) {
+		if (length < strcspn(NOT_FOUND_MESSAGE, ":") || strncmp(string, NOT_FOUND_MESSAGE, strcspn(NOT_FOUND_MESSAGE, ":")))
+			cpt->missing[0] = 0;
+		return;
+	}
+	if (length >= sizeof(cpt->missing)) length = 0;
+	memcpy(cpt->missing, string, length);
+	cpt->missing[length] = 0;
+}
+
+/*
+ * Prints only the symbol problems, the dynamic loader reports the missing
+ * libraries itself but never the symbols with --list
+ * data carries a struct check_package_t
+ */
+static void resolver_missing_symbol_check_package(const char *name, const char *message, void *data) {
+	if (strcmp(message, NOT_FOUND_MESSAGE)) resolver_missing_check_package(name, message, data);
+}
+
+/*
+ * The stream parser callback for check_package with FORMAT_NDJSON
+ * What follows the second colon of a line is the name, the rest is the message
+ */
+static void stream_parser_check_package_record(struct stream_t *st, struct check_package_t *cpt) {
+	const char *string = st->string;
+	size_t length = st->string_length;
+	if (st->beg && cpt->pos >= 2 && cpt->pos <= 3) {
+		/* The fields start after the separating space */
+		for (; length && *string == ' '; ++string, --length) ;
+		if (cpt->pos == 2) fprintf(cpt->out, "%s{\"name\":\"", cpt->problems ? "," : "");
+	}
+	if (cpt->pos > 1) json_write_chars(cpt->out, string, length);
+	if (!st->end) return;
+	if (st->string_delim == '\r' || st->string_delim == '\n') {
+		/* The end of the line closes the problem */
+		if (cpt->pos == 2) fprintf(cpt->out, "\",\"message\":\"\"}");
+		else if (cpt->pos > 2) {
+			fprintf(cpt->out, "\"");
+			if (cpt->missing[0]) check_package_print_providers(cpt, cpt->missing);
+			fprintf(cpt->out, "}");
+		}
+		if (cpt->pos > 1) ++cpt->problems;
+		cpt->missing[0] = 0;
+		++cpt->line;
+		cpt->pos = 0;
+		return;
+	}
+	if (cpt->pos == 2) fprintf(cpt->out, "\",\"message\":\"");
+	else if (cpt->pos > 2) json_write_chars(cpt->out, &st->string_delim, 1);
+	++cpt->pos;
+}
+
+/*
+ * The stream parser callback for check_package
+ * st->data carries a struct check_package_t
+ */
+static void stream_parser_check_package_callback(struct stream_t *st) {
+	struct check_package_t* cpt = (struct check_package_t*)(st->data);
+	check_package_print_header(cpt);
+	stream_parser_check_package_missing(st, cpt);
+	if (cpt->format == FORMAT_NDJSON) {
+		stream_parser_check_package_record(st, cpt);
+		return;
+	}
+	if (st->beg && cpt->pos == 2)  {
+		/* We are positioned directly after the second colon, start printing */
+		if (cpt->colors) fprintf(cpt->out, "        └──\033[0;31m");
+		else fprintf(cpt->out, "        └──");
+	}
+	if (cpt->pos > 1) 
+		fprintf(cpt->out, "%.*s", (int)(st->string_length), st->string);
+	if (st->end) {
+		if (st->string_delim == '\r' || st->string_delim == '\n') {
+			/* We hit the end of a line here */
+			if (cpt->colors) fprintf(cpt->out, "\033[0m\n");
+			else fprintf(cpt->out, "\n");
+			if (cpt->pos > 2 && cpt->missing[0]) check_package_print_providers(cpt, cpt->missing);
+			cpt->missing[0] = 0;
+			++cpt->line;
+			cpt->pos = 0;
+		}
+		else {
+			/* The stream parser overwrote the delimiter, so we print it ourselves */
+			if (cpt->pos > 1) fprintf(cpt->out, "%c", st->string_delim);
+			++cpt->pos;
+		}
+	}
+}
+
+/*
+ * Stops the pool, the workers take no new files and the printing thread wakes up
+ * Needs pool->lock
+ */
+static void check_pool_stop(struct check_pool_t *pool) {
+	__atomic_store_n(&pool->stop, 1, __ATOMIC_RELAXED);
+	pthread_cond_broadcast(&pool->done);
+}
+
+/*
+ * Marks a file as checked, waking up the printing thread once its package is done
+ * The pool stops as soon as the file makes the limit of broken packages reached
+ */
+static void check_file_done(struct check_pool_t *pool, size_t index) {
+	struct check_pkg_t *pkg = pool->pkgs + pool->files[index].package;
+	if (pool->ctx->stats->enabled) pool->files[index].end = stats_now();
+	pthread_mutex_lock(&pool->lock);
+	if (pool->files[index].broken && !pkg->broken) {
+		pkg->broken = 1;
+		if (++pool->broken == pool->limit) check_pool_stop(pool);
+	}
+	if (!--pkg->remaining)
+		pthread_cond_broadcast(&pool->done);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Called once the dynamic loader confirming a file exited
+ * data is a struct check_verify_t
+ */
+static void check_verify_exited(int status, void *data) {
+	struct check_verify_t *verify = (struct check_verify_t *)data;
+	(void)status;
+	check_package_finish(&verify->cpt);
+	check_file_done(verify->pool, verify->index);
+	stream_parser_free(&verify->st);
+	free(verify);
+}
+
+/*
+ * Spawns the dynamic loader on a file the resolver found broken
+ * Its error output is parsed as it arrives, in parallel with the other files
+ * Anything other than 0 returned means the loader could not be started
+ */
+static int check_verify(
+	struct check_worker_t *worker,
+	size_t index,
+	struct check_package_t *cpt,
+	const char *ld_bin) {
+	struct check_verify_t *verify;
+	char ld_bin_path[PATH_MAX];
+	/* Calling ld with --list will produce error output in case of broken lib */
+	char *cmd[] = { ld_bin_path, "--list", NULL, NULL };
+	if (!(verify = malloc(sizeof(struct check_verify_t)))) return error_handler("malloc()");
+	verify->pool = worker->pool;
+	verify->index = index;
+	verify->cpt = *cpt;
+	strncpy(verify->filename, cpt->filename, PATH_MAX - 1);
+	verify->filename[PATH_MAX - 1] = 0;
+	verify->cpt.filename = verify->filename;
+	check_package_out(&verify->cpt);
+	stream_parser_init(&verify->st);
+	/* The goal is to start printing the ld error output after the second colon
+	 * Anything before that is redundant information
+	 */
+	verify->st.delims = ":\r\n";
+	verify->st.callback = stream_parser_check_package_callback;
+	verify->st.data = &verify->cpt;
+	strncpy(ld_bin_path, ld_bin, PATH_MAX - 1);
+	ld_bin_path[PATH_MAX - 1] = 0;
+	cmd[2] = verify->filename;
+	/* Exec ld on our file, only stderr output is interesting */
+	if (exec_engine_spawn(&worker->engine, cmd, NULL, &verify->st, check_verify_exited, verify)) {
+		check_package_finish(&verify->cpt);
+		free(verify);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Sets up the batched probing of a worker for --io-uring
+ * Returns NULL if io_uring is not available, the files are probed one by one then
+ */
+static struct check_probe_t *check_probe_init(struct stats_t *stats) {
+	const uint8_t ops[] = { IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE };
+	struct check_probe_t *probe;
+	if (!(probe = calloc(1, sizeof(struct check_probe_t)))) {
+		error_handler("calloc()");
+		return NULL;
+	}
+	/* A read and a close per file at most */
+	if (uring_init(&probe->ring, 2 * PROBE_BATCH, ops, sizeof(ops), stats)) {
+		free(probe);
+		return NULL;
+	}
+	return probe;
+}
+
+/*
+ * Frees the batched probing of a worker
+ */
+static void check_probe_free(struct check_probe_t *probe) {
+	if (!probe) return;
+	uring_free(&probe->ring);
+	free(probe);
+}
+
+/*
+ * Completion of a probe operation, the user data holds the slot and the operation
+ * data is a struct check_probe_t
+ */
+static void check_probe_complete(uint64_t user_data, int res, void *data) {
+	struct check_probe_file_t *slot = ((struct check_probe_t *)data)->files + (user_data >> 2);
+	switch (user_data & 3) {
+	case PROBE_STATX:
+		slot->stat_res = res;
+		break;
+	case PROBE_OPEN:
+		slot->fd = res;
+		break;
+	case PROBE_READ:
+		slot->read_res = res;
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Probes the files [first, first + count) with batched io_uring requests:
+ * statx for all of them, then opening the executables the cache can't
+ * answer, then reading their header and closing them
+ * Three io_uring_enter() calls replace up to four system calls per file,
+ * check_file() falls back to the system calls for anything not probed
+ */
+static void check_probe(struct check_worker_t *worker, size_t first, size_t count) {
+	struct check_probe_t *probe = worker->probe;
+	struct check_context_t *ctx = worker->pool->ctx;
+	struct check_probe_file_t *slot;
+	struct io_uring_sqe *sqe;
+	struct file_stamp_t stamp;
+	size_t i, expected;
+	if (!probe || probe->ring.fd < 0) return;
+	probe->first = first;
+	probe->count = 0;
+	expected = 0;
+	for (i = 0; i < count; ++i) {
+		slot = probe->files + i;
+		slot->probed = 0;
+		slot->stat_res = 1;
+		slot->fd = -1;
+		slot->elf = -1;
+		/* Filenames do not have a leading '/', they are relative to the root */
+		sqe = uring_sqe(&probe->ring, i << 2 | PROBE_STATX);
+		sqe->opcode = IORING_OP_STATX;
+		sqe->fd = ctx->root_fd;
+		sqe->addr = (uint64_t)(uintptr_t)worker->pool->files[first + i].name;
+		sqe->len = STATX_BASIC_STATS;
+		sqe->off = (uint64_t)(uintptr_t)&slot->stx;
+		++expected;
+	}
+	if (uring_run(&probe->ring, expected, check_probe_complete, probe)) goto broken;
+	probe->count = count;
+	expected = 0;
+	for (i = 0; i < count; ++i) {
+		slot = probe->files + i;
+		if (slot->stat_res > 0) continue;
+		/* The operation itself was refused, fstatat() takes over */
+		if (slot->stat_res == -EINVAL || slot->stat_res == -EOPNOTSUPP) continue;
+		/* A failed statx is as final as a failed stat */
+		slot->probed = 1;
+		if (slot->stat_res < 0) continue;
+		memset(&slot->statbuf, 0, sizeof(struct stat));
+		slot->statbuf.st_mode = slot->stx.stx_mode;
+		slot->statbuf.st_dev = makedev(slot->stx.stx_dev_major, slot->stx.stx_dev_minor);
+		slot->statbuf.st_ino = (ino_t)slot->stx.stx_ino;
+		slot->statbuf.st_size = (off_t)slot->stx.stx_size;
+		slot->statbuf.st_mtim.tv_sec = slot->stx.stx_mtime.tv_sec;
+		slot->statbuf.st_mtim.tv_nsec = slot->stx.stx_mtime.tv_nsec;
+		/* Only the executables the cache doesn't know need their header */
+		if (!S_ISREG(slot->statbuf.st_mode) || !(slot->statbuf.st_mode & S_IXUSR)) continue;
+		file_stamp_init(&stamp, &slot->statbuf);
+		if (ctx->cache && scan_cache_lookup(ctx->cache, worker->pool->files[first + i].name, &stamp)) continue;
+		sqe = uring_sqe(&probe->ring, i << 2 | PROBE_OPEN);
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = ctx->root_fd;
+		sqe->addr = (uint64_t)(uintptr_t)worker->pool->files[first + i].name;
+		sqe->open_flags = O_RDONLY | O_CLOEXEC;
+		++expected;
+	}
+	if (uring_run(&probe->ring, expected, check_probe_complete, probe)) goto broken;
+	expected = 0;
+	for (i = 0; i < count; ++i) {
+		slot = probe->files + i;
+		if (slot->fd < 0) continue;
+		/* The hard link closes the file even if the read fails */
+		sqe = uring_sqe(&probe->ring, i << 2 | PROBE_READ);
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = slot->fd;
+		sqe->addr = (uint64_t)(uintptr_t)slot->header;
+		sqe->len = SELFMAG;
+		sqe->flags = IOSQE_IO_HARDLINK;
+		sqe = uring_sqe(&probe->ring, i << 2 | PROBE_CLOSE);
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->fd = slot->fd;
+		slot->read_res = -1;
+		expected += 2;
+	}
+	if (uring_run(&probe->ring, expected, check_probe_complete, probe)) goto broken;
+	for (i = 0; i < count; ++i) {
+		slot = probe->files + i;
+		if (slot->fd < 0) continue;
+		slot->fd = -1;
+		/* Errors are left to check_for_elf_header() to report */
+		if (slot->read_res >= 0) slot->elf = slot->read_res != SELFMAG || memcmp(slot->header, ELFMAG, SELFMAG);
+	}
+	return;
+broken:
+	/* The ring can't be trusted anymore, the system calls take over */
+	probe->count = 0;
+	uring_free(&probe->ring);
+}
+
+/*
+ * Returns the probe of the file at index, NULL if it was not probed
+ */
+static const struct check_probe_file_t *check_probe_file(const struct check_worker_t *worker, size_t index) {
+	const struct check_probe_t *probe = worker->probe;
+	if (!probe || index < probe->first || index - probe->first >= probe->count
+		|| !probe->files[index - probe->first].probed)
+		return NULL;
+	return probe->files + (index - probe->first);
+}
+
+/*
+ * Resolver callback recording a problem into a struct check_result_t
+ */
+static void check_result_missing(const char *name, const char *message, void *data) {
+	struct check_result_t *result = (struct check_result_t *)data;
+	size_t name_length = strlen(name) + 1, message_length = strlen(message) + 1, size;
+	void *grown;
+	if (result->problems_length + name_length + message_length > result->problems_size) {
+		size = result->problems_size ? result->problems_size : 256;
+		while (size < result->problems_length + name_length + message_length) size *= 2;
+		STATS_ADD(result->stats, allocations, 1);
+		if (!(grown = realloc(result->problems, size))) {
+			error_handler("realloc()");
+			result->lost = 1;
+			return;
+		}
+		result->problems = grown;
+		result->problems_size = size;
+	}
+	memcpy(result->problems + result->problems_length, name, name_length);
+	memcpy(result->problems + result->problems_length + name_length, message, message_length);
+	result->problems_length += name_length + message_length;
+	++result->problems_count;
+}
+
+/*
+ * Resolver callback recording a library into a struct check_result_t
+ */
+static void check_result_found(const char *path, void *data) {
+	struct check_result_t *result = (struct check_result_t *)data;
+	void *grown;
+	if (result->deps_count == result->deps_size) {
+		result->deps_size = result->deps_size ? result->deps_size * 2 : 16;
+		STATS_ADD(result->stats, allocations, 1);
+		if (!(grown = realloc(result->deps, result->deps_size * sizeof(char *)))) {
+			error_handler("realloc()");
+			result->lost = 1;
+			return;
+		}
+		result->deps = grown;
+	}
+	result->deps[result->deps_count++] = path;
+}
+
+/*
+ * Empties the result of a worker, its buffers are kept for the next file
+ */
+static void check_result_clear(struct check_result_t *result) {
+	result->missing = 0;
+	result->problems_count = 0;
+	result->problems_length = 0;
+	result->deps_count = 0;
+	result->lost = 0;
+}
+
+/*
+ * Returns the result of a copy of a file checked before, NULL if there is none
+ */
+static struct check_result_t *check_result_get(struct check_pool_t *pool, const char *key) {
+	struct hashmap_entry_t *entry;
+	struct check_result_t *result;
+	pthread_mutex_lock(&pool->results_lock);
+	result = (entry = hashmap_get(&pool->results, key)) ? (struct check_result_t *)entry->value : NULL;
+	pthread_mutex_unlock(&pool->results_lock);
+	return result;
+}
+
+/*
+ * Makes a result found under another key known under key too
+ */
+static void check_result_alias(struct check_pool_t *pool, const char *key, struct check_result_t *result) {
+	struct hashmap_entry_t *entry;
+	int inserted;
+	pthread_mutex_lock(&pool->results_lock);
+	if ((entry = hashmap_put(&pool->results, key, &inserted)) && inserted) entry->value = result;
+	pthread_mutex_unlock(&pool->results_lock);
+}
+
+/*
+ * Hands a copy of the result of the worker over to the pool for the copies of
+ * the file, under the inode key and the build id key if there is one
+ * The copy is packed into the arena of the worker
+ * Returns the shared result, or the result of the worker if another worker was faster
+ */
+static struct check_result_t *check_result_share(
+	struct check_worker_t *worker,
+	const char *inode_key,
+	const char *build_id_key) {
+	struct check_pool_t *pool = worker->pool;
+	struct check_result_t *result = &worker->result, *shared;
+	struct hashmap_entry_t *entry;
+	int inserted;
+	if (!(shared = arena_alloc(&worker->arena, sizeof(struct check_result_t)))) return result;
+	memset(shared, 0, sizeof(struct check_result_t));
+	shared->missing = result->missing;
+	shared->problems_count = result->problems_count;
+	shared->problems_length = result->problems_length;
+	shared->deps_count = result->deps_count;
+	if ((result->problems_length
+			&& !(shared->problems = arena_memdup(&worker->arena, result->problems, result->problems_length)))
+		|| (result->deps_count
+			&& !(shared->deps = arena_memdup(&worker->arena, result->deps, result->deps_count * sizeof(char *)))))
+		return result;
+	pthread_mutex_lock(&pool->results_lock);
+	if (!(entry = hashmap_put(&pool->results, inode_key, &inserted)) || !inserted) {
+		/* The copy stays in the arena until the pool is freed */
+		pthread_mutex_unlock(&pool->results_lock);
+		return result;
+	}
+	entry->value = shared;
+	if (build_id_key && (entry = hashmap_put(&pool->results, build_id_key, &inserted)) && inserted)
+		entry->value = shared;
+	pthread_mutex_unlock(&pool->results_lock);
+	return shared;
+}
+
+/*
+ * Resolves the file at path into the result of the worker, unless an
+ * identical file with the same build id and dynamic strings was resolved already
+ * The result is shared with the copies of the file, unless its search paths
+ * use $ORIGIN: the libraries found would depend on where the copy is
+ * Returns the result to report
+ */
+static struct check_result_t *check_result_resolve(
+	struct check_worker_t *worker,
+	const char *path,
+	const char *inode_key) {
+	struct check_context_t *ctx = worker->pool->ctx;
+	struct check_result_t *result, *own = &worker->result;
+	struct elf_object_t *obj;
+	char build_id_key[ELF_KEY_SIZE];
+	const char *key;
+	build_id_key[0] = 0;
+	if ((obj = resolver_object(ctx->resolver, path, &key)) && obj->build_id_length) {
+		elf_build_id_key(build_id_key, obj->build_id, obj->build_id_length, obj->dynamic_hash);
+		if ((result = check_result_get(worker->pool, build_id_key))) {
+			/* The next hard link of this copy is found by its inode */
+			check_result_alias(worker->pool, inode_key, result);
+			STATS_ADD(ctx->stats, shared_files, 1);
+			return result;
+		}
+	}
+	check_result_clear(own);
+	own->missing = resolver_check(ctx->resolver, &worker->walk, path, check_result_missing,
+		ctx->deps ? check_result_found : NULL, own);
+	if (own->lost || (obj && ((obj->rpath && strchr(obj->rpath, '$'))
+		|| (obj->runpath && strchr(obj->runpath, '$')))))
+		return own;
+	return check_result_share(worker, inode_key, build_id_key[0] ? build_id_key : NULL);
+}
+
+/*
+ * Keeps the problems of a broken file for the callback of the library, the
+ * report holds them like struct check_result_t does
+ */
+static void check_result_record(struct check_file_t *file, const struct check_result_t *result) {
+	file->broken = 1;
+	if (!(file->report = malloc(result->problems_length))) {
+		error_handler("malloc()");
+		return;
+	}
+	memcpy(file->report, result->problems, result->problems_length);
+	file->report_length = result->problems_length;
+}
+
+/*
+ * Reports a result for a file through the check_package callbacks, like
+ * resolver_check() does, or records it for the callback of the library
+ * The file refers to the libraries of a shared result, the ones of the
+ * worker's result are copied into its arena
+ * Returns what resolver_check() returned
+ */
+static int check_result_report(
+	struct check_worker_t *worker,
+	const struct check_result_t *result,
+	struct check_package_t *cpt) {
+	const struct check_context_t *ctx = worker->pool->ctx;
+	const char *name, *message;
+	size_t i;
+	if (ctx->callback && result->problems_count) check_result_record(cpt->file, result);
+	for (i = 0, name = result->problems; !ctx->callback && i < result->problems_count;
+		++i, name = message + strlen(message) + 1) {
+		message = name + strlen(name) + 1;
+		if (ctx->finder) resolver_missing_symbol_check_package(name, message, cpt);
+		else resolver_missing_check_package(name, message, cpt);
+	}
+	if (ctx->deps && result->deps_count) {
+		cpt->file->deps_count = result->deps_count;
+		if (result != &worker->result) cpt->file->deps = result->deps;
+		else if (!(cpt->file->deps = arena_memdup(&worker->arena, result->deps, result->deps_count * sizeof(char *))))
+			cpt->deps_lost = 1;
+	}
+	if (result->lost) cpt->deps_lost = 1;
+	return result->missing;
+}
+
+/*
+ * Returns the directory fd to look up the file name of the root with, base is
+ * set to the name relative to it
+ * The filelists are sorted so the files of a directory come one after the
+ * other, and most packages share the same few directories: the last
+ * CHECK_DIRS directories stay open
+ * The root fd and the whole name are returned if the directory can't be opened
+ */
+static int check_dir(struct check_worker_t *worker, const char *name, const char **base) {
+	struct check_context_t *ctx = worker->pool->ctx;
+	struct check_dir_t *dir;
+	const char *slash;
+	size_t i, length;
+	*base = name;
+	if (!(slash = strrchr(name, '/'))) return ctx->root_fd;
+	length = (size_t)(slash - name);
+	for (i = 0; i < CHECK_DIRS; ++i) {
+		dir = worker->dirs + i;
+		if (dir->fd >= 0 && dir->length == length && !memcmp(dir->name, name, length)) {
+			*base = slash + 1;
+			return dir->fd;
+		}
+	}
+	if (length >= PATH_MAX) return ctx->root_fd;
+	/* The oldest directory makes room */
+	dir = worker->dirs + worker->dirs_next++ % CHECK_DIRS;
+	if (dir->fd >= 0) close(dir->fd);
+	memcpy(dir->name, name, length);
+	dir->name[length] = 0;
+	dir->length = length;
+	STATS_ADD(ctx->stats, open_calls, 1);
+	if ((dir->fd = openat(ctx->root_fd, dir->name, O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0)
+		return ctx->root_fd;
+	*base = slash + 1;
+	return dir->fd;
+}
+
+/*
+ * Checks one queued file for broken dependencies
+ * The native resolver decides whether the file is broken, with a loader
+ * finder in the context the dynamic loader confirms and reports it instead
+ * The report is kept in the file for check_pool_run() to print in order
+ * Returns 0 if the file is done, anything else if a loader is still running
+ */
+static int check_file(struct check_worker_t *worker, size_t index) {
+	struct check_context_t *ctx = worker->pool->ctx;
+	struct check_file_t *file = worker->pool->files + index;
+	const struct check_probe_file_t *probe;
+	struct elf_object_t *obj;
+	struct check_result_t *result;
+	struct check_package_t cpt;
+	struct stat statbuf;
+	char filename[PATH_MAX], inode_key[64];
+	const char *ld_bin, *path, *base;
+	int dirfd, length, elf, missing;
+	if (ctx->stats->enabled) {
+		file->start = stats_now();
+		file->worker = (size_t)(worker - worker->pool->workers);
+	}
+	/* Filenames do not have a leading '/', they are relative to the root */
+	dirfd = ctx->root_fd;
+	base = file->name;
+	if ((probe = check_probe_file(worker, index))) {
+		if (probe->stat_res < 0) return 0;
+		statbuf = probe->statbuf;
+	}
+	else {
+		dirfd = check_dir(worker, file->name, &base);
+		STATS_ADD(ctx->stats, stat_calls, 1);
+		if (fstatat(dirfd, base, &statbuf, 0) < 0) {
+			/* Not caring about handling stat errors */
+			return 0;
+		}
+	}
+	/* Check if the file is user executable */
+	if (!S_ISREG(statbuf.st_mode) || !(statbuf.st_mode & S_IXUSR))
+		return 0;
+	file_stamp_init(&file->stamp, &statbuf);
+	/* A file unchanged since the last run, just like its libraries, keeps its verdict */
+	if (ctx->cache && (file->cached = scan_cache_lookup(ctx->cache, file->name, &file->stamp))) {
+		file->verdict = file->cached->verdict;
+		STATS_ADD(ctx->stats, cached_files, 1);
+		return 0;
+	}
+	/* A hard link or another path to a file checked already gets the same result */
+	snprintf(inode_key, sizeof(inode_key), "inode:%llx:%llx",
+		(unsigned long long)statbuf.st_dev, (unsigned long long)statbuf.st_ino);
+	if ((result = check_result_get(worker->pool, inode_key))) STATS_ADD(ctx->stats, shared_files, 1);
+	/* We are only interested in ELF files, so quickly check the header */
+	else if ((elf = probe && probe->elf >= 0 ? probe->elf : check_for_elf_header(dirfd, base, ctx->stats, ctx->low_impact))) {
+		/* Only remember the files that are no ELF for sure */
+		if (elf == 1) file->verdict = SCAN_CACHE_SKIP;
+		return 0;
+	}
+	/* Only the resolver and the reports need the whole filename */
+	length = snprintf(filename, PATH_MAX, "%s/%s", ctx->resolver->root_path, file->name);
+	if (length < 0 || length >= PATH_MAX) return 0;
+	/* The resolver works with paths inside the root, they start after it */
+	path = filename + ctx->resolver->root_path_length;
+	/* Predicting only needs the sonames the file asks for, the main thread indexes them */
+	if (ctx->predict) {
+		file->obj = resolver_object(ctx->resolver, path, &path);
+		return 0;
+	}
+	cpt.file = file;
+	cpt.filename = filename;
+	cpt.out = NULL;
+	cpt.line = 0;
+	cpt.pos = 0;
+	cpt.filename_printed = 0;
+	cpt.colors = ctx->colors;
+	cpt.format = ctx->format;
+	cpt.package = worker->pool->pkgs[file->package].name;
+	cpt.root = ctx->label;
+	cpt.problems = 0;
+	cpt.deps_lost = 0;
+	cpt.providers = ctx->sonames && !ctx->callback;
+	cpt.missing[0] = 0;
+	if (!result) result = check_result_resolve(worker, path, inode_key);
+	missing = check_result_report(worker, result, &cpt);
+	/* Broken files are always checked again, a missing library may show up anywhere */
+	if (!cpt.deps_lost && missing <= 0) file->verdict = missing ? SCAN_CACHE_SKIP : SCAN_CACHE_CLEAN;
+	if (missing > 0 && ctx->finder && !cpt.filename_printed
+		/* Find the correct ld binary which can do something useful with the file */
+		&& (obj = resolver_object(ctx->resolver, path, &path))
+		&& (ld_bin = ld_bin_finder(ctx->finder, obj))
+		&& !check_verify(worker, index, &cpt, ld_bin))
+		return 1;
+	check_package_finish(&cpt);
+	return 0;
+}
+
+/*
+ * Takes the next files [first, first + count) of a worker, count is the most
+ * wanted on input, stealing half of the largest remaining range of the other
+ * workers once its own range is empty
+ * Anything other than 0 returned means there is no work left
+ */
+static int check_worker_next(struct check_worker_t *worker, size_t *first, size_t *count) {
+	struct check_pool_t *pool = worker->pool;
+	struct check_worker_t *victim;
+	size_t i, remaining, best, begin, end;
+	/* Enough broken packages were found */
+	if (__atomic_load_n(&pool->stop, __ATOMIC_RELAXED)) return 1;
+	pthread_mutex_lock(&worker->lock);
+	if (worker->begin < worker->end) {
+		if (*count > worker->end - worker->begin) *count = worker->end - worker->begin;
+		*first = worker->begin;
+		worker->begin += *count;
+		pthread_mutex_unlock(&worker->lock);
+		return 0;
+	}
+	pthread_mutex_unlock(&worker->lock);
+	for (;;) {
+		victim = NULL;
+		best = 0;
+		for (i = 0; i < pool->workers_count; ++i) {
+			if (pool->workers + i == worker) continue;
+			pthread_mutex_lock(&pool->workers[i].lock);
+			remaining = pool->workers[i].end - pool->workers[i].begin;
+			pthread_mutex_unlock(&pool->workers[i].lock);
+			if (remaining > best) {
+				best = remaining;
+				victim = pool->workers + i;
+			}
+		}
+		if (!victim) return 1;
+		pthread_mutex_lock(&victim->lock);
+		if ((remaining = victim->end - victim->begin) == 0) {
+			/* Someone was faster, look again */
+			pthread_mutex_unlock(&victim->lock);
+			continue;
+		}
+		end = victim->end;
+		victim->end -= (remaining + 1) / 2;
+		begin = victim->end;
+		pthread_mutex_unlock(&victim->lock);
+		if (*count > end - begin) *count = end - begin;
+		pthread_mutex_lock(&worker->lock);
+		worker->begin = begin + *count;
+		worker->end = end;
+		pthread_mutex_unlock(&worker->lock);
+		*first = begin;
+		return 0;
+	}
+}
+
+/*
+ * Worker thread body, checks files until there are none left anywhere
+ */
+static void *check_worker_run(void *data) {
+	struct check_worker_t *worker = (struct check_worker_t *)data;
+	struct check_pool_t *pool = worker->pool;
+	size_t first, count, index, i;
+	for (;;) {
+		/* With --low-impact the worker waits while the system is under pressure */
+		low_impact_pace(pool->ctx->low_impact, (size_t)(worker - pool->workers));
+		/* With io_uring the files are taken and probed in batches */
+		count = worker->probe ? PROBE_BATCH : 1;
+		if (check_worker_next(worker, &first, &count)) {
+			low_impact_drain(pool->ctx->low_impact);
+			break;
+		}
+		check_probe(worker, first, count);
+		for (index = first; index < first + count; ++index) {
+			if (!check_file(worker, index)) check_file_done(pool, index);
+			/* Collect the loaders that are done without waiting for the others */
+			exec_engine_poll(&worker->engine, 0);
+		}
+	}
+	exec_engine_wait(&worker->engine);
+	for (i = 0; i < CHECK_DIRS; ++i) {
+		if (worker->dirs[i].fd >= 0) close(worker->dirs[i].fd);
+		worker->dirs[i].fd = -1;
+	}
+	return NULL;
+}
+
+/*
+ * Writes length bytes of data to fd, retrying on short writes
+ * Anything other than 0 returned is an error
+ */
+static int writer_write(int fd, const char *data, size_t length) {
+	ssize_t written;
+	while (length) {
+		if ((written = write(fd, data, length)) < 0) {
+			if (errno == EINTR) continue;
+			return error_handler("write()");
+		}
+		data += written;
+		length -= (size_t)written;
+	}
+	return 0;
+}
+
+/*
+ * Inits a writer on fd, a terminal gets every record as soon as it is complete
+ */
+static void writer_init(struct writer_t *writer, int fd) {
+	memset(writer, 0, sizeof(struct writer_t));
+	writer->fd = fd;
+	writer->flush_records = isatty(fd);
+}
+
+/*
+ * Writes everything buffered
+ * Anything other than 0 returned is an error
+ */
+static int writer_flush(struct writer_t *writer) {
+	int ret = writer_write(writer->fd, writer->data, writer->length);
+	writer->length = 0;
+	return ret;
+}
+
+/*
+ * Buffers length bytes of data, the buffer grows until the record is complete
+ */
+static void writer_append(struct writer_t *writer, const char *data, size_t length) {
+	char *grown;
+	size_t size;
+	if (writer->length + length > writer->size) {
+		for (size = writer->size ? writer->size : WRITER_BUFFER_SIZE; size < writer->length + length; size *= 2) ;
+		if (!(grown = realloc(writer->data, size))) {
+			error_handler("realloc()");
+			/* Better split than lost */
+			writer_flush(writer);
+			writer_write(writer->fd, data, length);
+			return;
+		}
+		writer->data = grown;
+		writer->size = size;
+	}
+	memcpy(writer->data + writer->length, data, length);
+	writer->length += length;
+}
+
+/*
+ * Buffers a '\0' terminated string
+ */
+static inline void writer_append_string(struct writer_t *writer, const char *string) {
+	writer_append(writer, string, strlen(string));
+}
+
+/*
+ * Ends a record, the buffer is written once it is full or right away if
+ * records must not wait
+ */
+static void writer_end_record(struct writer_t *writer) {
+	if (writer->flush_records || writer->length >= WRITER_BUFFER_SIZE) writer_flush(writer);
+}
+
+/*
+ * Writes what is left and frees the writer
+ */
+static void writer_free(struct writer_t *writer) {
+	writer_flush(writer);
+	free(writer->data);
+	memset(writer, 0, sizeof(struct writer_t));
+}
+
+/*
+ * Inits the pool, jobs is the number of worker threads
+ */
+static void check_pool_init(struct check_pool_t *pool, struct check_context_t *ctx, size_t jobs) {
+	struct stat out, err;
+	memset(pool, 0, sizeof(struct check_pool_t));
+	pool->ctx = ctx;
+	pool->workers_count = jobs ? jobs : 1;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_mutex_init(&pool->results_lock, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	writer_init(&pool->out, STDOUT_FILENO);
+	writer_init(&pool->err, STDERR_FILENO);
+	/* Both outputs going to the same place must keep the packages next to their reports */
+	if (!fstat(STDOUT_FILENO, &out) && !fstat(STDERR_FILENO, &err)
+		&& out.st_dev == err.st_dev && out.st_ino == err.st_ino)
+		pool->out.flush_records = pool->err.flush_records = 1;
+}
+
+/*
+ * Frees the queues and the reports left
+ */
+static void check_pool_free(struct check_pool_t *pool) {
+	size_t i;
+	for (i = 0; i < pool->files_count; ++i) free(pool->files[i].report);
+	/* The shared results and the libraries of the files go with the arenas */
+	for (i = 0; i < pool->workers_count && pool->workers; ++i) arena_free(&pool->workers[i].arena);
+	hashmap_free(&pool->results, NULL);
+	free(pool->files);
+	free(pool->pkgs);
+	free(pool->workers);
+	writer_free(&pool->out);
+	writer_free(&pool->err);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_mutex_destroy(&pool->results_lock);
+	pthread_cond_destroy(&pool->done);
+}
+
+/*
+ * Queues the files of a package for broken dependencies checks
+ * Only the main thread talks to alpm, the files are checked by check_pool_run()
+ * 
+ * Anything other than 0 returned is a fatal error
+ */
+static int check_package(struct check_pool_t *pool, const char* pkgname) {
+	alpm_pkg_t *pkg;
+	alpm_filelist_t *filelist;
+	void *grown;
+	size_t i;
+	char * slash;
+	
+	if (!(pkg = alpm_db_get_pkg(pool->ctx->db_local, pkgname))) {
+		fprintf(stderr, "%s\n", alpm_strerror(alpm_errno(pool->ctx->handle)));
+		return 1;
+	}
+	if (!(filelist = alpm_pkg_get_files(pkg))) {
+		alpm_pkg_free(pkg);
+		fprintf(stderr, "%s\n", alpm_strerror(alpm_errno(pool->ctx->handle)));
+		return 1;
+	}
+	if (pool->pkgs_count == pool->pkgs_size) {
+		pool->pkgs_size = pool->pkgs_size ? pool->pkgs_size * 2 : 64;
+		if (!(grown = realloc(pool->pkgs, pool->pkgs_size * sizeof(struct check_pkg_t)))) {
+			alpm_pkg_free(pkg);
+			return error_handler("realloc()");
+		}
+		pool->pkgs = grown;
+	}
+	pool->pkgs[pool->pkgs_count].name = pkgname;
+	pool->pkgs[pool->pkgs_count].remaining = 0;
+	pool->pkgs[pool->pkgs_count].broken = 0;
+	for (i = 0; i < filelist->count; ++i) {
+		/* If the name ends with a '/' then it's a directory */
+		if ((slash = strrchr(filelist->files[i].name, '/')) && slash[1] == 0)
+			continue;
+		if (pool->files_count == pool->files_size) {
+			pool->files_size = pool->files_size ? pool->files_size * 2 : 1024;
+			if (!(grown = realloc(pool->files, pool->files_size * sizeof(struct check_file_t)))) {
+				alpm_pkg_free(pkg);
+				return error_handler("realloc()");
+			}
+			pool->files = grown;
+		}
+		memset(pool->files + pool->files_count, 0, sizeof(struct check_file_t));
+		pool->files[pool->files_count].package = pool->pkgs_count;
+		pool->files[pool->files_count].name = filelist->files[i].name;
+		++pool->files_count;
+		++pool->pkgs[pool->pkgs_count].remaining;
+	}
+	++pool->pkgs_count;
+	/* The filelist stays owned by the handle */
+	alpm_pkg_free(pkg);
+	return 0;
+}
+
+/*
+ * Hands the broken files [first, last) of a package to the callback of the library
+ */
+static void check_pool_callback(struct check_pool_t *pool, size_t package, size_t first, size_t last) {
+	struct aurbrokenpkgcheck_problem_t *problems;
+	struct aurbrokenpkgcheck_file_t broken;
+	struct check_file_t *file;
+	const char *name, *end;
+	size_t count;
+	for (; first < last; ++first) {
+		file = pool->files + first;
+		if (!file->report) continue;
+		/* Every problem is a name and a message */
+		for (count = 0, name = file->report, end = name + file->report_length; name < end; name += strlen(name) + 1)
+			++count;
+		if (!(problems = calloc(count / 2 ? count / 2 : 1, sizeof(struct aurbrokenpkgcheck_problem_t)))) {
+			error_handler("calloc()");
+			continue;
+		}
+		for (count = 0, name = file->report; name < end; name += strlen(name) + 1, ++count) {
+			if (count % 2) problems[count / 2].message = name;
+			else problems[count / 2].name = name;
+		}
+		broken.package = pool->pkgs[package].name;
+		broken.name = file->name;
+		broken.problems = problems;
+		broken.problems_count = count / 2;
+		pool->ctx->callback(&broken, pool->ctx->data);
+		free(problems);
+		free(file->report);
+		file->report = NULL;
+	}
+}
+
+/*
+ * Appends the report of a file to reports, the markers left by
+ * check_package_print_providers() are replaced by the providers they name
+ */
+static void check_pool_print_report(struct check_pool_t *pool, struct writer_t *reports, const struct check_file_t *file) {
+	const char *chunk = file->report, *end = file->report + file->report_length, *name, *marker;
+	char *providers;
+	size_t length;
+	FILE *out;
+	while ((marker = memchr(chunk, 0, (size_t)(end - chunk)))) {
+		writer_append(reports, chunk, (size_t)(marker - chunk));
+		name = marker + 1;
+		if (!(marker = memchr(name, 0, (size_t)(end - name)))) return;
+		chunk = marker + 1;
+		if (!(out = open_memstream(&providers, &length))) {
+			error_handler("open_memstream()");
+			continue;
+		}
+		soname_index_print(soname_index_get(pool->ctx->sonames), out, name, pool->ctx->format, pool->ctx->colors);
+		fclose(out);
+		writer_append(reports, providers, length);
+		free(providers);
+	}
+	writer_append(reports, chunk, (size_t)(end - chunk));
+}
+
+/*
+ * Prints the results of a package once all its files are checked
+ * The package name goes to the standard output if anything is broken and the
+ * reports to the error output, with FORMAT_NDJSON the records of the broken
+ * files go to the standard output
+ * The callback of the library gets the broken files instead
+ * Returns 1 if the package is broken, else 0
+ */
+static int check_pool_print(struct check_pool_t *pool, size_t package, size_t *file) {
+	struct writer_t *reports;
+	size_t first = *file;
+	int broken = 0;
+	for (; *file < pool->files_count && pool->files[*file].package == package; ++*file)
+		broken |= pool->files[*file].broken;
+	if (pool->ctx->callback) {
+		check_pool_callback(pool, package, first, *file);
+		return broken;
+	}
+	if (broken && pool->ctx->format == FORMAT_TREE) {
+		if (pool->ctx->colors) writer_append_string(&pool->out, "\033[0;34m");
+		writer_append_string(&pool->out, pool->pkgs[package].name);
+		writer_append_string(&pool->out, pool->ctx->colors ? "\033[0m\n" : "\n");
+	}
+	reports = pool->ctx->format == FORMAT_NDJSON ? &pool->out : &pool->err;
+	for (; first < *file; ++first) {
+		if (!pool->files[first].report) continue;
+		check_pool_print_report(pool, reports, pool->files + first);
+		free(pool->files[first].report);
+		pool->files[first].report = NULL;
+	}
+	/* The package name comes before its reports */
+	writer_end_record(&pool->out);
+	writer_end_record(&pool->err);
+	return broken;
+}
+
+/*
+ * Checks every queued file on the workers
+ * The results are printed package by package in queue order as soon as they
+ * are complete, so the output is the same as the one of a serial run
+ * Once the pool stops only the broken packages are printed, up to the limit
+ */
+static void check_pool_run(struct check_pool_t *pool) {
+	size_t i, j, file, started, printed;
+	int stopped;
+	if (!(pool->workers = calloc(pool->workers_count, sizeof(struct check_worker_t)))) {
+		error_handler("calloc()");
+		return;
+	}
+	/* Every worker starts with a contiguous share of the files */
+	for (i = 0; i < pool->workers_count; ++i) {
+		pool->workers[i].pool = pool;
+		pool->workers[i].begin = pool->files_count * i / pool->workers_count;
+		pool->workers[i].end = pool->files_count * (i + 1) / pool->workers_count;
+		for (j = 0; j < CHECK_DIRS; ++j) pool->workers[i].dirs[j].fd = -1;
+		pthread_mutex_init(&pool->workers[i].lock, NULL);
+		resolver_walk_init(&pool->workers[i].walk);
+		pool->workers[i].result.stats = pool->ctx->stats;
+		pool->workers[i].arena.stats = pool->ctx->stats;
+		/* Every worker keeps a few loaders in flight, a single one with --low-impact */
+		if (pool->ctx->finder)
+			exec_engine_init(&pool->workers[i].engine, pool->ctx->low_impact->enabled ? 1 : VERIFY_CHILDREN_PER_JOB,
+				pool->ctx->stats);
+		/* Without io_uring the worker just probes every file itself */
+		if (pool->ctx->io_uring) pool->workers[i].probe = check_probe_init(pool->ctx->stats);
+	}
+	low_impact_reset(pool->ctx->low_impact, pool->workers_count);
+	for (started = 0; started < pool->workers_count; ++started) {
+		if ((errno = pthread_create(&pool->workers[started].thread, NULL,
+			check_worker_run, pool->workers + started))) {
+			error_handler("pthread_create()");
+			break;
+		}
+	}
+	/* Without any thread the main thread does the work */
+	if (!started) check_worker_run(pool->workers);
+	for (i = 0, file = 0, printed = 0; i < pool->pkgs_count; ++i) {
+		pthread_mutex_lock(&pool->lock);
+		while (pool->pkgs[i].remaining && !pool->stop) pthread_cond_wait(&pool->done, &pool->lock);
+		stopped = pool->stop;
+		pthread_mutex_unlock(&pool->lock);
+		if (stopped) break;
+		printed += (size_t)check_pool_print(pool, i, &file);
+	}
+	/* The files the workers still hold get finished, the packages left may be
+	 * incomplete, the broken ones are printed with the files checked so far */
+	if (i < pool->pkgs_count) {
+		for (j = 0; j < started; ++j) pthread_join(pool->workers[j].thread, NULL);
+		started = 0;
+		for (; i < pool->pkgs_count && printed < pool->limit; ++i)
+			printed += (size_t)check_pool_print(pool, i, &file);
+	}
+	writer_flush(&pool->out);
+	writer_flush(&pool->err);
+	for (i = 0; i < started; ++i) pthread_join(pool->workers[i].thread, NULL);
+	for (i = 0; i < pool->workers_count; ++i) {
+		pthread_mutex_destroy(&pool->workers[i].lock);
+		exec_engine_free(&pool->workers[i].engine);
+		check_probe_free(pool->workers[i].probe);
+		free(pool->workers[i].result.problems);
+		free(pool->workers[i].result.deps);
+		resolver_walk_free(&pool->workers[i].walk);
+	}
+}
+
+/*
+ * Computes when every package of the pool started and ended, and how long
+ * its files took in total since they are checked in parallel
+ * Returns an array of pool->pkgs_count entries, NULL on error
+ */
+static struct stats_package_t *stats_packages(const struct check_pool_t *pool) {
+	struct stats_package_t *pkgs, *pkg;
+	const struct check_file_t *file;
+	size_t i;
+	if (!(pkgs = calloc(pool->pkgs_count ? pool->pkgs_count : 1, sizeof(struct stats_package_t)))) {
+		error_handler("calloc()");
+		return NULL;
+	}
+	for (i = 0; i < pool->pkgs_count; ++i) pkgs[i].package = i;
+	for (i = 0; i < pool->files_count; ++i) {
+		file = pool->files + i;
+		pkg = pkgs + file->package;
+		if (!file->start) continue;
+		if (!pkg->start || file->start < pkg->start) pkg->start = file->start;
+		if (file->end > pkg->end) pkg->end = file->end;
+		pkg->busy += file->end - file->start;
+	}
+	return pkgs;
+}
+
+/*
+ * Sorts the packages by the time their files took, the slowest first
+ */
+static int stats_packages_cmp(const void *a, const void *b) {
+	const struct stats_package_t *pa = (const struct stats_package_t *)a;
+	const struct stats_package_t *pb = (const struct stats_package_t *)b;
+	return (pa->busy < pb->busy) - (pa->busy > pb->busy);
+}
+
+/*
+ * Prints the --stats summary on the error output
+ */
+static void stats_print(const struct check_pool_t *pool) {
+	const struct stats_t *stats = pool->ctx->stats;
+	struct stats_package_t *pkgs;
+	struct rusage usage;
+	uint64_t total;
+	size_t i;
+	total = stats_now() - stats->origin;
+	fprintf(stderr, "Statistics :\n");
+	for (i = 0; i < stats->phases_count; ++i) {
+		fprintf(stderr, "    %-20s : %10.3f ms\n", stats->phases[i].name, (double)stats->phases[i].duration / 1e6);
+	}
+	fprintf(stderr, "    %-20s : %10.3f ms\n", "total", (double)total / 1e6);
+	fprintf(stderr, "    %-20s : %zu\n", "packages", pool->pkgs_count);
+	fprintf(stderr, "    %-20s : %zu (%llu cached, %llu shared)\n", "files", pool->files_count,
+		(unsigned long long)stats->cached_files, (unsigned long long)stats->shared_files);
+	if (total) fprintf(stderr, "    %-20s : %.0f\n", "files per second", (double)pool->files_count * 1e9 / (double)total);
+	fprintf(stderr, "    %-20s : %llu\n", "ELF objects parsed", (unsigned long long)stats->elf_objects);
+	fprintf(stderr, "    %-20s : %llu\n", "bytes parsed", (unsigned long long)stats->bytes);
+	fprintf(stderr, "    %-20s : %llu\n", "processes started", (unsigned long long)stats->spawns);
+	fprintf(stderr, "    %-20s : %llu\n", "stat calls", (unsigned long long)stats->stat_calls);
+	fprintf(stderr, "    %-20s : %llu\n", "open calls", (unsigned long long)stats->open_calls);
+	fprintf(stderr, "    %-20s : %llu\n", "read calls", (unsigned long long)stats->read_calls);
+	fprintf(stderr, "    %-20s : %llu\n", "mmap calls", (unsigned long long)stats->map_calls);
+	fprintf(stderr, "    %-20s : %llu (%llu operations)\n", "io_uring_enter calls",
+		(unsigned long long)stats->uring_enters, (unsigned long long)stats->uring_ops);
+	fprintf(stderr, "    %-20s : %llu\n", "result allocations", (unsigned long long)stats->allocations);
+	if (pool->ctx->sonames && pool->ctx->sonames->built) {
+		fprintf(stderr, "    %-20s : %.3f ms (%zu libraries)\n", "soname index",
+			(double)pool->ctx->sonames->build_time / 1e6, pool->ctx->sonames->count);
+	}
+	if (!getrusage(RUSAGE_SELF, &usage)) fprintf(stderr, "    %-20s : %ld kB\n", "peak RSS", usage.ru_maxrss);
+	if (!pool->pkgs_count || !(pkgs = stats_packages(pool))) return;
+	qsort(pkgs, pool->pkgs_count, sizeof(struct stats_package_t), stats_packages_cmp);
+	fprintf(stderr, "    slowest packages :\n");
+	for (i = 0; i < pool->pkgs_count && i < STATS_SLOWEST_PACKAGES; ++i) {
+		fprintf(stderr, "        %-30s : %10.3f ms\n", pool->pkgs[pkgs[i].package].name, (double)pkgs[i].busy / 1e6);
+	}
+	free(pkgs);
+}
+
+/*
+ * Microseconds since the start of the run, the unit of the trace events
+ */
+static inline double stats_trace_time(const struct stats_t *stats, uint64_t ns) {
+	return (double)(ns - stats->origin) / 1e3;
+}
+
+/*
+ * Writes the run as Chrome trace events for chrome://tracing or Perfetto
+ * The phases are on the main thread, every worker shows the files it checked
+ * and the packages get their own rows from their first file to their last
+ * Anything other than 0 returned is an error
+ */
+static int stats_trace_write(const char *filename, const struct check_pool_t *pool) {
+	const struct stats_t *stats = pool->ctx->stats;
+	struct stats_package_t *pkgs;
+	const struct check_file_t *file;
+	FILE *out;
+	size_t i;
+	int ret;
+	if (!(out = fopen(filename, "w"))) return error_handler(filename);
+	fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"aurbrokenpkgcheck\"}},\n");
+	fprintf(out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"main\"}}");
+	for (i = 0; i < pool->workers_count; ++i) {
+		fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,\"args\":{\"name\":\"worker %zu\"}}",
+			i + 1, i);
+	}
+	for (i = 0; i < stats->phases_count; ++i) {
+		fprintf(out, ",\n{\"name\":");
+		json_write_string(out, stats->phases[i].name);
+		fprintf(out, ",\"cat\":\"phase\",\"ph\":\"X\",\"pid\":1,\"tid\":0,\"ts\":%.3f,\"dur\":%.3f}",
+			stats_trace_time(stats, stats->phases[i].start), (double)stats->phases[i].duration / 1e3);
+	}
+	for (i = 0; i < pool->files_count; ++i) {
+		file = pool->files + i;
+		if (!file->start) continue;
+		fprintf(out, ",\n{\"name\":");
+		json_write_string(out, file->name);
+		fprintf(out, ",\"cat\":\"file\",\"ph\":\"X\",\"pid\":1,\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"package\":",
+			file->worker + 1, stats_trace_time(stats, file->start), (double)(file->end - file->start) / 1e3);
+		json_write_string(out, pool->pkgs[file->package].name);
+		fprintf(out, ",\"broken\":%d,\"cached\":%d}}", file->broken, file->cached != NULL);
+	}
+	/* Packages overlap, async events give each of them a row */
+	if ((pkgs = stats_packages(pool))) {
+		for (i = 0; i < pool->pkgs_count; ++i) {
+			if (!pkgs[i].start) continue;
+			fprintf(out, ",\n{\"name\":");
+			json_write_string(out, pool->pkgs[i].name);
+			fprintf(out, ",\"cat\":\"package\",\"ph\":\"b\",\"id\":%zu,\"pid\":1,\"tid\":0,\"ts\":%.3f}", i,
+				stats_trace_time(stats, pkgs[i].start));
+			fprintf(out, ",\n{\"name\":");
+			json_write_string(out, pool->pkgs[i].name);
+			fprintf(out, ",\"cat\":\"package\",\"ph\":\"e\",\"id\":%zu,\"pid\":1,\"tid\":0,\"ts\":%.3f}", i,
+				stats_trace_time(stats, pkgs[i].end));
+		}
+		free(pkgs);
+	}
+	fprintf(out, "\n]}\n");
+	ret = ferror(out);
+	if (fclose(out) || ret) return error_handler(filename);
+	return 0;
+}
+
+/*
+ * Registers the sync databases of the repositories configured in pacman.conf
+ * A database that can't be registered is reported and left out
+ */
+static void sync_dbs_register(alpm_handle_t *handle, const struct pacman_config_t *conf) {
+	size_t i;
+	for (i = 0; i < conf->architectures_count; ++i) {
+		if (alpm_option_add_architecture(handle, conf->architectures[i]))
+			fprintf(stderr, "%s: %s\n", conf->architectures[i], alpm_strerror(alpm_errno(handle)));
+	}
+	for (i = 0; i < conf->repos_count; ++i) {
+		if (!alpm_register_syncdb(handle, conf->repos[i], 0))
+			fprintf(stderr, "%s: %s\n", conf->repos[i], alpm_strerror(alpm_errno(handle)));
+	}
+}
+
+/*
+ * qsort() comparator for package names
+ */
+static int foreign_packages_cmp(const void *a, const void *b) {
+	return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+/*
+ * Tells whether a package passes the filter, repo is the name of the sync
+ * database it belongs to or NULL for a foreign package
+ */
+static int package_filter_match(const struct aurbrokenpkgcheck_filter_t *filter, const char *name, const char *repo) {
+	size_t i;
+	if (!filter) return !repo;
+	if (!filter->all && repo) return 0;
+	if (filter->repos_count) {
+		for (i = 0; repo && i < filter->repos_count && strcmp(filter->repos[i], repo); ++i) ;
+		if (!repo || i == filter->repos_count) return 0;
+	}
+	if (!filter->globs_count) return 1;
+	for (i = 0; i < filter->globs_count; ++i)
+		if (!fnmatch(filter->globs[i], name, 0)) return 1;
+	return 0;
+}
+
+/*
+ * Lists the installed packages no sync database knows about, like pacman -Qm,
+ * or the ones filter selects if it is not NULL
+ * The sync databases are not loaded at all when every repository would pass,
+ * they are the slowest part of a check of everything
+ * The names are sorted and belong to the handle, only the array needs to be freed
+ * Anything other than 0 returned is an error
+ */
+static int foreign_packages(
+	alpm_handle_t *handle,
+	alpm_db_t *db_local,
+	const struct aurbrokenpkgcheck_filter_t *filter,
+	const char ***names,
+	size_t *count) {
+	struct hashmap_t synced;
+	struct hashmap_entry_t *entry;
+	alpm_list_t *i, *j;
+	const char *name;
+	void *grown;
+	size_t size;
+	int inserted, ret;
+	memset(&synced, 0, sizeof(struct hashmap_t));
+	*names = NULL;
+	*count = 0;
+	size = 0;
+	ret = 0;
+	for (i = alpm_get_syncdbs(handle); i && !ret && (!filter || !filter->all || filter->repos_count);
+		i = alpm_list_next(i)) {
+		for (j = alpm_db_get_pkgcache((alpm_db_t *)(i->data)); j; j = alpm_list_next(j)) {
+			if (!(entry = hashmap_put(&synced, alpm_pkg_get_name((alpm_pkg_t *)(j->data)), &inserted))) {
+				ret = 1;
+				break;
+			}
+			/* Like pacman, the first repository wins */
+			if (inserted) entry->value = (void *)alpm_db_get_name((alpm_db_t *)(i->data));
+		}
+	}
+	/* A misspelled repository would silently select nothing */
+	for (size = 0; filter && size < filter->repos_count; ++size) {
+		for (i = alpm_get_syncdbs(handle); i && strcmp(alpm_db_get_name((alpm_db_t *)(i->data)), filter->repos[size]);
+			i = alpm_list_next(i)) ;
+		if (!i) fprintf(stderr, "%s: no such repository in the configuration\n", filter->repos[size]);
+	}
+	size = 0;
+	for (i = alpm_db_get_pkgcache(db_local); i && !ret; i = alpm_list_next(i)) {
+		name = alpm_pkg_get_name((alpm_pkg_t *)(i->data));
+		entry = hashmap_get(&synced, name);
+		if (!package_filter_match(filter, name, entry ? (const char *)entry->value : NULL)) continue;
+		if (*count == size) {
+			size = size ? size * 2 : 64;
+			if (!(grown = realloc(*names, size * sizeof(char *)))) {
+				ret = error_handler("realloc()");
+				break;
+			}
+			*names = grown;
+		}
+		(*names)[(*count)++] = name;
+	}
+	hashmap_free(&synced, NULL);
+	/* Same order as pacman */
+	if (!ret) qsort(*names, *count, sizeof(char *), foreign_packages_cmp);
+	return ret;
+}
+
+/*
+ * Releases the alpm handle the context opened, a handle of the caller is just forgotten
+ */
+static void context_release(struct aurbrokenpkgcheck_t *abc) {
+	if (abc->owned && alpm_release(abc->handle) < 0)
+		fprintf(stderr, "%s\n", alpm_strerror(alpm_errno(abc->handle)));
+	abc->handle = NULL;
+	abc->owned = 0;
+}
+
+/*
+ * Opens an alpm handle on the root of abc->conf with its sync databases
+ * registered, it replaces the handle of the context
+ * Anything other than 0 returned is an error
+ */
+static int context_open(struct aurbrokenpkgcheck_t *abc) {
+	alpm_errno_t err;
+	context_release(abc);
+	stats_phase_begin(&abc->stats, "alpm");
+	if (!(abc->handle = alpm_initialize(abc->conf.root_path, abc->conf.db_path, &err))) {
+		fprintf(stderr, "%s\n", alpm_strerror(err));
+		return 1;
+	}
+	abc->owned = 1;
+	if (!alpm_get_localdb(abc->handle)) {
+		fprintf(stderr, "%s\n", alpm_strerror(alpm_errno(abc->handle)));
+		return 1;
+	}
+	/* The foreign packages are the local ones missing from every sync database,
+	 * they are listed by the check, in this phase too */
+	stats_phase_begin(&abc->stats, "foreign packages");
+	/* The files databases of pacman -Fy are the sync databases with the file lists */
+	if ((abc->flags & AURBROKENPKGCHECK_FILES_DATABASES) && alpm_option_set_dbext(abc->handle, ".files"))
+		fprintf(stderr, "%s\n", alpm_strerror(alpm_errno(abc->handle)));
+	sync_dbs_register(abc->handle, &abc->conf);
+	return 0;
+}
+
+/*
+ * Runs the pool of a check, aurbrokenpkgcheck_cancel() stops it from any thread
+ * Returns 1 if the check was canceled, 0 otherwise
+ */
+static int context_run(struct aurbrokenpkgcheck_t *abc, struct check_pool_t *pool) {
+	int canceled;
+	pthread_mutex_lock(&abc->lock);
+	abc->pool = pool;
+	pool->stop = abc->canceled;
+	pthread_mutex_unlock(&abc->lock);
+	check_pool_run(pool);
+	pthread_mutex_lock(&abc->lock);
+	abc->pool = NULL;
+	canceled = abc->canceled;
+	pthread_mutex_unlock(&abc->lock);
+	return canceled;
+}
+
+/*
+ * Sorts the packages by score, the highest first, then in pacman order
+ */
+static int foreign_priority_cmp(const void *a, const void *b) {
+	const struct foreign_priority_t *pa = (const struct foreign_priority_t *)a;
+	const struct foreign_priority_t *pb = (const struct foreign_priority_t *)b;
+	if (pa->score != pb->score) return (pa->score < pb->score) - (pa->score > pb->score);
+	return (pa->package > pb->package) - (pa->package < pb->package);
+}
+
+/*
+ * Orders the foreign packages so that the likely broken ones get checked first
+ * A package is more likely broken the later the providers of its dependencies
+ * were installed after it: a library upgraded since, like the ones behind the
+ * soname dependencies, may have dropped the sonames or symbols it was built with
+ * Returns an array of count indexes into names, NULL on error
+ */
+static size_t *foreign_packages_priority(alpm_db_t *db_local, const char *const *names, size_t count) {
+	struct foreign_priority_t *priorities;
+	alpm_list_t *pkgcache, *i;
+	alpm_pkg_t *pkg, *provider;
+	alpm_depend_t *dep;
+	size_t *order, package;
+	char *depstring;
+	int64_t installed, latest;
+	if (!(priorities = calloc(count ? count : 1, sizeof(struct foreign_priority_t)))) {
+		error_handler("calloc()");
+		return NULL;
+	}
+	if (!(order = calloc(count ? count : 1, sizeof(size_t)))) {
+		error_handler("calloc()");
+		free(priorities);
+		return NULL;
+	}
+	pkgcache = alpm_db_get_pkgcache(db_local);
+	for (package = 0; package < count; ++package) {
+		priorities[package].package = package;
+		/* The packages without dependencies come last */
+		priorities[package].score = INT64_MIN;
+		if (!(pkg = alpm_db_get_pkg(db_local, names[package]))) continue;
+		installed = (int64_t)alpm_pkg_get_installdate(pkg);
+		latest = INT64_MIN;
+		for (i = alpm_pkg_get_depends(pkg); i; i = alpm_list_next(i)) {
+			dep = (alpm_depend_t *)(i->data);
+			/* Most dependencies are package names, the others are provisions */
+			if (!(provider = alpm_db_get_pkg(db_local, dep->name))) {
+				if (!(depstring = alpm_dep_compute_string(dep))) continue;
+				provider = alpm_find_satisfier(pkgcache, depstring);
+				free(depstring);
+			}
+			if (provider && (int64_t)alpm_pkg_get_installdate(provider) > latest)
+				latest = (int64_t)alpm_pkg_get_installdate(provider);
+		}
+		if (latest != INT64_MIN) priorities[package].score = latest - installed;
+	}
+	qsort(priorities, count, sizeof(struct foreign_priority_t), foreign_priority_cmp);
+	for (package = 0; package < count; ++package) order[package] = priorities[package].package;
+	free(priorities);
+	return order;
+}
+
+/*
+ * Collects the file names of the targets still installed, the names of
+ * their libraries are the sonames the transaction may have provided or changed
+ */
+static void targets_provided(
+	alpm_db_t *db_local,
+	const struct hashmap_t *targets,
+	struct hashmap_t *provided) {
+	alpm_pkg_t *pkg;
+	alpm_filelist_t *filelist;
+	const char *slash;
+	size_t i, j;
+	int inserted;
+	for (i = 0; i < targets->size; ++i) {
+		/* Removed targets are gone from the database along with their file lists */
+		if (!targets->entries[i].key
+			|| !(pkg = alpm_db_get_pkg(db_local, targets->entries[i].key)))
+			continue;
+		if ((filelist = alpm_pkg_get_files(pkg))) {
+			for (j = 0; j < filelist->count; ++j) {
+				if (!(slash = strrchr(filelist->files[j].name, '/'))) slash = filelist->files[j].name;
+				else if (!*++slash) continue;
+				hashmap_put(provided, slash, &inserted);
+			}
+		}
+		alpm_pkg_free(pkg);
+	}
+}
+
+/*
+ * Adds the sonames needed by an ELF file of a foreign package to the reverse index
+ * Libraries the package ships itself, the names of own, are left out, the
+ * transaction can't touch them
+ */
+static void targets_index_object(
+	const struct elf_object_t *obj,
+	const struct hashmap_t *own,
+	size_t package,
+	struct hashmap_t *index) {
+	struct hashmap_entry_t *entry;
+	struct target_soname_t *soname;
+	char key[NAME_MAX + 32];
+	size_t j, *grown;
+	int inserted;
+	for (j = 0; j < obj->needed_count; ++j) {
+		if (hashmap_get(own, obj->needed[j])) continue;
+		snprintf(key, sizeof(key), "%u:%u:%s",
+			(unsigned int)obj->elfclass, (unsigned int)obj->machine, obj->needed[j]);
+		if (!(entry = hashmap_put(index, key, &inserted))) continue;
+		if (inserted) {
+			if (!(entry->value = calloc(1, sizeof(struct target_soname_t)))) {
+				error_handler("calloc()");
+				continue;
+			}
+			soname = (struct target_soname_t *)(entry->value);
+			soname->elfclass = obj->elfclass;
+			soname->machine = obj->machine;
+			soname->name = strchr(strchr(entry->key, ':') + 1, ':') + 1;
+		}
+		if (!(soname = (struct target_soname_t *)(entry->value))) continue;
+		/* Packages are indexed one after the other */
+		if (soname->packages_count && soname->packages[soname->packages_count - 1] == package)
+			continue;
+		if (soname->packages_count == soname->packages_size) {
+			soname->packages_size = soname->packages_size ? soname->packages_size * 2 : 4;
+			if (!(grown = realloc(soname->packages, soname->packages_size * sizeof(size_t)))) {
+				error_handler("realloc()");
+				continue;
+			}
+			soname->packages = grown;
+		}
+		soname->packages[soname->packages_count++] = package;
+	}
+}
+
+/*
+ * Adds the sonames needed by the ELF files of a foreign package to the reverse index
+ * Libraries the package ships itself are left out, the transaction can't touch them
+ */
+static void targets_index_package(
+	struct check_context_t *ctx,
+	const char *pkgname,
+	size_t package,
+	struct hashmap_t *index) {
+	alpm_pkg_t *pkg;
+	alpm_filelist_t *filelist;
+	struct hashmap_t own;
+	struct elf_object_t *obj;
+	struct stat statbuf;
+	char filename[PATH_MAX];
+	const char *slash, *path;
+	size_t i;
+	int inserted, length;
+	if (!(pkg = alpm_db_get_pkg(ctx->db_local, pkgname))) return;
+	if (!(filelist = alpm_pkg_get_files(pkg))) {
+		alpm_pkg_free(pkg);
+		return;
+	}
+	memset(&own, 0, sizeof(struct hashmap_t));
+	for (i = 0; i < filelist->count; ++i) {
+		if (!(slash = strrchr(filelist->files[i].name, '/'))) slash = filelist->files[i].name;
+		else if (!*++slash) continue;
+		hashmap_put(&own, slash, &inserted);
+	}
+	for (i = 0; i < filelist->count; ++i) {
+		/* The same files as check_file() looks at */
+		STATS_ADD(ctx->stats, stat_calls, 1);
+		if (fstatat(ctx->root_fd, filelist->files[i].name, &statbuf, 0) < 0
+			|| !S_ISREG(statbuf.st_mode) || !(statbuf.st_mode & S_IXUSR)
+			|| check_for_elf_header(ctx->root_fd, filelist->files[i].name, ctx->stats, ctx->low_impact))
+			continue;
+		length = snprintf(filename, PATH_MAX, "%s/%s", ctx->resolver->root_path, filelist->files[i].name);
+		if (length < 0 || length >= PATH_MAX) continue;
+		if ((obj = resolver_object(ctx->resolver, filename + ctx->resolver->root_path_length, &path)))
+			targets_index_object(obj, &own, package, index);
+	}
+	hashmap_free(&own, NULL);
+	alpm_pkg_free(pkg);
+}
+
+/*
+ * Frees an entry of the reverse index
+ */
+static void targets_free_soname(void *data) {
+	struct target_soname_t *soname = (struct target_soname_t *)data;
+	free(soname->packages);
+	free(soname);
+}
+
+/*
+ * Watches a directory of the root, dir is inside the root
+ * Returns the watch descriptor, -1 if it can't be watched
+ */
+static int watch_add_path(struct watch_t *watch, const struct check_context_t *ctx, const char *dir) {
+	char filename[PATH_MAX];
+	int length, wd;
+	length = snprintf(filename, PATH_MAX, "%s%s", ctx->resolver->root_path, dir);
+	if (length < 0 || length >= PATH_MAX) return -1;
+	/* Most of the default directories don't exist */
+	if ((wd = inotify_add_watch(watch->fd, filename, WATCH_EVENTS)) < 0 && errno != ENOENT && errno != ENOTDIR)
+		error_handler(filename);
+	return wd;
+}
+
+/*
+ * Watches a directory of the root for libraries showing up or going away, once
+ * Returns the watch descriptor, -1 if the directory was watched already or can't be
+ */
+static int watch_add_dir(struct watch_t *watch, const struct check_context_t *ctx, const char *dir) {
+	int inserted;
+	if (!hashmap_put(&watch->dirs, dir, &inserted) || !inserted) return -1;
+	return watch_add_path(watch, ctx, dir);
+}
+
+/*
+ * Remembers the packages to check as of now, with their version and install date
+ * Those which were not there before, or were upgraded or reinstalled, are added
+ * to changed if it is not NULL
+ */
+static void watch_installed(
+	struct watch_t *watch,
+	alpm_db_t *db_local,
+	const char *const *names,
+	size_t count,
+	struct hashmap_t *changed) {
+	struct hashmap_t installed;
+	alpm_pkg_t *pkg;
+	char key[PATH_MAX];
+	size_t i;
+	int inserted, length;
+	memset(&installed, 0, sizeof(struct hashmap_t));
+	for (i = 0; i < count; ++i) {
+		if (!(pkg = alpm_db_get_pkg(db_local, names[i]))) continue;
+		length = snprintf(key, PATH_MAX, "%s %s %lld", names[i], alpm_pkg_get_version(pkg),
+			(long long)alpm_pkg_get_installdate(pkg));
+		if (length < 0 || length >= PATH_MAX) continue;
+		hashmap_put(&installed, key, &inserted);
+		if (changed && !hashmap_get(&watch->installed, key)) hashmap_put(changed, names[i], &inserted);
+	}
+	hashmap_free(&watch->installed, NULL);
+	watch->installed = installed;
+}
+
+/*
+ * Frees a value of watch->dependents
+ */
+static void watch_free_packages(void *data) {
+	hashmap_free((struct hashmap_t *)data, NULL);
+	free(data);
+}
+
+/*
+ * Remembers that a package needs the library at path, and watches its directory
+ */
+static void watch_add_lib(
+	struct watch_t *watch,
+	const struct check_context_t *ctx,
+	const char *path,
+	const char *package) {
+	struct hashmap_entry_t *entry;
+	char dir[PATH_MAX];
+	const char *slash;
+	size_t length;
+	int inserted;
+	if (!(slash = strrchr(path, '/'))) return;
+	length = (size_t)(slash - path);
+	if (length < PATH_MAX) {
+		memcpy(dir, path, length);
+		dir[length] = 0;
+		watch_add_dir(watch, ctx, length ? dir : "/");
+	}
+	/* The events only carry the file name, a library is known by its name */
+	if (!(entry = hashmap_put(&watch->dependents, slash + 1, &inserted))) return;
+	if (inserted && !(entry->value = calloc(1, sizeof(struct hashmap_t)))) {
+		error_handler("calloc()");
+		return;
+	}
+	if (entry->value) hashmap_put((struct hashmap_t *)entry->value, package, &inserted);
+}
+
+/*
+ * Takes the libraries and the verdicts of the packages of a pool
+ * The dependents are never forgotten, a package checked once too many costs less than a missed one
+ */
+static void watch_update(struct watch_t *watch, const struct check_pool_t *pool) {
+	const struct check_context_t *ctx = pool->ctx;
+	const struct file_stamp_t *stamp;
+	struct hashmap_entry_t *entry;
+	size_t i, j, package;
+	int inserted;
+	for (i = 0, package = 0; package < pool->pkgs_count; ++package) {
+		if (!(entry = hashmap_put(&watch->broken, pool->pkgs[package].name, &inserted))) continue;
+		entry->value = NULL;
+		for (; i < pool->files_count && pool->files[i].package == package; ++i) {
+			/* Any non NULL value marks it broken, the names don't outlive the alpm handle */
+			if (pool->files[i].broken) entry->value = (void *)watch;
+			for (j = 0; j < scan_cache_file_libs(pool->files + i); ++j) {
+				watch_add_lib(watch, ctx, scan_cache_file_lib(ctx->cache, pool->files + i, j, &stamp),
+					pool->pkgs[package].name);
+			}
+		}
+	}
+}
+
+/*
+ * Sets up --watch once the first check is done, pool holds its results
+ * The system library directories and the ld.so.conf ones are watched, and the
+ * directory of every library found, which covers the DT_RPATH and DT_RUNPATH ones
+ * Anything other than 0 returned is an error
+ */
+static int watch_init(
+	struct watch_t *watch,
+	const struct check_pool_t *pool,
+	struct aurbrokenpkgcheck_t *abc,
+	const char *const *names,
+	size_t count) {
+	static const char *const system_dirs[] = { "/usr/lib", "/lib", "/usr/lib64", "/lib64", "/usr/lib32", "/lib32", NULL };
+	const char *const *dir;
+	const char *db_path = abc->conf.db_path;
+	const char *separator = db_path[0] && db_path[strlen(db_path) - 1] == '/' ? "" : "/";
+	char local_path[PATH_MAX];
+	int length;
+	memset(watch, 0, sizeof(struct watch_t));
+	watch->abc = abc;
+	watch->wake = abc->wake;
+	length = snprintf(watch->lock_path, PATH_MAX, "%s%sdb.lck", db_path, separator);
+	if (length < 0 || length >= PATH_MAX) watch->lock_path[0] = 0;
+	if ((watch->fd = inotify_init1(IN_CLOEXEC)) < 0) return error_handler("inotify_init1()");
+	/* pacman adds and removes a directory per package in the local database,
+	 * the packages installed without any library get checked too */
+	length = snprintf(local_path, PATH_MAX, "%s%slocal", db_path, separator);
+	if (length >= 0 && length < PATH_MAX && inotify_add_watch(watch->fd, local_path, WATCH_EVENTS) < 0)
+		error_handler(local_path);
+	/* ldconfig replaces ld.so.cache, so its directory is watched */
+	watch->etc_wd = watch_add_dir(watch, pool->ctx, "/etc");
+	watch->conf_wd = watch_add_path(watch, pool->ctx, LD_SO_CONF_DIR);
+	for (dir = system_dirs; *dir; ++dir) watch_add_dir(watch, pool->ctx, *dir);
+	for (dir = (const char *const *)pool->ctx->resolver->conf_dirs; dir && *dir; ++dir)
+		watch_add_dir(watch, pool->ctx, *dir);
+	watch_update(watch, pool);
+	watch_installed(watch, pool->ctx->db_local, names, count, NULL);
+	return 0;
+}
+
+/*
+ * Frees the state of --watch
+ */
+static void watch_free(struct watch_t *watch) {
+	if (watch->fd >= 0) close(watch->fd);
+	hashmap_free(&watch->dirs, NULL);
+	hashmap_free(&watch->dependents, watch_free_packages);
+	hashmap_free(&watch->broken, NULL);
+	hashmap_free(&watch->changed, NULL);
+	hashmap_free(&watch->installed, NULL);
+}
+
+/*
+ * Reads the pending events into watch->changed
+ * Anything other than 0 returned is an error
+ */
+static int watch_read(struct watch_t *watch) {
+	char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	ssize_t length;
+	char *position;
+	int inserted;
+	if ((length = read(watch->fd, buffer, sizeof(buffer))) < 0)
+		return errno == EINTR ? 0 : error_handler("read()");
+	for (position = buffer; position < buffer + length;
+		position += sizeof(struct inotify_event) + event->len) {
+		event = (const struct inotify_event *)position;
+		if (event->mask & IN_Q_OVERFLOW) watch->overflow = 1;
+		else if (!event->len) continue;
+		/* Other directories may hold the libraries now, any package can break */
+		else if (event->wd == watch->conf_wd
+			|| (event->wd == watch->etc_wd && !strncmp(event->name, "ld.so.conf", sizeof("ld.so.conf") - 1)))
+			watch->overflow = 1;
+		/* Only the loader configuration matters in /etc */
+		else if (event->wd == watch->etc_wd && strcmp(event->name, "ld.so.cache")) continue;
+		else hashmap_put(&watch->changed, event->name, &inserted);
+	}
+	return 0;
+}
+
+/*
+ * Blocks until something changed and things calmed down again: no event for
+ * WATCH_QUIET_MS and no pacman transaction running, so that a transaction
+ * gives a single pass
+ * Returns -1 once aurbrokenpkgcheck_cancel() wakes it, anything else than 0 is an error
+ */
+static int watch_wait(struct watch_t *watch) {
+	struct pollfd pfds[2];
+	int ready;
+	pfds[0].fd = watch->fd;
+	pfds[0].events = POLLIN;
+	/* poll() skips a negative descriptor */
+	pfds[1].fd = watch->wake;
+	pfds[1].events = POLLIN;
+	for (;;) {
+		/* Nothing to wait for before the first change */
+		ready = poll(pfds, 2, watch->changed.count || watch->overflow ? WATCH_QUIET_MS : -1);
+		if (ready < 0) {
+			if (errno == EINTR) continue;
+			return error_handler("poll()");
+		}
+		if (pfds[1].revents & POLLIN) return -1;
+		if (pfds[0].revents & POLLIN) {
+			if (watch_read(watch)) return 1;
+		}
+		else if (!ready && (!watch->lock_path[0] || access(watch->lock_path, F_OK))) return 0;
+	}
+}
+
+/*
+ * Checks again the packages needing a changed library and the broken ones,
+ * a library showing up may fix them, and the packages installed or upgraded
+ * since the last pass
+ * libalpm never reloads its databases, so a new handle replaces ctx->handle and
+ * the packages to check, names and count, are listed again
+ * The resolver starts over since the libraries and the ld.so.cache changed
+ * Returns -1 if the pass was canceled, anything else than 0 is an error
+ */
+static int watch_pass(struct watch_t *watch, struct check_context_t *ctx, const char ***names, size_t *count) {
+	struct check_pool_t pool;
+	struct hashmap_t affected;
+	struct hashmap_entry_t *entry;
+	const struct hashmap_t *packages;
+	struct elf_store_t *store;
+	const char *const *dir;
+	size_t i, j;
+	int inserted, check_symbols, canceled;
+	memset(&affected, 0, sizeof(struct hashmap_t));
+	for (i = 0; i < watch->changed.size; ++i) {
+		if (!watch->changed.entries[i].key
+			|| !(entry = hashmap_get(&watch->dependents, watch->changed.entries[i].key))
+			|| !(packages = (const struct hashmap_t *)entry->value)) continue;
+		for (j = 0; j < packages->size; ++j)
+			if (packages->entries[j].key) hashmap_put(&affected, packages->entries[j].key, &inserted);
+	}
+	for (i = 0; i < watch->broken.size; ++i)
+		if (watch->broken.entries[i].key && watch->broken.entries[i].value)
+			hashmap_put(&affected, watch->broken.entries[i].key, &inserted);
+	/* The names belong to the handle, the index points into its filelists */
+	free(*names);
+	*names = NULL;
+	*count = 0;
+	soname_index_free(ctx->sonames);
+	if (context_open(watch->abc) || aurbrokenpkgcheck_packages(watch->abc, names, count)) {
+		soname_index_init(ctx->sonames, NULL);
+		hashmap_free(&affected, NULL);
+		return 1;
+	}
+	ctx->handle = watch->abc->handle;
+	ctx->db_local = alpm_get_localdb(ctx->handle);
+	soname_index_init(ctx->sonames, ctx->db_local);
+	watch_installed(watch, ctx->db_local, *names, *count, &affected);
+	check_symbols = ctx->resolver->check_symbols;
+	store = ctx->resolver->store;
+	resolver_free(ctx->resolver);
+	/* The changed files are read again */
+	elf_store_free(store);
+	elf_store_init(store, ctx->stats, ctx->low_impact);
+	resolver_init(ctx->resolver, ctx->root_path, store);
+	ctx->resolver->check_symbols = check_symbols;
+	/* ld.so.conf may name new directories, ld.so.conf.d may have been created */
+	if (watch->conf_wd < 0) watch->conf_wd = watch_add_path(watch, ctx, LD_SO_CONF_DIR);
+	for (dir = (const char *const *)ctx->resolver->conf_dirs; dir && *dir; ++dir) watch_add_dir(watch, ctx, *dir);
+	check_pool_init(&pool, ctx, watch->abc->jobs);
+	/* The packages come in pacman order, like in the first check */
+	for (i = 0; i < *count; ++i) {
+		if ((watch->overflow || hashmap_get(&affected, (*names)[i])) && check_package(&pool, (*names)[i]))
+			break;
+	}
+	fprintf(stderr, "%-8s : %zu files, checking %zu packages again\n",
+		"Changes", watch->changed.count, pool.pkgs_count);
+	canceled = context_run(watch->abc, &pool);
+	watch_update(watch, &pool);
+	check_pool_free(&pool);
+	hashmap_free(&affected, NULL);
+	hashmap_free(&watch->changed, NULL);
+	watch->overflow = 0;
+	return canceled ? -1 : 0;
+}
+
+/*
+ * Decides which foreign packages a transaction may have broken
+ * A package is affected if it is a target itself, if it needs a soname
+ * the targets provide, or if it needs a soname that can't be found anymore,
+ * which is how removed and renamed libraries show up after the transaction
+ * Returns a flag per package of names, NULL on error
+ */
+static char *targets_affected(
+	struct check_context_t *ctx,
+	const char *const *names,
+	size_t count,
+	const struct hashmap_t *targets) {
+	struct hashmap_t provided, index;
+	struct target_soname_t *soname;
+	char *affected;
+	size_t package, j;
+	if (!(affected = calloc(count ? count : 1, 1))) {
+		error_handler("calloc()");
+		return NULL;
+	}
+	memset(&provided, 0, sizeof(struct hashmap_t));
+	memset(&index, 0, sizeof(struct hashmap_t));
+	targets_provided(ctx->db_local, targets, &provided);
+	for (package = 0; package < count; ++package) {
+		if (hashmap_get(targets, names[package])) affected[package] = 1;
+		else targets_index_package(ctx, names[package], package, &index);
+	}
+	for (j = 0; j < index.size; ++j) {
+		if (!index.entries[j].key || !(soname = (struct target_soname_t *)(index.entries[j].value)))
+			continue;
+		if (!hashmap_get(&provided, soname->name)
+			&& resolver_search_system(ctx->resolver, soname->name, soname->elfclass, soname->machine))
+			continue;
+		for (package = 0; package < soname->packages_count; ++package)
+			affected[soname->packages[package]] = 1;
+	}
+	hashmap_free(&index, targets_free_soname);
+	hashmap_free(&provided, NULL);
+	return affected;
+}
+
+/*
+ * Adds the names of the shared libraries of a filelist to names
+ */
+static void predict_filelist_sonames(const alpm_filelist_t *filelist, struct hashmap_t *names) {
+	const char *soname;
+	char stem[NAME_MAX + 1];
+	size_t i;
+	int inserted;
+	for (i = 0; filelist && i < filelist->count; ++i) {
+		soname = (soname = strrchr(filelist->files[i].name, '/')) ? soname + 1 : filelist->files[i].name;
+		if (*soname && !soname_stem(soname, stem, sizeof(stem))) hashmap_put(names, soname, &inserted);
+	}
+}
+
+/*
+ * Tells if an installed package not upgraded keeps shipping the library name
+ */
+static int predict_kept(
+	const struct soname_index_t *sonames,
+	const struct hashmap_t *upgrades,
+	const char *name) {
+	const struct soname_provider_t *provider;
+	for (provider = soname_index_lookup(sonames, name); provider; provider = provider->next) {
+		if (!strcmp(provider->soname, name) && !hashmap_get(upgrades, provider->package)) return 1;
+	}
+	return 0;
+}
+
+/*
+ * Collects the sonames the pending upgrades remove: the libraries the installed
+ * version of an upgraded package ships, which neither a new version from the
+ * files databases nor a package staying as it is ships anymore
+ * removed maps them to a struct predict_soname_t
+ * Returns the number of pending upgrades
+ */
+static size_t predict_removed(struct check_context_t *ctx, struct hashmap_t *removed) {
+	struct hashmap_t upgrades, shipped, old;
+	struct hashmap_entry_t *entry;
+	struct predict_soname_t *soname;
+	alpm_list_t *syncdbs, *i;
+	alpm_pkg_t *pkg, *new_pkg;
+	size_t j, count;
+	int inserted;
+	memset(&upgrades, 0, sizeof(struct hashmap_t));
+	memset(&shipped, 0, sizeof(struct hashmap_t));
+	syncdbs = alpm_get_syncdbs(ctx->handle);
+	/* The libraries of every new version, one of them may take over a library of another */
+	for (i = alpm_db_get_pkgcache(ctx->db_local), count = 0; i; i = alpm_list_next(i)) {
+		pkg = (alpm_pkg_t *)(i->data);
+		if (!(new_pkg = alpm_sync_get_new_version(pkg, syncdbs))) continue;
+		if (!(entry = hashmap_put(&upgrades, alpm_pkg_get_name(pkg), &inserted))) continue;
+		entry->value = new_pkg;
+		predict_filelist_sonames(alpm_pkg_get_files(new_pkg), &shipped);
+		++count;
+	}
+	for (i = alpm_db_get_pkgcache(ctx->db_local); i; i = alpm_list_next(i)) {
+		pkg = (alpm_pkg_t *)(i->data);
+		if (!(entry = hashmap_get(&upgrades, alpm_pkg_get_name(pkg)))) continue;
+		new_pkg = (alpm_pkg_t *)(entry->value);
+		memset(&old, 0, sizeof(struct hashmap_t));
+		predict_filelist_sonames(alpm_pkg_get_files(pkg), &old);
+		for (j = 0; j < old.size; ++j) {
+			if (!old.entries[j].key || hashmap_get(&shipped, old.entries[j].key)
+				|| predict_kept(soname_index_get(ctx->sonames), &upgrades, old.entries[j].key))
+				continue;
+			if (!(entry = hashmap_put(removed, old.entries[j].key, &inserted)) || !inserted) continue;
+			if (!(entry->value = soname = malloc(sizeof(struct predict_soname_t)))) {
+				error_handler("malloc()");
+				continue;
+			}
+			soname->name = entry->key;
+			soname->pkg = pkg;
+			soname->new_pkg = new_pkg;
+		}
+		hashmap_free(&old, NULL);
+	}
+	hashmap_free(&shipped, NULL);
+	hashmap_free(&upgrades, NULL);
+	return count;
+}
+
+/*
+ * Sorts the breaks by package, then by soname
+ */
+static int predict_breaks_cmp(const void *a, const void *b) {
+	const struct predict_break_t *pa = (const struct predict_break_t *)a;
+	const struct predict_break_t *pb = (const struct predict_break_t *)b;
+	if (pa->package != pb->package) return (pa->package > pb->package) - (pa->package < pb->package);
+	return strcmp(pa->soname->name, pb->soname->name);
+}
+
+/*
+ * Prints a foreign package the upgrades would break like check_pool_print() does,
+ * with the removed sonames it needs and the upgrades removing them
+ */
+static void predict_print(
+	struct check_pool_t *pool,
+	const char *name,
+	const struct predict_break_t *breaks,
+	size_t count) {
+	const struct predict_soname_t *soname;
+	struct writer_t *reports;
+	char *report;
+	size_t i, length;
+	FILE *out;
+	if (!(out = open_memstream(&report, &length))) {
+		error_handler("open_memstream()");
+		return;
+	}
+	if (pool->ctx->format == FORMAT_NDJSON) {
+		if (pool->ctx->label) {
+			fprintf(out, "{\"root\":");
+			json_write_string(out, pool->ctx->label);
+			fprintf(out, ",\"package\":");
+		}
+		else fprintf(out, "{\"package\":");
+		json_write_string(out, name);
+		fprintf(out, ",\"removed\":[");
+	}
+	else {
+		/* The package name goes to the standard output like the broken ones */
+		if (pool->ctx->colors) writer_append_string(&pool->out, "\033[0;34m");
+		writer_append_string(&pool->out, name);
+		writer_append_string(&pool->out, pool->ctx->colors ? "\033[0m\n" : "\n");
+	}
+	for (i = 0; i < count; ++i) {
+		soname = breaks[i].soname;
+		if (pool->ctx->format == FORMAT_NDJSON) {
+			fprintf(out, "%s{\"name\":", i ? "," : "");
+			json_write_string(out, soname->name);
+			fprintf(out, ",\"by\":");
+			json_write_string(out, alpm_pkg_get_name(soname->pkg));
+			fprintf(out, ",\"version\":");
+			json_write_string(out, alpm_pkg_get_version(soname->pkg));
+			fprintf(out, ",\"new_version\":");
+			json_write_string(out, alpm_pkg_get_version(soname->new_pkg));
+			fprintf(out, "}");
+		}
+		else {
+			fprintf(out, pool->ctx->colors
+				? "    └──\033[0;31m %s: removed by %s %s -> %s\033[0m\n" : "    └── %s: removed by %s %s -> %s\n",
+				soname->name, alpm_pkg_get_name(soname->pkg),
+				alpm_pkg_get_version(soname->pkg), alpm_pkg_get_version(soname->new_pkg));
+		}
+	}
+	if (pool->ctx->format == FORMAT_NDJSON) fprintf(out, "]}\n");
+	fclose(out);
+	reports = pool->ctx->format == FORMAT_NDJSON ? &pool->out : &pool->err;
+	writer_append(reports, report, length);
+	free(report);
+	/* The package name comes before its reports */
+	writer_end_record(&pool->out);
+	writer_end_record(&pool->err);
+}
+
+/*
+ * Collects the sonames the pending upgrades remove into removed, from the
+ * sync databases loaded with their file lists, and queues the files of the
+ * foreign packages names for the workers to parse if there are any
+ * Anything other than 0 returned is a fatal error
+ */
+static int predict_queue(
+	struct check_pool_t *pool,
+	const char *const *names,
+	size_t count,
+	struct hashmap_t *removed) {
+	struct check_context_t *ctx = pool->ctx;
+	alpm_list_t *i;
+	size_t upgrades, package;
+	int ret;
+	for (i = alpm_get_syncdbs(ctx->handle); i; i = alpm_list_next(i)) {
+		if (!alpm_db_get_pkgcache((alpm_db_t *)(i->data)))
+			fprintf(stderr, "%s: no files database, run pacman -Fy\n", alpm_db_get_name((alpm_db_t *)(i->data)));
+	}
+	upgrades = predict_removed(ctx, removed);
+	fprintf(stderr, "%-8s : %zu pending, %zu sonames removed\n", "Upgrades", upgrades, removed->count);
+	/* Without removed sonames the foreign packages don't even need to be read */
+	ctx->predict = 1;
+	for (package = 0, ret = 0; removed->count && package < count && !ret; ++package)
+		ret = check_package(pool, names[package]);
+	return ret;
+}
+
+/*
+ * Predicts which foreign packages the pending upgrades would break once the
+ * workers parsed the files queued by predict_queue()
+ * The sonames the upgrades remove are looked up in the reverse index of the
+ * sonames the foreign packages need, the packages found count as broken
+ */
+static void predict_breakage(
+	struct check_pool_t *pool,
+	const char *const *names,
+	const struct hashmap_t *removed) {
+	struct hashmap_t own, index;
+	struct hashmap_entry_t *entry;
+	struct target_soname_t *needed;
+	struct predict_break_t *breaks, *grown;
+	const char *slash;
+	size_t breaks_count, breaks_size, package, first, j, k;
+	int inserted;
+	memset(&index, 0, sizeof(struct hashmap_t));
+	/* The files of a package follow each other, in the order of names */
+	for (first = 0; first < pool->files_count; first = j) {
+		package = pool->files[first].package;
+		memset(&own, 0, sizeof(struct hashmap_t));
+		for (j = first; j < pool->files_count && pool->files[j].package == package; ++j) {
+			slash = strrchr(pool->files[j].name, '/');
+			hashmap_put(&own, slash ? slash + 1 : pool->files[j].name, &inserted);
+		}
+		for (j = first; j < pool->files_count && pool->files[j].package == package; ++j) {
+			if (pool->files[j].obj) targets_index_object(pool->files[j].obj, &own, package, &index);
+		}
+		hashmap_free(&own, NULL);
+	}
+	breaks = NULL;
+	breaks_count = breaks_size = 0;
+	for (j = 0; j < index.size; ++j) {
+		if (!index.entries[j].key || !(needed = (struct target_soname_t *)(index.entries[j].value))
+			|| !(entry = hashmap_get(removed, needed->name)) || !entry->value)
+			continue;
+		for (k = 0; k < needed->packages_count; ++k) {
+			if (breaks_count == breaks_size) {
+				breaks_size = breaks_size ? breaks_size * 2 : 16;
+				if (!(grown = realloc(breaks, breaks_size * sizeof(struct predict_break_t)))) {
+					error_handler("realloc()");
+					break;
+				}
+				breaks = grown;
+			}
+			breaks[breaks_count].package = needed->packages[k];
+			breaks[breaks_count++].soname = (const struct predict_soname_t *)(entry->value);
+		}
+	}
+	/* The same soname may be needed by several classes of objects of a package */
+	if (breaks_count) qsort(breaks, breaks_count, sizeof(struct predict_break_t), predict_breaks_cmp);
+	for (j = 0, k = 0; j < breaks_count; ++j) {
+		if (k && breaks[k - 1].package == breaks[j].package && breaks[k - 1].soname == breaks[j].soname) continue;
+		breaks[k++] = breaks[j];
+	}
+	for (j = 0; j < k; j = package) {
+		for (package = j; package < k && breaks[package].package == breaks[j].package; ++package) ;
+		predict_print(pool, names[breaks[j].package], breaks + j, package - j);
+		++pool->broken;
+	}
+	free(breaks);
+	hashmap_free(&index, targets_free_soname);
+}
+
+/*
+ * Checks the packages of names, or the selected ones if names is NULL, like
+ * aurbrokenpkgcheck_check() and the command line do
+ * mode is RUN_CHECK, RUN_PREDICT for aurbrokenpkgcheck_predict() or RUN_WATCH
+ * for aurbrokenpkgcheck_watch(), which keeps checking until an error or a cancellation
+ * The resolver starts over for every check, a transaction may have changed
+ * the libraries and the ld.so.cache, the files parsed before are kept
+ * Returns 0 once every package is checked, -1 if the check was canceled,
+ * anything else is an error
+ */
+static int check_run(
+	struct aurbrokenpkgcheck_t *abc,
+	const char *const *names,
+	size_t count,
+	aurbrokenpkgcheck_callback_t callback,
+	void *data,
+	size_t *broken,
+	int mode) {
+	struct resolver_t resolver;
+	struct check_context_t ctx;
+	struct check_pool_t pool;
+	struct scan_cache_t cache;
+	struct soname_index_t sonames;
+	struct hashmap_t removed;
+	struct watch_t watch;
+	const char **selected;
+	char *affected;
+	size_t *order;
+	size_t package, queued;
+	uint64_t wakes;
+	int use_cache, all, watching, ret;
+	if (broken) *broken = 0;
+	if (!abc->handle) {
+		fprintf(stderr, "No root opened\n");
+		return 1;
+	}
+	/* Only the check running at the time of a cancellation is canceled */
+	pthread_mutex_lock(&abc->lock);
+	abc->canceled = 0;
+	if (abc->wake >= 0 && read(abc->wake, &wakes, sizeof(wakes)) < 0 && errno != EAGAIN) error_handler("read()");
+	pthread_mutex_unlock(&abc->lock);
+	/* A check after the statistics were printed gets its own */
+	if (abc->reported) stats_reset(&abc->stats);
+	abc->reported = 0;
+	memset(&ctx, 0, sizeof(struct check_context_t));
+	ctx.handle = abc->handle;
+	if (!(ctx.db_local = alpm_get_localdb(abc->handle))) {
+		fprintf(stderr, "%s\n", alpm_strerror(alpm_errno(abc->handle)));
+		return 1;
+	}
+	selected = NULL;
+	if ((all = !names)) {
+		if (aurbrokenpkgcheck_packages(abc, &selected, &count)) return 1;
+		names = selected;
+	}
+	/* The resolver reads the root's ld.so.cache and ld.so.conf once for all packages */
+	stats_phase_begin(&abc->stats, "resolver");
+	ctx.root_path = abc->root_path;
+	/* The files are looked up relative to the root instead of from '/' every time */
+	if ((ctx.root_fd = open(ctx.root_path, O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0) {
+		free(selected);
+		return error_handler(ctx.root_path);
+	}
+	resolver_init(&resolver, ctx.root_path, &abc->store);
+	resolver.check_symbols = abc->flags & AURBROKENPKGCHECK_SYMBOLS;
+	/* The verdicts of the previous run spare the files that did not change */
+	stats_phase_begin(&abc->stats, "cache load");
+	/* Nothing gets checked when predicting */
+	use_cache = mode != RUN_PREDICT && !(abc->flags & AURBROKENPKGCHECK_NO_CACHE);
+	if (use_cache && (use_cache = !scan_cache_init(&cache, &resolver, abc->filter)) && !(abc->flags & AURBROKENPKGCHECK_REBUILD_CACHE))
+		scan_cache_load(&cache, &resolver);
+	ctx.resolver = &resolver;
+	ctx.finder = abc->flags & AURBROKENPKGCHECK_VERIFY_WITH_LD ? &abc->finder : NULL;
+	ctx.cache = use_cache ? &cache : NULL;
+	ctx.deps = use_cache || mode == RUN_WATCH;
+	ctx.colors = abc->format == FORMAT_NDJSON ? 0 : abc->colors;
+	ctx.format = abc->format;
+	/* The probes of io_uring can't tell which files were cached before */
+	ctx.io_uring = (abc->flags & AURBROKENPKGCHECK_IO_URING) && !abc->low_impact.enabled;
+	ctx.label = abc->label ? abc->root_path : NULL;
+	/* The providers of the missing libraries are looked up in the filelists of every package */
+	soname_index_init(&sonames, ctx.db_local);
+	ctx.sonames = &sonames;
+	ctx.callback = callback;
+	ctx.data = data;
+	ctx.stats = &abc->stats;
+	ctx.low_impact = &abc->low_impact;
+	check_pool_init(&pool, &ctx, abc->jobs);
+	pool.limit = abc->limit;
+	/* Only the packages the transaction may have broken are checked for a hook,
+	 * everything is checked if they can't be told apart */
+	stats_phase_begin(&abc->stats, "select targets");
+	affected = abc->use_targets ? targets_affected(&ctx, names, count, &abc->targets) : NULL;
+	/* With a limit the likely broken packages are queued first, else in pacman order */
+	order = NULL;
+	if (pool.limit) {
+		stats_phase_begin(&abc->stats, "priority");
+		order = foreign_packages_priority(ctx.db_local, names, count);
+	}
+	/* Queue each package, then check their libs and binaries on all the workers */
+	stats_phase_begin(&abc->stats, "file lists");
+	for (package = 0, ret = 0; mode != RUN_PREDICT && package < count && !ret; ++package) {
+		queued = order ? order[package] : package;
+		if (!affected || affected[queued]) ret = check_package(&pool, names[queued]);
+	}
+	free(order);
+	/* The packages of every root follow its own header line */
+	if (!ret && abc->label && abc->format == FORMAT_TREE) {
+		writer_append_string(&pool.out, abc->root_path);
+		writer_append_string(&pool.out, ":\n");
+	}
+	/* The packages the pending upgrades would break are reported instead of checked,
+	 * the workers only parse their files */
+	memset(&removed, 0, sizeof(struct hashmap_t));
+	if (!ret && mode == RUN_PREDICT) {
+		stats_phase_begin(&abc->stats, "upgrades");
+		ret = predict_queue(&pool, names, count, &removed);
+	}
+	watching = 0;
+	if (!ret) {
+		stats_phase_begin(&abc->stats, "scan");
+		ret = context_run(abc, &pool) ? -1 : 0;
+		if (!ret && mode == RUN_PREDICT) {
+			stats_phase_begin(&abc->stats, "predict");
+			predict_breakage(&pool, names, &removed);
+			writer_flush(&pool.out);
+			writer_flush(&pool.err);
+		}
+		low_impact_print(&abc->low_impact);
+		/* The libraries of the cached files are only known until the cache is freed */
+		if ((watching = !ret && mode == RUN_WATCH) && watch_init(&watch, &pool, abc, names, count)) ret = 1;
+		/* A stopped check leaves files unchecked, the previous cache stays then, and
+		 * a check of a few packages keeps the verdicts of the others */
+		if (use_cache) {
+			stats_phase_begin(&abc->stats, "cache save");
+			if (!pool.stop) scan_cache_save(&cache, &resolver, pool.files, pool.files_count, !all || affected);
+		}
+		stats_phase_end(&abc->stats);
+		if (abc->flags & AURBROKENPKGCHECK_STATS) stats_print(&pool);
+		if (abc->trace) stats_trace_write(abc->trace, &pool);
+		abc->reported = 1;
+		/* The packages found broken past the limit were not reported */
+		if (broken) *broken = pool.limit && pool.broken > pool.limit ? pool.limit : pool.broken;
+	}
+	if (use_cache) scan_cache_free(&cache);
+	check_pool_free(&pool);
+	/* The next passes start from scratch, the cache is not up to date anymore */
+	ctx.cache = NULL;
+	while (watching && !ret && !(ret = watch_wait(&watch))) ret = watch_pass(&watch, &ctx, &selected, &count);
+	if (watching) watch_free(&watch);
+	hashmap_free(&removed, free);
+	soname_index_free(&sonames);
+	free(affected);
+	resolver_free(&resolver);
+	close(ctx.root_fd);
+	free(selected);
+	return ret;
+}
+
+alpm_handle_t *aurbrokenpkgcheck_initialize(const char *config, const char *root_path, const char *db_path) {
+	struct pacman_config_t conf;
+	alpm_handle_t *handle;
+	alpm_errno_t err;
+	handle = NULL;
+	if (!pacman_config_init(&conf, config ? config : PACMAN_CONF, root_path, db_path, NULL)) {
+		if ((handle = alpm_initialize(conf.root_path, conf.db_path, &err))) sync_dbs_register(handle, &conf);
+		else fprintf(stderr, "%s\n", alpm_strerror(err));
+	}
+	pacman_config_free(&conf);
+	return handle;
+}
+
+struct aurbrokenpkgcheck_t *aurbrokenpkgcheck_new(alpm_handle_t *handle, size_t jobs, int flags) {
+	struct aurbrokenpkgcheck_t *abc;
+	long online;
+	if (!(abc = calloc(1, sizeof(struct aurbrokenpkgcheck_t)))) {
+		error_handler("calloc()");
+		return NULL;
+	}
+	abc->handle = handle;
+	if (handle) abc->root_path = alpm_option_get_root(handle);
+	online = sysconf(_SC_NPROCESSORS_ONLN);
+	abc->jobs = jobs ? jobs : online > 0 ? (size_t)online : 1;
+	abc->flags = flags;
+	abc->format = FORMAT_TREE;
+	if ((abc->stats.enabled = flags & AURBROKENPKGCHECK_STATS)) abc->stats.origin = stats_now();
+	/* Before any worker or loader is started, they inherit the IO priority */
+	if (flags & AURBROKENPKGCHECK_LOW_IMPACT) low_impact_init(&abc->low_impact);
+	if (flags & AURBROKENPKGCHECK_VERIFY_WITH_LD) ld_bin_finder_init(&abc->finder);
+	/* The same libraries are usually found in every root, they are only parsed once */
+	elf_store_init(&abc->store, &abc->stats, &abc->low_impact);
+	pthread_mutex_init(&abc->lock, NULL);
+	if ((abc->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) error_handler("eventfd()");
+	return abc;
+}
+
+void aurbrokenpkgcheck_free(struct aurbrokenpkgcheck_t *abc) {
+	if (!abc) return;
+	context_release(abc);
+	pacman_config_free(&abc->conf);
+	hashmap_free(&abc->targets, NULL);
+	free(abc->trace);
+	if (abc->low_impact.enabled) pthread_mutex_destroy(&abc->low_impact.lock);
+	if (abc->flags & AURBROKENPKGCHECK_VERIFY_WITH_LD) ld_bin_finder_free(&abc->finder);
+	elf_store_free(&abc->store);
+	pthread_mutex_destroy(&abc->lock);
+	if (abc->wake >= 0) close(abc->wake);
+	free(abc);
+}
+
+int aurbrokenpkgcheck_open(struct aurbrokenpkgcheck_t *abc, const char *config, const char *root_path, const char *db_path) {
+	context_release(abc);
+	abc->root_path = NULL;
+	/* Every root gets its own statistics */
+	stats_reset(&abc->stats);
+	abc->reported = 0;
+	/* The paths and the repositories come from the pacman configuration */
+	stats_phase_begin(&abc->stats, "pacman.conf");
+	pacman_config_free(&abc->conf);
+	if (pacman_config_init(&abc->conf, config ? config : PACMAN_CONF, root_path, db_path, &abc->stats)) {
+		pacman_config_free(&abc->conf);
+		memset(&abc->conf, 0, sizeof(struct pacman_config_t));
+		return 1;
+	}
+	abc->root_path = abc->conf.root_path;
+	return context_open(abc);
+}
+
+int aurbrokenpkgcheck_paths(const struct aurbrokenpkgcheck_t *abc, const char **root_path, const char **db_path) {
+	if (!abc->root_path) return 1;
+	*root_path = abc->conf.root_path;
+	*db_path = abc->conf.db_path;
+	return 0;
+}
+
+void aurbrokenpkgcheck_select(struct aurbrokenpkgcheck_t *abc, const struct aurbrokenpkgcheck_filter_t *filter) {
+	abc->filter = filter;
+}
+
+int aurbrokenpkgcheck_targets(struct aurbrokenpkgcheck_t *abc, const char *const *targets, size_t count) {
+	size_t i;
+	int inserted;
+	hashmap_free(&abc->targets, NULL);
+	memset(&abc->targets, 0, sizeof(struct hashmap_t));
+	abc->use_targets = targets != NULL;
+	for (i = 0; i < count; ++i) {
+		if (!hashmap_put(&abc->targets, targets[i], &inserted)) return 1;
+	}
+	return 0;
+}
+
+void aurbrokenpkgcheck_limit(struct aurbrokenpkgcheck_t *abc, size_t limit) {
+	abc->limit = limit;
+}
+
+void aurbrokenpkgcheck_report(struct aurbrokenpkgcheck_t *abc, int format, int colors, int label) {
+	abc->format = format;
+	abc->colors = colors;
+	abc->label = label;
+}
+
+int aurbrokenpkgcheck_trace(struct aurbrokenpkgcheck_t *abc, const char *filename) {
+	free(abc->trace);
+	if (!(abc->trace = strdup(filename))) return error_handler("strdup()");
+	/* The trace needs the counters from now on */
+	if (!abc->stats.enabled) {
+		abc->stats.enabled = 1;
+		stats_reset(&abc->stats);
+	}
+	return 0;
+}
+
+int aurbrokenpkgcheck_foreign(struct aurbrokenpkgcheck_t *abc, const char ***names, size_t *count) {
+	alpm_db_t *db_local;
+	if (!(db_local = alpm_get_localdb(abc->handle))) {
+		fprintf(stderr, "%s\n", alpm_strerror(alpm_errno(abc->handle)));
+		return 1;
+	}
+	return foreign_packages(abc->handle, db_local, NULL, names, count);
+}
+
+int aurbrokenpkgcheck_packages(struct aurbrokenpkgcheck_t *abc, const char ***names, size_t *count) {
+	alpm_db_t *db_local;
+	if (!(db_local = alpm_get_localdb(abc->handle))) {
+		fprintf(stderr, "%s\n", alpm_strerror(alpm_errno(abc->handle)));
+		return 1;
+	}
+	return foreign_packages(abc->handle, db_local, abc->filter, names, count);
+}
+
+int aurbrokenpkgcheck_check(
+	struct aurbrokenpkgcheck_t *abc,
+	const char *const *names,
+	size_t count,
+	aurbrokenpkgcheck_callback_t callback,
+	void *data,
+	size_t *broken) {
+	return check_run(abc, names, count, callback, data, broken, RUN_CHECK);
+}
+
+int aurbrokenpkgcheck_predict(struct aurbrokenpkgcheck_t *abc, size_t *broken) {
+	return check_run(abc, NULL, 0, NULL, NULL, broken, RUN_PREDICT);
+}
+
+int aurbrokenpkgcheck_watch(struct aurbrokenpkgcheck_t *abc, aurbrokenpkgcheck_callback_t callback, void *data) {
+	/* Every pass opens the root again */
+	if (!abc->owned) {
+		fprintf(stderr, "Watching needs a root opened by aurbrokenpkgcheck_open()\n");
+		return 1;
+	}
+	return check_run(abc, NULL, 0, callback, data, NULL, RUN_WATCH);
+}
+
+void aurbrokenpkgcheck_cancel(struct aurbrokenpkgcheck_t *abc) {
+	uint64_t wake = 1;
+	pthread_mutex_lock(&abc->lock);
+	abc->canceled = 1;
+	if (abc->pool) {
+		pthread_mutex_lock(&abc->pool->lock);
+		check_pool_stop(abc->pool);
+		pthread_mutex_unlock(&abc->pool->lock);
+	}
+	/* A watch waiting for changes has no pool */
+	if (abc->wake >= 0 && write(abc->wake, &wake, sizeof(wake)) < 0) error_handler("write()");
+	pthread_mutex_unlock(&abc->lock);
+}